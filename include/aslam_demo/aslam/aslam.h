@@ -110,7 +110,7 @@ public:
 
   visualization_msgs::MarkerArray marker_array_;
   //All interface stuff
-  void updateFromProbMap(mapping::ProbabilityMap& probability_map,gtsam::Pose2 current_pose);
+  void updateFromProbMap(const mapping::ProbabilityMap& probability_map,gtsam::Pose2 current_pose);
   void updateFromOccMap(nav_msgs::OccupancyGrid& occupancy_grid,gtsam::Pose2 current_pose);
   void fromTftoGtsamPose(gtsam::Pose3 &pose3, const tf::Transform &transform);
   void fromGtsamPose2toROS(gtsam::Pose2& pose2,geometry_msgs::Pose& pose);
@@ -16,13 +16,24 @@
 
 #include <aslam_demo/mapping/map_processing.h>
 #include <aslam_demo/mapping/probability_map.h>
+#include <aslam_demo/mapping/submaps.h>
+#include <aslam_demo/mapping/timer.h>
+#include <aslam_demo/mapping/bounded_queue.h>
 #include <aslam_demo/factors/key_generator.h>
 #include <aslam_demo/factors/laser_scan_factor.h>
 
 #include <aslam_demo/mapping/csm_processing.h>
+#include <aslam_demo/mapping/scan_matcher.h>
+#include <aslam_demo/mapping/scan_match_cache.h>
+#include <aslam_demo/mapping/correlative_scan_matcher.h>
+#include <aslam_demo/mapping/scan_to_map_matcher.h>
+#include <aslam_demo/mapping/feature_scan_matcher.h>
 #include <aslam_demo/mapping/optimization_processing.h>
+#include <aslam_demo/mapping/graph_manager.h>
+#include <aslam_demo/mapping/graph_reduction.h>
 #include <aslam_demo/mapping/laserscan_processing.h>
 #include <aslam_demo/mapping/odometry_processing.h>
+#include <aslam_demo/mapping/time_series.h>
 
 #include <aslam_demo/aslam/aslam.h>
 
@@ -32,6 +43,7 @@
 #include <gtsam/nonlinear/NonlinearFactorGraph.h>
 #include <gtsam/nonlinear/Values.h>
 #include <gtsam/nonlinear/Symbol.h>
+#include <gtsam/slam/PriorFactor.h>
 #include <gtsam/geometry/Pose2.h>
 #include <gtsam/geometry/Pose3.h>
 #include <gtsam/geometry/Rot2.h>
@@ -54,6 +66,7 @@
 #include <atomic>
 #include <mutex>
 #include <condition_variable>
+#include <set>
 
 #include <kdtree++/kdtree.hpp>
 
@@ -110,6 +123,10 @@ private:
 	    key_ = A.key_;
 	  }
 
+	  bool operator==(poseNode const& A) const {
+	    return key_ == A.key_ && d[0] == A.d[0] && d[1] == A.d[1] && d[2] == A.d[2];
+	  }
+
 	  inline value_type operator[](size_t const N) const { return d[N]; }
     value_type d[3];
 	  gtsam::Key key_;
@@ -121,9 +138,21 @@ private:
 	double angledist(double a1,double a2) { return(M_PI - fabs(fabs(a1 - a2)) - M_PI); }
 	typedef KDTree::KDTree<2, poseNode, std::pointer_to_binary_function<poseNode,size_t,double> > tree_type;
   tree_type pose_tree_;
+  std::map<gtsam::Key,poseNode> kdtree_nodes_; ///< The node of every pose in pose_tree_, so each pose is inserted once
+  mapping::csm::ScanMatchCache loop_closure_cache_; ///< Outcomes of previously verified loop closure candidates
+  std::map<ros::Time,mapping::features::ScanFeatures> keyframe_features_; ///< Features of the keyframes compared for loop closures, by scan timestamp
+  gtsam::Key loop_closure_queried_key_ = 0; ///< Newest pose searched for loop closures; keys grow with time, so later keys are the new poses
   void updateKDTree(const gtsam::Values& );
   void searchForLoopClosure(gtsam::NonlinearFactorGraph& ,gtsam::Values& );
-  void doScanMatch(sensor_msgs::LaserScan&,sensor_msgs::LaserScan&,mapping::RelativePoseEstimates& );
+  void doScanMatch(const sensor_msgs::LaserScan&,const sensor_msgs::LaserScan&,mapping::RelativePoseEstimates& );
+  bool doScanToMapMatch(const sensor_msgs::LaserScan&,const sensor_msgs::LaserScan&,mapping::RelativePoseEstimates& );
+  bool doFeatureMatch(const sensor_msgs::LaserScan&,const sensor_msgs::LaserScan&,mapping::RelativePoseEstimates& );
+  gtsam::Pose2 computeOdomGuess(const ros::Time&,const ros::Time&);
+  /**
+   * The odometry motion between two times, only if both lie inside the odometry buffer
+   * @return False if the motion is unknown
+   */
+  bool computeOdomMotion(const ros::Time&,const ros::Time&,gtsam::Pose2&);
   bool tflistflag_ = false;
   std::shared_ptr<aslam::AslamBase> aslam_;
 	ros::NodeHandle n_;
@@ -139,6 +168,8 @@ private:
 	nav_msgs::Odometry odometry_;
 	nav_msgs::OccupancyGrid current_map_,current_map_publishable_;
   mapping::ProbabilityMap prob_map_;
+  mapping::submaps::SubmapCollection submaps_; ///< Keyframe submaps composed into prob_map_
+  bool use_submaps_ = true; ///< Compose the map from submaps instead of inserting every scan into prob_map_
   gtsam::Pose2 current_pose_;
 
   int missing_scan_counter_ = 0;
@@ -162,25 +193,90 @@ private:
 	nav_msgs::GetMap srv_map_;
 	gazebo_msgs::GetModelState model_state_srv_;
 
-  mapping::LaserScans laserscans_;
-  mapping::Odometry odomreadings_;
-  mapping::Odometry trueodomreadings_;
+  mapping::LaserScans laserscans_; ///< Keyframe scans only, selected by keyframe_selector_
+  sensor_msgs::LaserScan::ConstPtr previous_scan_; ///< Reference of the front end: the last matched scan, or the current keyframe in ScanToKeyframe mode
+  mapping::laserscan::KeyframeSelector keyframe_selector_;
+  mapping::laserscan::ScanFilterChain scan_filter_chain_; ///< Preprocessing applied by the match stage, configured by ~scan_filter_config
+  std::vector<sensor_msgs::LaserScan::Ptr> filtered_scans_; ///< Reused buffers for the filtered scans, only touched by the match thread
+  mapping::TimeSeries<nav_msgs::Odometry> odomreadings_; ///< The last minute of /odom
+  mapping::TimeSeries<nav_msgs::Odometry> trueodomreadings_; ///< The last minute of ground truth; /gazebo/model_states arrives at about 1 kHz
+  mapping::odometry::OdometryPreintegrator odom_preintegrator_; ///< Odometry factors between matched scans, fed with trueodomreadings_
 
   mapping::RelativePoseEstimates laser_poses_;
+  size_t processed_matches_ = 0; ///< Matches consumed by slam(); the matches themselves are not kept
   mapping::RelativePoseEstimates laser_pose_cache_;
 
   factors::KeyGenerator key_generator_;
+  std::shared_ptr<mapping::csm::ScanMatcher> scan_matcher_; ///< Front-end scan matcher
+  std::shared_ptr<mapping::csm::ScanMatcher> loop_closure_scan_matcher_; ///< ICP refinement of loop closures, used by the factor thread only
+  mapping::correlative::CorrelativeScanMatcher loop_closure_matcher_; ///< Initial alignment of loop closure candidates, before ICP
+  mapping::scan_to_map::ScanToMapMatcher scan_to_map_matcher_; ///< Front-end matcher against the latest map, used when front_end_ is ScanToMap
+  std::shared_ptr<const mapping::ProbabilityMap> front_end_map_; ///< The map snapshot scan_to_map_matcher_ was built from
+  gtsam::Pose2 front_end_pose_; ///< Pose of previous_scan_ in the map frame, integrated from the front-end matches
+  std::shared_ptr<const std::pair<ros::Time,gtsam::Pose2> > front_end_anchor_; ///< Latest optimized pose and its timestamp, accessed with std::atomic_load/store
+  double scan_to_map_max_deviation_ = .5; ///< Scan-to-map matches further than this from the odometry guess are rejected
+  mapping::features::FeatureScanMatcher feature_matcher_; ///< Front-end line and corner matcher, used when front_end_ is Features
+  mapping::features::ScanFeatures previous_features_; ///< Features of previous_scan_ in Features mode
+
+  /**
+   * How consecutive scans are matched
+   */
+  enum FrontEnd {
+    ScanToScan, ///< PL-ICP against the previous scan
+    ScanToMap, ///< Gauss-Newton against the latest map, falling back to ScanToScan until a map exists or when the match fails
+    ScanToKeyframe, ///< PL-ICP against the reference keyframe, only once the odometry has moved keyframe_distance_ or keyframe_rotation_ from it
+    Features ///< Line and corner matching against the previous scan, falling back to ScanToScan when too few features correspond
+  };
+  FrontEnd front_end_ = ScanToScan;
+  double stationary_distance_ = .01; ///< Scans with less odometry motion since the reference are skipped in every mode
+  double stationary_rotation_ = .01;
+  double keyframe_distance_ = .3; ///< Odometry motion that promotes a new reference keyframe in ScanToKeyframe mode
+  double keyframe_rotation_ = .25;
+  std::atomic<size_t> skipped_scans_{0}; ///< Scans dropped by the stationary and keyframe checks
+  std::shared_ptr<mapping::csm::ScanMatchRecorder> csm_recorder_; ///< Optional scan match debug log, enabled by ~csm_debug_log
 
   const double time_tolerance;
   bool map_initialized_ = false;
 
-  gtsam::NonlinearFactorGraph factor_graph_;
-  gtsam::Values initial_guess_,pose_estimates_; //@todo:initial_guess
-  mapping::optimization::Covariances pose_with_cov_;
+  mapping::optimization::GraphManager graph_manager_; ///< Every factor and the latest estimate of every pose, across all cycles
+  gtsam::Values initial_guess_,pose_estimates_; ///< pose_estimates_ accumulates the latest optimized value of every pose
+  mapping::optimization::Covariances pose_with_cov_; ///< Covariance of the latest pose, refreshed every cycle
+  mapping::optimization::CovarianceMode covariance_mode_ = mapping::optimization::ExactCovariance; ///< Selected by ~covariance_mode
+  double loop_closure_radius_ = 1.0; ///< Loop closure search radius for a certain pose, in meters
+  double loop_closure_max_radius_ = 5.0; ///< The search radius grows with three sigma of the latest position, up to this
   gtsam::LevenbergMarquardtParams parameters_; //@todo:parameters
+  mapping::optimization::OrderingCache ordering_cache_; ///< Elimination ordering of graph_manager_ kept between Batch optimizations
+
+  /**
+   * How the batches of 40 matches are optimized
+   */
+  enum Backend {
+    Batch, ///< Levenberg-Marquardt on the full graph, from scratch
+    Incremental, ///< iSAM2 over the whole trajectory, relinearizing only the affected part of the Bayes tree
+    FixedLag ///< Levenberg-Marquardt over the last ~smoother_lag seconds, older poses marginalized
+  };
+  Backend back_end_ = Incremental;
+  mapping::optimization::IncrementalOptimizer incremental_optimizer_;
+  mapping::optimization::FixedLagSmoother fixed_lag_smoother_;
+  mapping::optimization::PoseGraphReducer graph_reducer_; ///< Keeps the keyframe poses of each batch, configured by ~reduction_distance, ~reduction_rotation and ~reduction_interval
+  bool reduce_graph_ = true; ///< Selected by ~reduce_graph; when false, every matched scan becomes a pose
+
+  /**
+   * Optimize the factors added to graph_manager_ since the last call with the selected back end
+   * @return The new estimates; all poses for Batch and Incremental, the window for FixedLag
+   */
+  gtsam::Values optimizeGraph(size_t extra_iterations);
+
+  /**
+   * Compute the covariances of the requested poses with the selected back end, reusing its factorization
+   */
+  mapping::optimization::Covariances computePoseCovariances(const std::set<gtsam::Key>& keys) const;
 
   gtsam::Pose2 getRelativeOdom(nav_msgs::Odometry &,nav_msgs::Odometry &);
-  nav_msgs::Odometry getCorrespondingOdom(const ros::Time &,mapping::Odometry&);
+  /**
+   * The odometry message closest in time, or NULL if none has arrived yet. The caller holds odom_mutex_.
+   */
+  const nav_msgs::Odometry* getCorrespondingOdom(const ros::Time &,const mapping::TimeSeries<nav_msgs::Odometry>&) const;
   nav_msgs::OccupancyGrid fromGtsamMatrixToROS(gtsam::Matrix &);
 
   void createZeroInitialGuess();
@@ -196,6 +292,13 @@ public:
 	std::atomic<bool> isactive_laser_factor_thread_,isactive_slam_thread_,isactive_navigation_thread_;
 
 	void scanCallback (const sensor_msgs::LaserScan::ConstPtr&);
+	void storeKeyframe (const sensor_msgs::LaserScan::ConstPtr&);
+	/**
+	 * Copy the keyframe scans of the given poses out of laserscans_, skipping poses already fused into a submap
+	 */
+	void copyKeyframeScans(const gtsam::Values& poses,mapping::LaserScans& scans);
+	void matchStage();
+	void factorStage();
 	void odomCallback (const nav_msgs::Odometry::ConstPtr&);
 	void slam(ros::Time& time);
 	void getMapCallback (nav_msgs::GetMap::Request &req, nav_msgs::GetMap::Response &res);
@@ -204,7 +307,8 @@ public:
 	void createLaserFactors();
 	void slamHandler();
 	void navigationHandler();
-	void doAslamStuff(mapping::ProbabilityMap& map);
+	void doAslamStuff(const mapping::ProbabilityMap& map);
+	void mapBuilder();
 	void tfInit();
 
   void fromTftoGtsamPose(gtsam::Pose3 &, const tf::Transform &);
@@ -215,6 +319,24 @@ public:
 	std::mutex slam_mutex;
 	std::condition_variable slam_cv;
 
+	std::mutex scans_mutex_; ///< Guards laserscans_ against the map builder thread
+	std::mutex map_mutex_; ///< Guards the pending map building job
+	std::condition_variable map_cv_;
+	gtsam::Values map_job_; ///< Pose estimates not yet inserted into the map, coalesced across slam() cycles
+	bool map_job_pending_ = false;
+	std::atomic<bool> isactive_map_thread_;
+	std::thread map_thread_; ///< Builds prob_map_ (the back buffer) and swaps finished snapshots into front_map_
+	std::shared_ptr<const mapping::ProbabilityMap> front_map_; ///< Latest finished map, accessed with std::atomic_load/store
+	std::shared_ptr<const nav_msgs::OccupancyGrid> front_grid_; ///< Publishable version of front_map_, accessed with std::atomic_load/store
+
+
+	typedef mapping::BoundedQueue<sensor_msgs::LaserScan::ConstPtr> ScanQueue;
+	typedef mapping::BoundedQueue<mapping::RelativePoseEstimate> MatchQueue;
+	ScanQueue scan_queue_; ///< Scans from the callback to the match stage. Keeps the newest scans under load.
+	MatchQueue match_queue_; ///< Scan matches from the match stage to the factor stage. Never drops, so the odometry chain stays connected.
+	std::mutex odom_mutex_; ///< Guards odomreadings_, trueodomreadings_ and odom_preintegrator_ against the pipeline threads
+	std::thread match_thread_; ///< Odometry lookup and scan matching
+	std::thread factor_thread_; ///< Factor creation and optimization
 
 	std::thread laser_factor_thread_;
 	std::thread slam_thread_;
@@ -0,0 +1,134 @@
+/**
+ * bounded_queue.h
+ */
+
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace mapping {
+
+/**
+ * A fixed-capacity queue connecting two pipeline stages. The overflow policy decides what
+ * happens when a producer outruns its consumer, so the latency through the queue stays bounded.
+ */
+template<typename T>
+class BoundedQueue {
+public:
+
+  /**
+   * What push() does when the queue is full
+   */
+  enum Policy {
+    DropOldest, ///< Discard the oldest queued item to make room
+    DropNewest, ///< Discard the pushed item
+    Block ///< Wait until the consumer makes room
+  };
+
+  /**
+   * Queue statistics since construction
+   */
+  struct Metrics {
+    size_t depth; ///< Current number of queued items
+    size_t high_water_mark; ///< Largest depth observed
+    size_t pushed; ///< Items accepted by push()
+    size_t popped; ///< Items handed to the consumer
+    size_t dropped; ///< Items discarded by the overflow policy
+  };
+
+  /**
+   * Constructor
+   * @param capacity The maximum number of queued items (at least 1)
+   * @param policy The overflow policy
+   */
+  BoundedQueue(size_t capacity, Policy policy) :
+    capacity_(std::max<size_t>(capacity, 1)), policy_(policy), closed_(false) {
+    metrics_.depth = 0;
+    metrics_.high_water_mark = 0;
+    metrics_.pushed = 0;
+    metrics_.popped = 0;
+    metrics_.dropped = 0;
+  }
+
+  /**
+   * Add an item, applying the overflow policy if the queue is full
+   * @return False if the item was dropped or the queue is closed
+   */
+  bool push(const T& item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if(policy_ == Block) {
+      not_full_.wait(lock, [&](){ return items_.size() < capacity_ || closed_; });
+    }
+    if(closed_) return false;
+
+    if(items_.size() >= capacity_) {
+      ++metrics_.dropped;
+      if(policy_ == DropNewest) return false;
+      items_.pop_front();
+    }
+
+    items_.push_back(item);
+    ++metrics_.pushed;
+    metrics_.depth = items_.size();
+    metrics_.high_water_mark = std::max(metrics_.high_water_mark, metrics_.depth);
+    lock.unlock();
+    not_empty_.notify_one();
+    return true;
+  }
+
+  /**
+   * Remove the oldest item, waiting until one is available
+   * @return False if the queue was closed and is empty
+   */
+  bool pop(T& item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [&](){ return !items_.empty() || closed_; });
+    if(items_.empty()) return false;
+
+    item = items_.front();
+    items_.pop_front();
+    ++metrics_.popped;
+    metrics_.depth = items_.size();
+    lock.unlock();
+    not_full_.notify_one();
+    return true;
+  }
+
+  /**
+   * Wake up all waiting producers and consumers. Queued items can still be popped.
+   */
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+  /**
+   * Return a snapshot of the queue statistics
+   */
+  Metrics metrics() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return metrics_;
+  }
+
+protected:
+  size_t capacity_;
+  Policy policy_;
+  bool closed_;
+  std::deque<T> items_;
+  Metrics metrics_;
+  mutable std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+};
+
+} // namespace mapping
+
+#endif // BOUNDED_QUEUE_H
@@ -0,0 +1,122 @@
+/**
+ * correlative_scan_matcher.h
+ */
+
+#ifndef CORRELATIVE_SCAN_MATCHER_H
+#define CORRELATIVE_SCAN_MATCHER_H
+
+#include <sensor_msgs/LaserScan.h>
+#include <gtsam/geometry/Point2.h>
+#include <gtsam/geometry/Pose2.h>
+#include <gtsam/geometry/Pose3.h>
+#include <vector>
+
+namespace mapping {
+
+namespace correlative {
+
+/**
+ * Convert the valid returns of a laser scan into points in the robot/base frame
+ * @param scan The laser scan
+ * @param base_T_laser The pose (3D) of the laser in the robot/base frame
+ * @return The scan endpoints in the base frame
+ */
+std::vector<gtsam::Point2> scanToPoints(const sensor_msgs::LaserScan& scan, const gtsam::Pose3& base_T_laser = gtsam::Pose3::identity());
+
+/**
+ * An exhaustive search over a window of (x, y, theta) around an initial guess, made fast by
+ * branch-and-bound over a stack of precomputed max-pooled grids (Olson 2009, Hess et al. 2016).
+ * The reference scan is rendered into a smoothed lookup grid; level h of the stack holds the
+ * maximum of the lookup grid over a 2^h x 2^h block, so the score of a block of translations
+ * at level h is an upper bound of the score of every translation in it. The result is a good
+ * initial guess for ICP even when the guess error is far larger than ICP's convergence basin.
+ */
+class CorrelativeScanMatcher {
+public:
+
+  /**
+   * Constructor
+   * @param resolution The lookup grid cell size and translation search step in meters
+   * @param linear_window The translation search half-width in meters
+   * @param angular_window The rotation search half-width in radians
+   * @param depth The number of precomputed grid levels (the coarsest level pools 2^(depth-1) cells)
+   * @param min_score Matches whose mean lookup score is below this value are rejected, in [0, 1]
+   * @param base_T_laser The pose (3D) of the laser in the robot/base frame
+   */
+  CorrelativeScanMatcher(double resolution = 0.05, double linear_window = 1.0, double angular_window = 0.5,
+      size_t depth = 6, double min_score = 0.55, const gtsam::Pose3& base_T_laser = gtsam::Pose3::identity());
+
+  /**
+   * Find the relative pose of scan with respect to reference within the search window
+   * @param reference The reference laser scan (timestamp1)
+   * @param scan The laser scan to align (timestamp2)
+   * @param initial_guess The center of the search window, the relative pose from timestamp1 to timestamp2
+   * @param relative_pose [output] The best relative pose found
+   * @param score [output] The mean lookup score of the best pose, in [0, 1]
+   * @return True if a pose with a score of at least min_score was found
+   */
+  bool match(const sensor_msgs::LaserScan& reference, const sensor_msgs::LaserScan& scan,
+      const gtsam::Pose2& initial_guess, gtsam::Pose2& relative_pose, double& score) const;
+
+protected:
+
+  /**
+   * The lookup grid of the reference scan and its max-pooled levels
+   */
+  struct PrecomputationGrids {
+    int x_min; ///< Cell index of the first column
+    int y_min; ///< Cell index of the first row
+    int width;
+    int height;
+    std::vector<std::vector<float> > levels; ///< levels[h](x,y) = max of levels[0] over [x, x+2^h) x [y, y+2^h)
+
+    float value(size_t level, int x, int y) const {
+      x -= x_min;
+      y -= y_min;
+      if(x < 0 || y < 0 || x >= width || y >= height) return 0.0f;
+      return levels[level][y*width + x];
+    }
+  };
+
+  /**
+   * A set of translations at one rotation: (x_offset, y_offset) is the lowest corner of a
+   * 2^level x 2^level block of cell offsets
+   */
+  struct Candidate {
+    size_t rotation;
+    int x_offset;
+    int y_offset;
+    double score;
+    bool operator>(const Candidate& other) const { return score > other.score; }
+  };
+
+  /**
+   * Render the reference points into the lookup grid and build the pooled levels
+   */
+  PrecomputationGrids computeGrids(const std::vector<gtsam::Point2>& points) const;
+
+  /**
+   * Score a candidate against one grid level
+   */
+  double scoreCandidate(const PrecomputationGrids& grids, size_t level, const std::vector<std::pair<int,int> >& cells, int x_offset, int y_offset) const;
+
+  /**
+   * Recursively split the candidates, pruning every block whose bound cannot beat the best score
+   */
+  void branchAndBound(const PrecomputationGrids& grids, const std::vector<std::vector<std::pair<int,int> > >& rotated_cells,
+      std::vector<Candidate>& candidates, size_t level, int window, Candidate& best) const;
+
+  double resolution_;
+  double linear_window_;
+  double angular_window_;
+  size_t depth_;
+  double min_score_;
+  gtsam::Pose3 base_T_laser_;
+  double sigma_; ///< Smoothing of the lookup grid in meters
+};
+
+} // namespace correlative
+
+} // namespace mapping
+
+#endif // CORRELATIVE_SCAN_MATCHER_H
@@ -7,17 +7,58 @@
 
 #include <aslam_demo/mapping/laserscan_processing.h>
 #include <aslam_demo/mapping/mapping_common.h>
+#include <aslam_demo/mapping/scan_match_recorder.h>
 #include <csm/csm.h>
 #include <ros/ros.h>
 #include <gtsam/geometry/Pose3.h>
 #include <string>
 #include <fstream>
 #include <limits.h>
+#include <limits>
+#include <mutex>
 
 namespace mapping {
 
 namespace csm {
 
+/**
+ * Set the CSM parameters used by this package for laserscan matching
+ * @param csm_params The parameter structure to configure
+ */
+void setDefaultParameters(struct sm_params& csm_params);
+
+/**
+ * How the covariance of a scan match is estimated
+ */
+enum CovarianceMode {
+  FullCovariance, ///< CSM's exact covariance (Censi 2007). The most expensive part of a match after the ICP iterations.
+  HessianCovariance, ///< The inverse point-to-line Hessian at the final correspondences, scaled by the residual variance
+  FixedShapeCovariance ///< The closed-form Hessian of an isotropic scene with the same number and spread of points, scaled by the residual variance
+};
+
+/**
+ * Configure the CSM parameters for a covariance mode. Only FullCovariance lets CSM compute its covariance.
+ * @param csm_params The parameter structure to configure
+ * @param mode The covariance mode
+ */
+void setCovarianceMode(struct sm_params& csm_params, CovarianceMode mode);
+
+/**
+ * Compute the covariance of a finished sm_icp call, in the laser frame. The laser data in the
+ * parameters must not have been released yet. For FullCovariance, the covariance matrices in the
+ * result are released.
+ * @param csm_params The parameters of the sm_icp call, including its laser data
+ * @param output The result of the sm_icp call
+ * @param mode The covariance mode the parameters were configured with
+ * @return The 3x3 covariance of the match
+ */
+gtsam::Matrix computeMatchCovariance(const struct sm_params& csm_params, sm_result& output, CovarianceMode mode);
+
+/**
+ * The lock held around every sm_icp call. CSM keeps its egsl matrix contexts in a global stack,
+ * so concurrent sm_icp calls are not safe even on separate sm_params.
+ */
+std::mutex& icpMutex();
 
 /**
  * Use the CSM library to compute relative poses between scans
@@ -29,7 +70,9 @@ namespace csm {
  * @param laser_sigma An optional measurement error estimate for the laser data
  * @param covariance_trace_threshold An outlier detection threshold. All matches that have a covaraince trace larger than this threshold will report as failed.
  * @param initial_guess_error_threshold An outlier detection threshold. All matches with a euclidean distance between the initial guess and the final match greater than the threshold will report as failed.
- * @param csm_filename An optional filename. When provided, a CSM log file will be generated.
+ * @param csm_filename An optional filename. When provided, a CSM log file will be written synchronously.
+ * @param recorder An optional asynchronous recorder. When provided, the match inputs are queued for binary logging. Failed matches are always recorded.
+ * @param covariance_mode How the covariance of the match is estimated
  * @return The relative pose and covariance based on laser scan matching
  */
 RelativePoseEstimate computeLaserScanMatch(const sensor_msgs::LaserScan& scan1,
@@ -40,7 +83,9 @@ RelativePoseEstimate computeLaserScanMatch(const sensor_msgs::LaserScan& scan1,
     double laserscan_sigma = 0.05,
     double covariance_trace_threshold = 10000000000000000,
     double initial_guess_error_threshold = 100000000000000000,
-    const std::string& csm_filename = "");
+    const std::string& csm_filename = "",
+    ScanMatchRecorder* recorder = NULL,
+    CovarianceMode covariance_mode = FullCovariance);
 
 /**
  * Use the CSM library to compute relative poses between scans
@@ -111,26 +156,41 @@ RelativePoseEstimate computeLaserScanMatch(const sensor_msgs::LaserScan& scan1,
     const std::string& debug_log_path = "",
     bool use_map_frame = false);*/
 
-///**
-// *
-// * @param relative_pose
-// * @param scan1
-// * @param scan2
-// * @param correspondence_distance
-// * @return
-// */
-//size_t computeScanCorrespondences(const gtsam::Pose2 relative_pose, const sensor_msgs::LaserScan& scan1, const sensor_msgs::LaserScan& scan2, double correspondence_distance);
-
-///**
-// * Filter out incorrect scan matches based on scan-to-scan point correspondences
-// * @param scans
-// * @param relative_pose_estimates
-// * @param correspondence_distance
-// * @param minimum_correspondences
-// * @param debug_log
-// * @return
-// */
-//RelativePoseEstimates filterLowOverlapMatches(const AugmentedScans& scans, const RelativePoseEstimates& relative_pose_estimates, double correspondence_distance, size_t minimum_correspondences, const std::string& debug_log = "");
+/**
+ * Count the points of scan2 that land within the correspondence distance of a point of scan1
+ * once scan2 is moved by the relative pose. The endpoints of scan1 are hashed into a bitset grid
+ * with a cell size of the correspondence distance, and each occupied cell is dilated into its
+ * eight neighbours, so every true correspondence is found with a single lookup. Points up to
+ * two cells (2*sqrt(2) correspondence distances) away may also count.
+ * @param relative_pose The pose of the robot at timestamp2 relative to timestamp1
+ * @param scan1 ROS laserscan message from timestamp1
+ * @param scan2 ROS laserscan message from timestamp2
+ * @param correspondence_distance The maximum distance between corresponding points in meters
+ * @param base_T_laser The frame transformation from the sensor frame to the robot frame
+ * @param valid_points [output] If not NULL, the number of valid returns in scan2
+ * @return The number of points of scan2 with a correspondence in scan1
+ */
+size_t computeScanCorrespondences(const gtsam::Pose2& relative_pose, const sensor_msgs::LaserScan& scan1, const sensor_msgs::LaserScan& scan2,
+    double correspondence_distance, const gtsam::Pose3& base_T_laser = gtsam::Pose3::identity(), size_t* valid_points = NULL);
+
+/**
+ * Compute the fraction of the valid returns of scan2 that have a correspondence in scan1
+ * @return The overlap in [0, 1], or 0 if scan2 has no valid returns
+ */
+double computeScanOverlap(const gtsam::Pose2& relative_pose, const sensor_msgs::LaserScan& scan1, const sensor_msgs::LaserScan& scan2,
+    double correspondence_distance, const gtsam::Pose3& base_T_laser = gtsam::Pose3::identity());
+
+/**
+ * Filter out incorrect scan matches based on scan-to-scan point correspondences
+ * @param scans The laser scans referenced by the relative pose estimates, keyed by timestamp
+ * @param relative_pose_estimates The scan matches to validate
+ * @param correspondence_distance The maximum distance between corresponding points in meters
+ * @param minimum_overlap Matches with a lower fraction of corresponding points are removed, in [0, 1]
+ * @param base_T_laser The frame transformation from the sensor frame to the robot frame
+ * @return The scan matches with enough overlap, in input order
+ */
+RelativePoseEstimates filterLowOverlapMatches(const LaserScans& scans, const RelativePoseEstimates& relative_pose_estimates, double correspondence_distance,
+    double minimum_overlap, const gtsam::Pose3& base_T_laser = gtsam::Pose3::identity());
 
 /**
  *
@@ -0,0 +1,156 @@
+/**
+ * feature_scan_matcher.h
+ */
+
+#ifndef FEATURE_SCAN_MATCHER_H
+#define FEATURE_SCAN_MATCHER_H
+
+#include <aslam_demo/mapping/mapping_common.h>
+#include <sensor_msgs/LaserScan.h>
+#include <gtsam/geometry/Point2.h>
+#include <gtsam/geometry/Pose2.h>
+#include <gtsam/geometry/Pose3.h>
+#include <vector>
+
+namespace mapping {
+
+namespace features {
+
+/**
+ * A line segment fitted to consecutive scan points
+ */
+struct LineSegment {
+  gtsam::Point2 start;
+  gtsam::Point2 end;
+  gtsam::Point2 direction; ///< Unit vector from start to end
+  gtsam::Point2 normal; ///< Unit normal, (-direction.y, direction.x)
+  double offset; ///< normal . p for every point p on the line
+  double length;
+  size_t points; ///< Number of scan points supporting the segment
+};
+
+/**
+ * The intersection of two adjacent, non-parallel line segments
+ */
+struct Corner {
+  gtsam::Point2 position;
+  double orientation; ///< Direction of the bisector between the two arms, in radians
+  double aperture; ///< Angle between the two arms, in radians
+};
+
+/**
+ * The features of one scan, in the robot/base frame
+ */
+struct ScanFeatures {
+  ros::Time timestamp;
+  std::vector<LineSegment> lines;
+  std::vector<Corner> corners;
+};
+
+/**
+ * Extract line segments from ordered points with split-and-merge. The points are first broken into
+ * clusters at range discontinuities; each cluster is split recursively at the point farthest from
+ * the chord until every piece is within split_distance of its chord, and adjacent pieces are merged
+ * back when a single line fits them both. Each piece is then fitted by total least squares.
+ * @param points The scan endpoints in scan order
+ * @param split_distance The maximum distance of a point from its segment in meters
+ * @param break_distance The minimum gap between consecutive points that starts a new cluster in meters
+ * @param min_points The minimum number of points supporting a segment
+ * @param min_length The minimum length of a segment in meters
+ * @return The line segments in scan order
+ */
+std::vector<LineSegment> extractLineSegments(const std::vector<gtsam::Point2>& points, double split_distance = 0.03,
+    double break_distance = 0.2, size_t min_points = 6, double min_length = 0.3);
+
+/**
+ * Extract corners from consecutive line segments whose endpoints are close
+ * @param lines The line segments in scan order
+ * @param max_gap The maximum distance from the intersection to either segment endpoint in meters
+ * @param min_aperture The minimum angle between the segments in radians (the maximum is pi - min_aperture)
+ * @return The corners
+ */
+std::vector<Corner> extractCorners(const std::vector<LineSegment>& lines, double max_gap = 0.3, double min_aperture = 0.5);
+
+/**
+ * Scan matching on line and corner features. Each scan is reduced to a few dozen features; pose
+ * hypotheses come from pairs of corresponding corners (one pair fixes the full pose) and the
+ * initial guess, and are scored by the length of the scan2 segments that fall onto scan1 segments
+ * (RANSAC). The best hypothesis is refined by Gauss-Newton on the endpoint-to-line distances of
+ * its inlier segments, which also provides the covariance.
+ */
+class FeatureScanMatcher {
+public:
+
+  /**
+   * Constructor
+   * @param base_T_laser The pose (3D) of the laser in the robot/base frame
+   * @param max_linear_deviation Hypotheses further than this from the initial guess are ignored, in meters
+   * @param max_angular_deviation Hypotheses rotated further than this from the initial guess are ignored, in radians
+   * @param inlier_distance The maximum distance of a segment endpoint from its corresponding line in meters
+   * @param inlier_angle The maximum angle between corresponding segments in radians
+   * @param min_inlier_length Matches where less than this length of scan2 segments has a correspondence are rejected, in meters
+   * @param max_hypotheses Above this number of corner pairs, hypotheses are sampled at random
+   * @param sigma The minimum standard deviation of the endpoint-to-line distances in meters
+   */
+  FeatureScanMatcher(const gtsam::Pose3& base_T_laser = gtsam::Pose3::identity(),
+      double max_linear_deviation = 2.0, double max_angular_deviation = 1.0,
+      double inlier_distance = 0.1, double inlier_angle = 0.1, double min_inlier_length = 2.0,
+      size_t max_hypotheses = 1000, double sigma = 0.02);
+
+  /**
+   * Extract the line and corner features of a scan in the robot/base frame
+   */
+  ScanFeatures extractFeatures(const sensor_msgs::LaserScan& scan) const;
+
+  /**
+   * Compute the relative pose between two scans
+   * @param scan1 ROS laserscan message from timestamp1
+   * @param scan2 ROS laserscan message from timestamp2
+   * @param initial_guess An initial guess of the relative pose from timestamp1 to timestamp2
+   * @return The relative pose and covariance, as computeLaserScanMatch would return it
+   */
+  RelativePoseEstimate match(const sensor_msgs::LaserScan& scan1, const sensor_msgs::LaserScan& scan2, const gtsam::Pose2& initial_guess) const;
+
+  /**
+   * Compute the relative pose between two sets of previously extracted features
+   */
+  RelativePoseEstimate match(const ScanFeatures& features1, const ScanFeatures& features2, const gtsam::Pose2& initial_guess) const;
+
+protected:
+
+  /**
+   * A scan2 segment and the scan1 segment it falls onto
+   */
+  struct Correspondence {
+    size_t line1;
+    size_t line2;
+  };
+
+  /**
+   * Score a hypothesis by the length of the scan2 segments with a corresponding scan1 segment
+   */
+  double scoreHypothesis(const ScanFeatures& features1, const ScanFeatures& features2, const gtsam::Pose2& pose,
+      std::vector<Correspondence>* correspondences = NULL) const;
+
+  /**
+   * Refine the pose on the endpoint-to-line distances of the correspondences
+   * @return False if the correspondences do not constrain all three degrees of freedom
+   */
+  bool refine(const ScanFeatures& features1, const ScanFeatures& features2, const std::vector<Correspondence>& correspondences,
+      gtsam::Pose2& pose, gtsam::Matrix& covariance) const;
+
+  gtsam::Pose3 base_T_laser_;
+  double max_linear_deviation_;
+  double max_angular_deviation_;
+  double inlier_distance_;
+  double inlier_angle_;
+  double min_inlier_length_;
+  size_t max_hypotheses_;
+  double sigma_;
+};
+
+} // namespace features
+
+} // namespace mapping
+
+#endif // FEATURE_SCAN_MATCHER_H
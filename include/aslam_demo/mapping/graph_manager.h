@@ -0,0 +1,117 @@
+/**
+ * graph_manager.h
+ */
+
+#ifndef GRAPH_MANAGER_H
+#define GRAPH_MANAGER_H
+
+#include <aslam_demo/mapping/graph_validator.h>
+#include <gtsam/nonlinear/NonlinearFactorGraph.h>
+#include <gtsam/nonlinear/Values.h>
+#include <gtsam/nonlinear/Key.h>
+#include <algorithm>
+#include <set>
+#include <utility>
+
+namespace mapping {
+
+namespace optimization {
+
+/**
+ * Owns the full factor graph and the current estimate of every variable. Factors and initial values
+ * are appended as they arrive; a key that is already known keeps its current estimate, so batches
+ * that share a boundary pose can be added as they are. The factors and variables added since the
+ * last optimization are kept as a delta, which incremental solvers consume directly.
+ */
+class GraphManager {
+public:
+
+  GraphManager();
+
+  /**
+   * Append factors to the graph and to the delta
+   */
+  void addFactors(const gtsam::NonlinearFactorGraph& factors);
+
+  /**
+   * Append loop closure factors between two variables. A factor whose variables already have a loop
+   * closure, in either direction, is dropped.
+   * @return The number of factors added
+   */
+  size_t addLoopClosures(const gtsam::NonlinearFactorGraph& factors);
+
+  /**
+   * Return true if a loop closure between the two variables has been added, in either direction
+   */
+  bool hasLoopClosure(gtsam::Key key1, gtsam::Key key2) const {
+    return loop_closures_.count(std::make_pair(std::min(key1, key2), std::max(key1, key2))) > 0;
+  }
+
+  /**
+   * Add initial values for new variables. Values of known variables are ignored.
+   * @return The number of new variables
+   */
+  size_t addValues(const gtsam::Values& values);
+
+  /**
+   * Check a batch of factors and values against the graph before adding it, see GraphValidator::check
+   */
+  bool validate(const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values) const {
+    return validator_.check(factors, values);
+  }
+
+  /**
+   * Return true if the variable has been added
+   */
+  bool exists(gtsam::Key key) const {
+    return values_.exists(key);
+  }
+
+  /**
+   * Replace the estimates of the optimized variables and clear the delta
+   * @param estimate The optimized values; variables it does not contain keep their estimate
+   */
+  void commit(const gtsam::Values& estimate);
+
+  /**
+   * The factors added since the last commit
+   */
+  const gtsam::NonlinearFactorGraph& newFactors() const {
+    return new_factors_;
+  }
+
+  /**
+   * The initial values of the variables added since the last commit
+   */
+  const gtsam::Values& newValues() const {
+    return new_values_;
+  }
+
+  /**
+   * The full factor graph
+   */
+  const gtsam::NonlinearFactorGraph& graph() const {
+    return graph_;
+  }
+
+  /**
+   * The current estimate of every variable
+   */
+  const gtsam::Values& values() const {
+    return values_;
+  }
+
+protected:
+  gtsam::NonlinearFactorGraph graph_;
+  gtsam::Values values_;
+  gtsam::NonlinearFactorGraph new_factors_;
+  gtsam::Values new_values_;
+  GraphValidator validator_; ///< Connectivity and membership of graph_ and values_, kept up to date as they grow
+  std::set<std::pair<gtsam::Key, gtsam::Key> > loop_closures_; ///< Variable pairs joined by a loop closure, smaller key first
+};
+
+} // namespace optimization
+
+} // namespace mapping
+
+#endif // GRAPH_MANAGER_H
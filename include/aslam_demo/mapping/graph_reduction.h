@@ -0,0 +1,79 @@
+/**
+ * graph_reduction.h
+ */
+
+#ifndef GRAPH_REDUCTION_H
+#define GRAPH_REDUCTION_H
+
+#include <aslam_demo/mapping/mapping_common.h>
+#include <gtsam/geometry/Pose2.h>
+
+namespace mapping {
+
+namespace optimization {
+
+/**
+ * Compose two relative pose estimates that share a pose, propagating both covariances through the
+ * composition. The estimates are assumed independent.
+ * @param estimate1 The estimate from timestamp1 to the shared pose
+ * @param estimate2 The estimate from the shared pose to timestamp2
+ * @return The estimate from estimate1.timestamp1 to estimate2.timestamp2
+ */
+RelativePoseEstimate composeRelativePoses(const RelativePoseEstimate& estimate1, const RelativePoseEstimate& estimate2);
+
+/**
+ * Pose graph reduction. The front end produces one pose per matched scan, dozens per second while
+ * moving; most of them carry no scan for the map and only chain the matches. The reducer keeps a
+ * subset of the poses (the keyframes, at least) and replaces each chain of estimates through the
+ * dropped poses by the single composed estimate between the kept poses at its ends. The graph then
+ * grows with the keyframes instead of with the scan rate.
+ */
+class PoseGraphReducer {
+public:
+
+  /**
+   * Constructor
+   * @param max_distance A pose is kept once the translation since the last kept pose exceeds this, in meters
+   * @param max_rotation A pose is kept once the rotation since the last kept pose exceeds this, in radians
+   * @param max_interval A pose is kept once the time since the last kept pose exceeds this, in seconds
+   */
+  PoseGraphReducer(double max_distance = 1.0, double max_rotation = 0.5, double max_interval = 10.0);
+
+  /**
+   * Select the poses to keep and compose the estimates through the others. A pose is kept if it is
+   * required, if no estimate leads to it (the start of a chain), or once the motion or time from the
+   * last kept pose behind it exceeds the limits.
+   * @param estimates Relative pose estimates in time order, forming chains or stars from a reference
+   * @param required The poses that must be kept, such as the keyframes and the end of the batch
+   * @param kept [output] The kept poses are added
+   * @return The composed estimates between kept poses
+   */
+  RelativePoseEstimates reduce(const RelativePoseEstimates& estimates, const Timestamps& required, Timestamps& kept) const;
+
+  /**
+   * Compose the estimates through every pose that is not in the given set, e.g. to reduce the
+   * odometry between the poses kept by reduce()
+   * @param estimates Relative pose estimates in time order
+   * @param kept The poses to keep; poses without an estimate leading to them are kept as well
+   * @return The composed estimates between kept poses
+   */
+  RelativePoseEstimates restrictTo(const RelativePoseEstimates& estimates, const Timestamps& kept) const;
+
+protected:
+
+  /**
+   * Compose every estimate onto the path from the last kept pose behind it, emitting the path when
+   * it reaches a kept pose
+   */
+  RelativePoseEstimates compose(const RelativePoseEstimates& estimates, const Timestamps& required, Timestamps& kept, bool use_limits) const;
+
+  double max_distance_;
+  double max_rotation_;
+  double max_interval_;
+};
+
+} // namespace optimization
+
+} // namespace mapping
+
+#endif // GRAPH_REDUCTION_H
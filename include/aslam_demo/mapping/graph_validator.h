@@ -0,0 +1,79 @@
+/**
+ * graph_validator.h
+ */
+
+#ifndef GRAPH_VALIDATOR_H
+#define GRAPH_VALIDATOR_H
+
+#include <gtsam/nonlinear/NonlinearFactorGraph.h>
+#include <gtsam/nonlinear/Values.h>
+#include <gtsam/nonlinear/Key.h>
+#include <gtsam/base/FastMap.h>
+#include <gtsam/base/FastSet.h>
+
+namespace mapping {
+
+namespace optimization {
+
+/**
+ * Incremental structural checks of a growing factor graph. The variables with values, the variables
+ * with factors and a union-find forest of the connected components are kept as factors and values
+ * are added, so a new batch is checked against the graph in time proportional to the batch.
+ */
+class GraphValidator {
+public:
+
+  GraphValidator();
+
+  /**
+   * Check a batch of new factors and values against the graph added so far, without adding it. Every
+   * variable of the new factors must have a value, every new value must be constrained by a factor,
+   * and all variables of the batch must be connected, through the batch or through the graph.
+   * Problems are logged as they are found.
+   * @return True if the batch passes all checks
+   */
+  bool check(const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values) const;
+
+  /**
+   * Add factors and values to the tracked structure
+   */
+  void add(const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values);
+
+  /**
+   * The number of connected components of the graph added so far
+   */
+  size_t components() const {
+    return components_;
+  }
+
+  void clear();
+
+protected:
+
+  /**
+   * Return the representative of the variable's component, compressing the path to it
+   */
+  gtsam::Key find(gtsam::Key key) const;
+
+  /**
+   * Add a variable to the forest as its own component, if it is new
+   */
+  void insert(gtsam::Key key);
+
+  /**
+   * Merge the components of two variables, attaching the smaller tree below the larger one
+   */
+  void merge(gtsam::Key key1, gtsam::Key key2);
+
+  gtsam::FastSet<gtsam::Key> value_keys_;
+  gtsam::FastSet<gtsam::Key> factor_keys_;
+  mutable gtsam::FastMap<gtsam::Key, gtsam::Key> parent_;
+  gtsam::FastMap<gtsam::Key, size_t> size_; ///< The number of variables below each root
+  size_t components_;
+};
+
+} // namespace optimization
+
+} // namespace mapping
+
+#endif // GRAPH_VALIDATOR_H
@@ -8,9 +8,13 @@
 #include <aslam_demo/mapping/mapping_common.h>
 #include <ros/ros.h>
 #include <gtsam/geometry/Pose2.h>
+#include <gtsam/geometry/Pose3.h>
 #include <gtsam/base/Matrix.h>
+#include <sensor_msgs/LaserScan.h>
 #include <string>
 #include <vector>
+#include <unordered_set>
+#include <stdint.h>
 
 namespace mapping {
 
@@ -23,11 +27,157 @@ namespace laserscan {
 LaserScans sparsifyLaserScans(const LaserScans& scans, const Poses& poses, double time_delta_threshold, double distance_delta_threshold, double rotation_delta_threshold);
 
 /**
- * Read the scan filter configuration file, parse out the YAML, and convert it to XmlRpc.
+ * Online version of sparsifyLaserScans. Each incoming scan is tested against the last keyframe;
+ * a scan becomes a keyframe when the time, translation or rotation since the last keyframe exceeds
+ * the thresholds. Optionally, a scan also becomes a keyframe when a large enough fraction of its
+ * returns fall into coarse cells not observed by any previous keyframe.
+ */
+class KeyframeSelector {
+public:
+
+  /**
+   * Constructor
+   * @param time_delta_threshold Maximum time between keyframes in seconds
+   * @param distance_delta_threshold Maximum translation between keyframes in meters
+   * @param rotation_delta_threshold Maximum rotation between keyframes in radians
+   * @param coverage_threshold Minimum fraction of returns in unobserved cells that triggers a keyframe. Zero disables the coverage test.
+   * @param coverage_cell_size The size of the coarse coverage cells in meters
+   */
+  KeyframeSelector(double time_delta_threshold = 5.0, double distance_delta_threshold = 0.2, double rotation_delta_threshold = 0.2,
+      double coverage_threshold = 0.0, double coverage_cell_size = 0.25);
+
+  /**
+   * Test whether the scan should be kept as a keyframe. Accepted keyframes become the new reference.
+   * @param timestamp The scan timestamp
+   * @param pose The (odometry) pose of the robot at the scan timestamp
+   * @param scan An optional scan used for the coverage test
+   * @param base_T_laser The pose (3D) of the laser in the robot/base frame
+   * @return True if the scan was selected as a keyframe
+   */
+  bool check(const ros::Time& timestamp, const gtsam::Pose2& pose, const sensor_msgs::LaserScan* scan = NULL, const gtsam::Pose3& base_T_laser = gtsam::Pose3::identity());
+
+  /**
+   * Forget the previous keyframe and all covered cells
+   */
+  void reset();
+
+  /**
+   * Return the number of scans tested and selected since the last reset
+   */
+  size_t tested() const { return tested_; }
+  size_t selected() const { return selected_; }
+
+protected:
+
+  /**
+   * Compute the coverage cells of the scan returns and the fraction not yet covered
+   */
+  double computeNewCoverage(const sensor_msgs::LaserScan& scan, const gtsam::Pose2& pose, const gtsam::Pose3& base_T_laser, std::vector<uint64_t>& cells) const;
+
+  double time_delta_threshold_;
+  double distance_delta_threshold_;
+  double rotation_delta_threshold_;
+  double coverage_threshold_;
+  double coverage_cell_size_;
+
+  bool has_keyframe_; ///< A previous keyframe exists
+  ros::Time keyframe_time_; ///< Timestamp of the previous keyframe
+  gtsam::Pose2 keyframe_pose_; ///< Pose of the previous keyframe
+  std::unordered_set<uint64_t> covered_cells_; ///< Coarse cells observed by the keyframes
+  size_t tested_;
+  size_t selected_;
+};
+
+/**
+ * An in-process replacement for the ROS filters::FilterChain. The filters run in order, in place,
+ * on the ranges of a scan. Removed readings are set to NaN, so the scan keeps its geometry and
+ * every consumer that checks [range_min, range_max) skips them. The scratch buffers are reused
+ * across scans, so after the first scan of a given size no memory is allocated.
+ */
+class ScanFilterChain {
+public:
+
+  /**
+   * The available filters
+   */
+  enum FilterType {
+    RangeClip, ///< Remove readings outside [min_range, max_range]
+    Median, ///< Replace each reading by the median of the valid readings in a window around it
+    Shadow, ///< Remove veiling points whose angle to a neighbour is outside [min_angle, max_angle]
+    Voxel ///< Keep only the first reading of each run of consecutive readings in the same grid cell
+  };
+
+  /**
+   * The parameters of a single filter. Only the fields of the filter type are used.
+   */
+  struct Filter {
+    FilterType type;
+    std::string name;
+    double min_range;
+    double max_range;
+    size_t window; ///< Number of neighbours on each side (Median, Shadow)
+    double min_angle; ///< Radians
+    double max_angle; ///< Radians
+    double cell_size; ///< Meters
+  };
+
+  /**
+   * Add a range clipping filter
+   */
+  void addRangeClip(double min_range, double max_range, const std::string& name = "range_clip");
+
+  /**
+   * Add a median filter over 2*window + 1 readings
+   */
+  void addMedian(size_t window, const std::string& name = "median");
+
+  /**
+   * Add a shadow (veiling point) filter, comparing each reading with window neighbours on each side
+   */
+  void addShadow(double min_angle, double max_angle, size_t window, const std::string& name = "shadow");
+
+  /**
+   * Add a voxel downsampling filter
+   */
+  void addVoxel(double cell_size, const std::string& name = "voxel");
+
+  /**
+   * Return the configured filters, in order
+   */
+  const std::vector<Filter>& filters() const { return filters_; }
+
+  /**
+   * Return true if no filter is configured
+   */
+  bool empty() const { return filters_.empty(); }
+
+  /**
+   * Run every filter on the scan, in place
+   * @param scan The laser scan to filter
+   */
+  void apply(sensor_msgs::LaserScan& scan);
+
+protected:
+
+  void applyRangeClip(const Filter& filter, sensor_msgs::LaserScan& scan);
+  void applyMedian(const Filter& filter, sensor_msgs::LaserScan& scan);
+  void applyShadow(const Filter& filter, sensor_msgs::LaserScan& scan);
+  void applyVoxel(const Filter& filter, sensor_msgs::LaserScan& scan);
+
+  std::vector<Filter> filters_;
+  std::vector<float> ranges_; ///< Scratch copy of the input ranges
+  std::vector<float> window_; ///< Scratch buffer for the median
+  std::vector<char> removed_; ///< Scratch flags for the shadow filter
+};
+
+/**
+ * Read the scan filter configuration file, parse out the YAML, and build the filter chain.
+ * The file holds a list of filters, each with a name, a type (RangeClip, Median, Shadow or
+ * Voxel) and a params map. Angles are given in degrees.
  * @param filename Filename of a scan filter YAML configuration file
- * @return The ROS XmlRpc version of the YAML
+ * @return The configured filter chain
  */
-XmlRpc::XmlRpcValue readFilterConfiguration(const std::string& filename);
+ScanFilterChain readFilterConfiguration(const std::string& filename);
 
 /**
  * Apply some laser scan filters to the source scan before matching
@@ -35,6 +35,18 @@ namespace map {
  */
 ProbabilityMap createEmptyMap(const gtsam::Values& values, double map_cell_size, double map_size_buffer);
 
+/**
+ * Find the laser scan used to update the map for a pose timestamp. The scan closest to the
+ * timestamp is selected from the scans surrounding the +/- time_tolerance window. Scans
+ * further than time_tolerance from the timestamp are rejected, so sparsified (keyframe-only)
+ * scan sets only update the map for the keyframe poses.
+ * @param scans The set of available laser scans
+ * @param timestamp The (quantized) timestamp of the pose
+ * @param time_tolerance The time window used to search for scans
+ * @return A pointer to the selected scan, or NULL if no suitable scan exists
+ */
+const sensor_msgs::LaserScan* findMapScan(const LaserScans& scans, const ros::Time& timestamp, double time_tolerance);
+
 /**
  * Update the map with the provided laser scans at the optimized poses.
  * @param map
@@ -43,6 +55,23 @@ ProbabilityMap createEmptyMap(const gtsam::Values& values, double map_cell_size,
  */
 void buildMap(ProbabilityMap& map, const gtsam::Values& values, const LaserScans& scans, const gtsam::Pose3& base_T_laser, double scan_sigma, double time_tolerance, const std::string& debug_path);
 
+/**
+ * Update the map with the provided laser scans at the optimized poses, using several threads.
+ * The map rows are split into bands and each scan is binned to the bands its rays touch. Each
+ * band is updated by a single thread, applying the scans in the same order as buildMap, so the
+ * resulting map data is bitwise identical to the serial version. The Shannon entropy is
+ * recomputed from scratch afterwards.
+ * @param map The map to update
+ * @param values The optimized poses
+ * @param scans The set of available laser scans
+ * @param base_T_laser The pose (3D) of the laser in the robot/base frame
+ * @param scan_sigma The measurement error of the laser used by the sensor model
+ * @param time_tolerance The time window used to search for scans
+ * @param threads The number of worker threads. Zero uses one thread per hardware core.
+ * @param band_size The height of each row band in map cells
+ */
+void buildMapParallel(ProbabilityMap& map, const gtsam::Values& values, const LaserScans& scans, const gtsam::Pose3& base_T_laser, double scan_sigma, double time_tolerance, size_t threads = 0, size_t band_size = 32);
+
 
 
 /* ************************************************************************* */
@@ -18,6 +18,7 @@
 #include <gtsam/nonlinear/NonlinearFactorGraph.h>
 #include <gtsam/nonlinear/Values.h>
 #include <boost/array.hpp>
+#include <functional>
 #include <map>
 #include <set>
 #include <vector>
@@ -64,6 +65,15 @@ typedef struct {
  */
 void printProgressBar(const std::string& title, int percent);
 
+/**
+ * Run a function for every index in [0, count) on a set of worker threads. Indices are handed
+ * out dynamically, so uneven work per index is balanced across the workers.
+ * @param count The number of indices
+ * @param threads The number of worker threads. Zero uses the hardware concurrency.
+ * @param function The function to run for each index. Must be safe to call concurrently.
+ */
+void parallelFor(size_t count, size_t threads, const std::function<void(size_t)>& function);
+
 /**
  * Open all of the bagfiles indicated by filenames
  * @param filenames A container of bag filenames to open
@@ -6,8 +6,11 @@
 #define ODOMETRY_PROCESSING_H
 
 #include <aslam_demo/mapping/mapping_common.h>
+#include <aslam_demo/mapping/time_series.h>
 #include <nav_msgs/Odometry.h>
 #include <ros/ros.h>
+#include <algorithm>
+#include <deque>
 #include <string>
 #include <vector>
 
@@ -33,6 +36,20 @@ namespace odometry {
  */
 RelativePoseEstimates computeRelativePoses(const Odometry& odometry, const Timestamps& timestamps, const gtsam::Vector& sigmas, double time_tolerance, double scale = 1.0);
 
+/**
+ * Compute the relative pose and covariance between each provided timestamp, from a bounded odometry buffer
+ */
+RelativePoseEstimates computeRelativePoses(const TimeSeries<nav_msgs::Odometry>& odometry, const Timestamps& timestamps, const gtsam::Vector& sigmas, double time_tolerance, double scale = 1.0);
+
+/**
+ * Interpolate the 2D pose of the odometry at a timestamp
+ * @param odometry The odometry buffer
+ * @param timestamp The time to look up; outside of the buffer, the first or last message is used
+ * @param pose [output] The interpolated pose
+ * @return False if the buffer is empty
+ */
+bool interpolatePose(const TimeSeries<nav_msgs::Odometry>& odometry, const ros::Time& timestamp, gtsam::Pose2& pose);
+
 /**
  * Compute relative poses between the previous message time and the target time, and between the target time and next message time
  * @param previous_message
@@ -49,7 +66,94 @@ gtsam::Pose2 splitOdometry(const nav_msgs::Odometry& previous_message, const nav
  * @param time_tolerance
  * @return A GTSAM factor graph of odometry factors
  */
-gtsam::NonlinearFactorGraph createOdometryFactors(const RelativePoseEstimates& relative_poses, double time_tolerance,gtsam::KeySet keys);
+gtsam::NonlinearFactorGraph createOdometryFactors(const RelativePoseEstimates& relative_poses, double time_tolerance,const gtsam::KeySet& keys);
+
+/**
+ * Create a GTSAM odometry factor for each relative pose, between the keys of its own timestamps.
+ * Relative poses whose timestamps share a key are skipped.
+ * @param relative_poses
+ * @param time_tolerance
+ * @return A GTSAM factor graph of odometry factors
+ */
+gtsam::NonlinearFactorGraph createOdometryFactors(const RelativePoseEstimates& relative_poses, double time_tolerance);
+
+/**
+ * Online odometry preintegration. Each message is converted to a 2D pose once and folded into a
+ * running relative pose and covariance (the same G-matrix model as computeRelativePoses) as it
+ * arrives. Declaring a keyframe closes the running increment at the keyframe timestamp, splitting
+ * the message interval that spans it; the increments between consecutive keyframes are queued
+ * until they are collected.
+ */
+class OdometryPreintegrator {
+public:
+
+  /**
+   * Constructor
+   * @param sigmas The six parameters of the odometry noise model, as for computeRelativePoses
+   * @param history The length of message history kept for keyframes declared after later messages arrived, in seconds
+   * @param scale The scale correction applied to the translations
+   */
+  OdometryPreintegrator(const gtsam::Vector& sigmas = gtsam::zero(6), double history = 5.0, double scale = 1.0);
+
+  /**
+   * Fold an odometry message into the running increment. Messages must arrive in time order.
+   */
+  void add(const nav_msgs::Odometry& message);
+
+  /**
+   * Close the running increment at a keyframe. Keyframes must be declared in time order. A keyframe
+   * later than the newest message is closed once a message past it arrives.
+   */
+  void declareKeyframe(const ros::Time& timestamp);
+
+  /**
+   * Move the finished increments with timestamp2 up to the given time into the output
+   * @return The number of increments moved
+   */
+  size_t collect(const ros::Time& until, RelativePoseEstimates& increments);
+
+  /**
+   * The relative pose and covariance from the last keyframe to the newest message
+   */
+  RelativePoseEstimate current() const;
+
+protected:
+
+  /**
+   * A message reduced to its 2D pose, with the motion integrated from the last keyframe up to it
+   */
+  struct Sample {
+    ros::Time timestamp;
+    gtsam::Pose2 pose;
+    gtsam::Pose2 relative_pose;
+    gtsam::Matrix cov;
+  };
+
+  /**
+   * Fold the part of the motion between two samples that lies within [timestamp1, timestamp2]
+   */
+  void integrate(const Sample& sample1, const Sample& sample2, const ros::Time& timestamp1, const ros::Time& timestamp2,
+      gtsam::Pose2& relative_pose, gtsam::Matrix& cov) const;
+
+  /**
+   * Compute the integrated motion of a sample from the one before it
+   */
+  void advance(size_t index);
+
+  /**
+   * Finish the increment ending at the keyframe and start the next one there
+   */
+  void closeIncrement(const ros::Time& timestamp);
+
+  gtsam::Matrix G_;
+  double history_;
+  double scale_;
+  std::deque<Sample> samples_; ///< Recent messages, oldest first; the first one may precede the keyframe
+  std::deque<ros::Time> pending_; ///< Keyframes declared ahead of the newest message
+  bool anchored_; ///< False until the first keyframe
+  ros::Time anchor_; ///< The last keyframe
+  RelativePoseEstimates finished_;
+};
 
 } /// @namespace odometry
 
@@ -7,6 +7,8 @@
 
 #include <ros/ros.h>
 #include <gtsam/nonlinear/LevenbergMarquardtOptimizer.h>
+#include <gtsam/nonlinear/ISAM2.h>
+#include <gtsam/nonlinear/LinearContainerFactor.h>
 #include <gtsam/nonlinear/NonlinearFactorGraph.h>
 #include <gtsam/nonlinear/Values.h>
 #include <gtsam/nonlinear/Key.h>
@@ -18,6 +20,14 @@ namespace optimization {
 
 typedef std::map<gtsam::Key, gtsam::Matrix> Covariances;
 
+/**
+ * How marginal covariances are recovered
+ */
+enum CovarianceMode {
+  ExactCovariance, ///< The true marginal, from a factorization of the whole graph
+  ConditionalCovariance ///< The covariance of the variable with all others held fixed; only the factors on the variable are used. Cheap, but a lower bound on the marginal.
+};
+
 /**
  * Perform a series of checks on the factor graph before optimization. This checks that the
  * factor graph is connected, all variables have been initialized, etc.
@@ -27,14 +37,44 @@ typedef std::map<gtsam::Key, gtsam::Matrix> Covariances;
  */
 bool validateFactorGraph(const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values);
 
+/**
+ * Keeps the elimination ordering of a graph that grows between optimizations. New variables are
+ * appended to the cached ordering, which suits a trajectory growing at its tail; the fill-reducing
+ * COLAMD ordering is only recomputed once enough variables have been appended since the last time,
+ * or when variables were removed.
+ */
+class OrderingCache {
+public:
+
+  /**
+   * Constructor
+   * @param recompute_fraction COLAMD is rerun once the appended variables exceed this fraction of the ordering
+   */
+  OrderingCache(double recompute_fraction = 0.2);
+
+  /**
+   * Return an ordering of every variable of the values, extending or recomputing the cached one
+   */
+  const gtsam::Ordering& update(const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values);
+
+  void clear();
+
+protected:
+  double recompute_fraction_;
+  gtsam::Ordering ordering_;
+  size_t colamd_size_; ///< The number of variables at the last COLAMD
+};
+
 /**
  * Use GTSAM to optimize the factor graph
  * @param configuration The set of configuration parameters
  * @param factors The set of factors to optimize
  * @param values A set of initial values for each variable
+ * @param ordering_cache An optional ordering kept between calls on a growing graph; the ordering in the parameters is used otherwise
  * @return The optimized set of variables
  */
-gtsam::Values optimizeFactorGraph(const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values, const gtsam::LevenbergMarquardtParams& parameters);
+gtsam::Values optimizeFactorGraph(const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values, const gtsam::LevenbergMarquardtParams& parameters,
+    OrderingCache* ordering_cache = NULL);
 
 /**
  * Use GTSAM to compute the marginal covariances for each variable.
@@ -46,6 +86,137 @@ gtsam::Values optimizeFactorGraph(const gtsam::NonlinearFactorGraph& factors, co
  */
 Covariances computeCovariances(const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values);
 
+/**
+ * Compute the marginal covariances of the requested variables only. In exact mode the graph is
+ * factorized once, with Cholesky, and only the requested marginals are recovered from it.
+ * @param factors The set of factors
+ * @param values A set of optimal values for each variable
+ * @param keys The variables of interest, e.g. the latest pose and the loop closure candidates
+ * @param mode Exact marginals or the cheap conditional approximation
+ * @return The covariance matrix of each requested variable
+ */
+Covariances computeCovariances(const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values, const std::set<gtsam::Key>& keys, CovarianceMode mode = ExactCovariance);
+
+/**
+ * Incremental smoothing and mapping back end (iSAM2, Kaess et al. 2012). New factors are added to a
+ * Bayes tree that is kept between updates, so only the cliques touched by the new factors, and the
+ * variables whose linearization point moved more than the relinearization threshold, are
+ * re-eliminated. The cost of an update depends on the size of the affected part of the tree rather
+ * than on the length of the trajectory.
+ */
+class IncrementalOptimizer {
+public:
+
+  /**
+   * Constructor
+   * @param relinearize_threshold Variables whose update exceeds this are relinearized
+   * @param relinearize_skip Relinearization is only checked every relinearize_skip updates
+   */
+  IncrementalOptimizer(double relinearize_threshold = 0.01, int relinearize_skip = 1);
+
+  /**
+   * Add new factors and optimize incrementally
+   * @param factors The factors added since the last update
+   * @param values Initial values for the variables of the new factors. Variables already in the
+   * optimizer are ignored, so the initial guess of a whole batch can be passed.
+   * @param extra_iterations Additional relinearization steps without new factors, useful after loop closures
+   * @return The current estimate of every variable
+   */
+  gtsam::Values update(const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values, size_t extra_iterations = 0);
+
+  /**
+   * Return the current estimate of every variable
+   */
+  gtsam::Values estimate() const;
+
+  /**
+   * Return true if the variable has been added to the optimizer
+   */
+  bool exists(gtsam::Key key) const {
+    return isam_.getLinearizationPoint().exists(key);
+  }
+
+  /**
+   * Compute the marginal covariances of the requested variables. Exact marginals are recovered from
+   * the Bayes tree, which only requires the cliques between each variable and the root; the graph is
+   * not factorized again.
+   * @param keys The variables of interest. Variables not in the optimizer are skipped.
+   * @param mode Exact marginals or the conditional approximation
+   */
+  Covariances computeCovariances(const std::set<gtsam::Key>& keys, CovarianceMode mode = ExactCovariance) const;
+
+  /**
+   * Return true until the first factors have been added
+   */
+  bool empty() const {
+    return isam_.getLinearizationPoint().empty();
+  }
+
+protected:
+  gtsam::ISAM2 isam_;
+};
+
+/**
+ * Fixed-lag smoother. Only the variables of the last lag seconds are optimized; older variables are
+ * marginalized out, and the information they carried is kept as a linear prior on the variables
+ * they were connected to (LinearContainerFactor). The optimized window, and with it the latency of
+ * an update, stays bounded however long the trajectory grows.
+ */
+class FixedLagSmoother {
+public:
+
+  /**
+   * Constructor
+   * @param lag The length of the optimized window in seconds
+   * @param parameters The parameters of the Levenberg-Marquardt optimization of the window
+   */
+  FixedLagSmoother(double lag = 30.0, const gtsam::LevenbergMarquardtParams& parameters = gtsam::LevenbergMarquardtParams());
+
+  /**
+   * Add new factors, optimize the window and marginalize the variables that fell out of it
+   * @param factors The factors added since the last update. Factors on marginalized variables are dropped.
+   * @param values Initial values for the variables of the new factors. Variables already in the window are ignored.
+   * @param timestamps The timestamp of every new variable
+   * @return The estimate of the variables in the window, including those marginalized by this update
+   */
+  gtsam::Values update(const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values, const std::map<gtsam::Key, ros::Time>& timestamps);
+
+  /**
+   * Return the estimate of the variables in the window
+   */
+  const gtsam::Values& estimate() const {
+    return estimate_;
+  }
+
+  /**
+   * Return true if the variable is in the window
+   */
+  bool exists(gtsam::Key key) const {
+    return estimate_.exists(key);
+  }
+
+  /**
+   * Compute the marginal covariances of requested variables in the window. The marginal priors keep
+   * the information of the marginalized variables, so the window alone gives the full marginal.
+   * @param keys The variables of interest. Variables outside of the window are skipped.
+   * @param mode Exact marginals or the conditional approximation
+   */
+  Covariances computeCovariances(const std::set<gtsam::Key>& keys, CovarianceMode mode = ExactCovariance) const;
+
+protected:
+
+  /**
+   * Replace the factors on the given variables by the linear marginal on their neighbours
+   */
+  void marginalize(const std::set<gtsam::Key>& keys);
+
+  double lag_;
+  gtsam::LevenbergMarquardtParams parameters_;
+  gtsam::NonlinearFactorGraph factors_; ///< The factors of the window and the marginal priors on its boundary
+  gtsam::Values estimate_;
+  std::map<gtsam::Key, ros::Time> timestamps_; ///< The timestamp of every variable in the window
+};
+
 ///**
 // * Serialize the pose covariances to a log file for easy MATLAB parsing.
 // * Format: Timestamp Covariance (in row-major order, c11 c12 c13 c21 c22 c23 c31 c32 c33)
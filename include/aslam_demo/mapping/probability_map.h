@@ -280,6 +280,30 @@ public:
     update(std::floor(map_coordinates.y()), std::floor(map_coordinates.x()), probability);
   }
 
+  /**
+   * Return the raw log-odds stored in a map cell. No bounds check is performed.
+   * @param row
+   * @param col
+   * @return log-odds at (row, col)
+   */
+  double logOdds(int row, int col) const {
+    return data_(row,col);
+  }
+
+  /**
+   * Overwrite a map cell with a log-odds value, clipped to the allowable range.
+   * The Shannon entropy is kept in sync with the new cell value.
+   * @param row
+   * @param col
+   * @param log_odds
+   */
+  void setLogOdds(int row, int col, double log_odds);
+
+  /**
+   * Crop the map to the smallest rectangle containing every cell with a non-zero log-odds.
+   * The origin is shifted so that the world position of the remaining cells is unchanged.
+   */
+  void shrinkToFit();
 
   void nanRecalc();
 	/**
@@ -316,6 +340,15 @@ public:
   }
   void calcShannonEntropy();
 
+  /**
+   * Enable or disable the incremental Shannon entropy bookkeeping in update(). With tracking
+   * disabled, concurrent updates of disjoint cells are safe; call calcShannonEntropy() afterwards.
+   * @param enable
+   */
+  void setEntropyTracking(bool enable) {
+    track_entropy_ = enable;
+  }
+
 
 protected:
 
@@ -336,6 +369,7 @@ protected:
 
   double shannon_entropy_ = 0.0;
   double entropy_tol_ = 1.e-06;
+  bool track_entropy_ = true;
 
 
 	/**
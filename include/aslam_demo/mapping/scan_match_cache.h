@@ -0,0 +1,109 @@
+/**
+ * scan_match_cache.h
+ */
+
+#ifndef SCAN_MATCH_CACHE_H
+#define SCAN_MATCH_CACHE_H
+
+#include <aslam_demo/mapping/mapping_common.h>
+#include <ros/ros.h>
+#include <gtsam/geometry/Pose2.h>
+#include <list>
+#include <map>
+
+namespace mapping {
+
+namespace csm {
+
+/**
+ * A bounded LRU cache of scan match outcomes. Entries are keyed by the two scan timestamps and the
+ * initial guess, quantized so that guesses that differ by less than the resolution share an entry.
+ * Failed matches are cached as well, so a candidate pair that was rejected is not matched again
+ * until its initial guess changes noticeably. Not thread-safe.
+ */
+class ScanMatchCache {
+public:
+
+  /**
+   * Constructor
+   * @param capacity The maximum number of cached outcomes (at least 1)
+   * @param translation_resolution The quantization of the initial guess translation in meters
+   * @param rotation_resolution The quantization of the initial guess rotation in radians
+   */
+  ScanMatchCache(size_t capacity = 1024, double translation_resolution = 0.25, double rotation_resolution = 0.1);
+
+  /**
+   * Look up a previous outcome, marking it as most recently used
+   * @param timestamp1 The timestamp of the reference scan
+   * @param timestamp2 The timestamp of the matched scan
+   * @param initial_guess The initial guess of the relative pose
+   * @param match [output] The cached match, if the cached outcome is a success
+   * @param valid [output] True if the cached outcome is a success
+   * @return True if an outcome was cached
+   */
+  bool lookup(const ros::Time& timestamp1, const ros::Time& timestamp2, const gtsam::Pose2& initial_guess, RelativePoseEstimate& match, bool& valid);
+
+  /**
+   * Cache a successful match
+   */
+  void insert(const ros::Time& timestamp1, const ros::Time& timestamp2, const gtsam::Pose2& initial_guess, const RelativePoseEstimate& match);
+
+  /**
+   * Cache a failed match
+   */
+  void insertFailure(const ros::Time& timestamp1, const ros::Time& timestamp2, const gtsam::Pose2& initial_guess);
+
+  /**
+   * Remove all cached outcomes
+   */
+  void clear();
+
+  /**
+   * Return the number of cached outcomes
+   */
+  size_t size() const { return entries_.size(); }
+
+  /**
+   * Return the number of lookups that found or missed an outcome since construction
+   */
+  size_t hits() const { return hits_; }
+  size_t misses() const { return misses_; }
+
+protected:
+
+  /**
+   * The timestamps and the quantized initial guess
+   */
+  struct Key {
+    ros::Time timestamp1;
+    ros::Time timestamp2;
+    int x;
+    int y;
+    int theta;
+    bool operator<(const Key& other) const;
+  };
+
+  struct Entry {
+    bool valid;
+    RelativePoseEstimate match;
+    std::list<Key>::iterator lru;
+  };
+
+  Key makeKey(const ros::Time& timestamp1, const ros::Time& timestamp2, const gtsam::Pose2& initial_guess) const;
+
+  void store(const Key& key, bool valid, const RelativePoseEstimate& match);
+
+  size_t capacity_;
+  double translation_resolution_;
+  double rotation_resolution_;
+  std::map<Key, Entry> entries_;
+  std::list<Key> lru_; ///< Cached keys, most recently used first
+  size_t hits_;
+  size_t misses_;
+};
+
+} /// @namespace csm
+
+} /// @namespace mapping
+
+#endif // SCAN_MATCH_CACHE_H
@@ -0,0 +1,134 @@
+/**
+ * scan_match_recorder.h
+ */
+
+#ifndef SCAN_MATCH_RECORDER_H
+#define SCAN_MATCH_RECORDER_H
+
+#include <csm/csm.h>
+#include <ros/ros.h>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace mapping {
+
+namespace csm {
+
+/**
+ * Records the CSM inputs of scan matches for offline debugging without blocking the matcher.
+ * The matching thread copies the two laser_data structures into a preallocated slot of a
+ * bounded lock-free ring buffer; a background thread serializes the slots to a binary file.
+ * When the ring is full the record is dropped instead of waiting.
+ *
+ * File layout (native endianness): the magic "CSMR" and a uint32 version, followed by one
+ * record per match: int64 sec/nsec of timestamp1 and timestamp2, then the reference and the
+ * sensor scan, each stored as int32 nrays, double min_theta, max_theta, odometry[3],
+ * estimate[3], theta[nrays], readings[nrays] and int32 valid[nrays].
+ */
+class ScanMatchRecorder {
+public:
+
+  /**
+   * Constructor. Starts the writer thread.
+   * @param filename The binary log file to create
+   * @param capacity The number of ring buffer slots. Rounded up to a power of two.
+   * @param max_rays The number of rays preallocated per scan. Longer scans are truncated.
+   * @param sample_interval Record one of every sample_interval matches
+   * @param max_records Stop recording after this many records. Zero means no limit.
+   */
+  ScanMatchRecorder(const std::string& filename, size_t capacity = 64, size_t max_rays = 1081,
+      size_t sample_interval = 1, size_t max_records = 0);
+
+  /**
+   * Destructor. Flushes the pending records and stops the writer thread.
+   */
+  ~ScanMatchRecorder();
+
+  /**
+   * Copy the inputs of a scan match into the ring buffer, subject to sampling and the record limit
+   * @param reference The CSM reference scan
+   * @param scan The CSM sensor scan
+   * @param timestamp1 The timestamp of the reference scan
+   * @param timestamp2 The timestamp of the sensor scan
+   * @param force Record the match regardless of the sample interval, e.g. a failed match
+   * @return True if the match was queued for writing
+   */
+  bool record(const struct laser_data* reference, const struct laser_data* scan, const ros::Time& timestamp1, const ros::Time& timestamp2,
+      bool force = false);
+
+  /**
+   * Return the number of records written, and dropped because the ring buffer was full
+   */
+  size_t written() const { return written_; }
+  size_t dropped() const { return dropped_; }
+
+protected:
+
+  /**
+   * A copy of the CSM laser_data fields needed to replay a match
+   */
+  struct ScanRecord {
+    int32_t nrays;
+    double min_theta;
+    double max_theta;
+    double odometry[3];
+    double estimate[3];
+    std::vector<double> theta;
+    std::vector<double> readings;
+    std::vector<int32_t> valid;
+  };
+
+  /**
+   * A ring buffer slot. The sequence number implements the bounded MPMC queue of D. Vyukov.
+   */
+  struct Slot {
+    std::atomic<size_t> sequence;
+    ros::Time timestamp1;
+    ros::Time timestamp2;
+    ScanRecord reference;
+    ScanRecord scan;
+  };
+
+  /**
+   * Copy a laser_data structure into preallocated storage
+   */
+  void copyScan(const struct laser_data* source, ScanRecord& record) const;
+
+  /**
+   * Append a scan record to the log file
+   */
+  void writeScan(const ScanRecord& record);
+
+  /**
+   * Writer thread main loop
+   */
+  void writeRecords();
+
+  std::unique_ptr<Slot[]> slots_;
+  size_t mask_; ///< Slot count - 1
+  size_t max_rays_;
+  size_t sample_interval_;
+  size_t max_records_;
+
+  std::atomic<size_t> enqueue_position_;
+  std::atomic<size_t> dequeue_position_;
+  std::atomic<size_t> match_counter_; ///< Number of matches offered to record()
+  std::atomic<size_t> accepted_; ///< Number of records queued
+  std::atomic<size_t> written_;
+  std::atomic<size_t> dropped_;
+
+  std::FILE* file_;
+  std::atomic<bool> active_;
+  std::thread writer_thread_;
+};
+
+} /// @namespace csm
+
+} /// @namespace mapping
+
+#endif // SCAN_MATCH_RECORDER_H
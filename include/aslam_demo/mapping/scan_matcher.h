@@ -0,0 +1,127 @@
+/**
+ * scan_matcher.h
+ */
+
+#ifndef SCAN_MATCHER_H
+#define SCAN_MATCHER_H
+
+#include <aslam_demo/mapping/csm_processing.h>
+#include <aslam_demo/mapping/scan_match_recorder.h>
+#include <csm/csm.h>
+#include <ros/ros.h>
+#include <sensor_msgs/LaserScan.h>
+#include <gtsam/geometry/Pose2.h>
+#include <gtsam/geometry/Pose3.h>
+#include <list>
+#include <map>
+#include <limits>
+#include <vector>
+
+namespace mapping {
+
+namespace csm {
+
+/**
+ * A stateful version of computeLaserScanMatch. The CSM parameters are configured once, and the
+ * converted CSM laser_data of recently matched scans are kept in a bounded LRU cache keyed by
+ * the scan timestamp, so a scan used as laser_sens in one match and as laser_ref in the next is
+ * converted only once. Not thread-safe; use one matcher per thread.
+ */
+class ScanMatcher {
+public:
+
+  /**
+   * Constructor
+   * @param base_T_laser The frame transformation from the sensor frame to the robot frame
+   * @param laserscan_sigma The measurement error estimate for the laser data
+   * @param cache_size The maximum number of converted scans kept in the cache (at least 2)
+   * @param covariance_trace_threshold All matches that have a covariance trace larger than this threshold will report as failed
+   * @param initial_guess_error_threshold All matches further than this from the initial guess will report as failed
+   * @param minimum_overlap All matches where a smaller fraction of the scan2 points has a correspondence in scan1 will report as failed
+   * @param correspondence_distance The maximum distance between corresponding points for the overlap check, in meters
+   * @param covariance_mode How the covariance of each match is estimated
+   */
+  ScanMatcher(const gtsam::Pose3& base_T_laser = gtsam::Pose3::identity(),
+      double laserscan_sigma = 0.05,
+      size_t cache_size = 64,
+      double covariance_trace_threshold = std::numeric_limits<double>::max(),
+      double initial_guess_error_threshold = std::numeric_limits<double>::max(),
+      double minimum_overlap = 0.0,
+      double correspondence_distance = 0.1,
+      CovarianceMode covariance_mode = FullCovariance);
+
+  /**
+   * Destructor. Releases the cached laser data.
+   */
+  ~ScanMatcher();
+
+  /**
+   * Compute the relative pose between two scans
+   * @param scan1 ROS laserscan message from timestamp1
+   * @param scan2 ROS laserscan message from timestamp2
+   * @param initial_guess An initial guess of the relative pose from timestamp1 to timestamp2
+   * @param recorder An optional asynchronous recorder for the match inputs
+   * @return The relative pose and covariance based on laser scan matching
+   */
+  RelativePoseEstimate match(const sensor_msgs::LaserScan& scan1, const sensor_msgs::LaserScan& scan2,
+      const gtsam::Pose2& initial_guess, ScanMatchRecorder* recorder = NULL);
+
+  /**
+   * Access the CSM parameters. Changes apply to the following matches.
+   */
+  struct sm_params& params() { return csm_params_; }
+
+  /**
+   * Release all cached laser data
+   */
+  void clearCache();
+
+  /**
+   * Return the number of cache hits and misses since construction
+   */
+  size_t cacheHits() const { return cache_hits_; }
+  size_t cacheMisses() const { return cache_misses_; }
+
+protected:
+
+  /**
+   * A converted scan. CSM invalidates rays in place during matching, so the original
+   * validity flags are kept to restore the scan before it is reused.
+   */
+  struct CachedScan {
+    LDP data;
+    std::vector<int> valid;
+    std::list<ros::Time>::iterator lru;
+  };
+
+  /**
+   * Look up or convert a scan, marking it as most recently used
+   */
+  LDP acquire(const sensor_msgs::LaserScan& scan, const ros::Time& keep);
+
+  ScanMatcher(const ScanMatcher&);
+  ScanMatcher& operator=(const ScanMatcher&);
+
+  struct sm_params csm_params_;
+  gtsam::Pose3 base_T_laser_;
+  gtsam::Pose3 laser_T_base_;
+  bool laser_inverted_;
+  double laserscan_sigma_;
+  size_t cache_size_;
+  double covariance_trace_threshold_;
+  double initial_guess_error_threshold_;
+  double minimum_overlap_;
+  double correspondence_distance_;
+  CovarianceMode covariance_mode_;
+
+  std::map<ros::Time, CachedScan> cache_;
+  std::list<ros::Time> lru_; ///< Cached timestamps, most recently used first
+  size_t cache_hits_;
+  size_t cache_misses_;
+};
+
+} /// @namespace csm
+
+} /// @namespace mapping
+
+#endif // SCAN_MATCHER_H
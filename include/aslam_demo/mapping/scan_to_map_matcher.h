@@ -0,0 +1,111 @@
+/**
+ * scan_to_map_matcher.h
+ */
+
+#ifndef SCAN_TO_MAP_MATCHER_H
+#define SCAN_TO_MAP_MATCHER_H
+
+#include <aslam_demo/mapping/probability_map.h>
+#include <sensor_msgs/LaserScan.h>
+#include <gtsam/geometry/Point2.h>
+#include <gtsam/geometry/Pose2.h>
+#include <gtsam/geometry/Pose3.h>
+#include <gtsam/base/Matrix.h>
+#include <vector>
+
+namespace mapping {
+
+namespace scan_to_map {
+
+/**
+ * Aligns a scan directly to an occupancy map by Gauss-Newton minimization of the unexplained
+ * occupancy at the scan endpoints (Kohlbrecher et al. 2011, "Hector SLAM"). The map is converted
+ * into a smoothed occupancy-evidence grid with a small pyramid of coarser levels, and sampled with
+ * bilinear interpolation so that both the value and its gradient are continuous. Matching runs
+ * from the coarsest to the finest level, which widens the convergence basin.
+ */
+class ScanToMapMatcher {
+public:
+
+  /**
+   * Constructor
+   * @param levels The number of pyramid levels. Each level halves the resolution of the previous one.
+   * @param iterations The maximum number of Gauss-Newton iterations per level
+   * @param min_score Matches whose mean occupancy evidence at the scan endpoints is lower are rejected, in [0, 1]
+   * @param base_T_laser The pose (3D) of the laser in the robot/base frame
+   */
+  ScanToMapMatcher(size_t levels = 3, size_t iterations = 10, double min_score = 0.25,
+      const gtsam::Pose3& base_T_laser = gtsam::Pose3::identity());
+
+  /**
+   * Rebuild the map pyramid from a probability map
+   * @param map The map to match against
+   */
+  void setMap(const ProbabilityMap& map);
+
+  /**
+   * Return true once a map has been provided
+   */
+  bool hasMap() const {
+    return !levels_.empty();
+  }
+
+  /**
+   * Estimate the map pose of the robot at the scan timestamp
+   * @param scan The laser scan to align
+   * @param initial_guess The initial estimate of the robot pose in the map frame
+   * @param pose [output] The aligned robot pose in the map frame
+   * @param covariance [output] The 3x3 covariance of the aligned pose
+   * @return True if the alignment converged with a score of at least min_score
+   */
+  bool match(const sensor_msgs::LaserScan& scan, const gtsam::Pose2& initial_guess, gtsam::Pose2& pose, gtsam::Matrix& covariance) const;
+
+protected:
+
+  /**
+   * One level of the map pyramid
+   */
+  struct Level {
+    int rows;
+    int cols;
+    double cell_size;
+    std::vector<float> values; ///< Occupancy evidence in [0, 1], row-major
+
+    float value(int row, int col) const {
+      if(row < 0 || col < 0 || row >= rows || col >= cols) return 0.0f;
+      return values[row*cols + col];
+    }
+
+    /**
+     * Bilinear interpolation of the cell-centered values and the gradient with respect to
+     * the map coordinates (in cells)
+     */
+    double interpolate(double x, double y, double& dx, double& dy) const;
+  };
+
+  /**
+   * Compute the mean occupancy evidence at the transformed points and the normal equations of
+   * the Gauss-Newton step
+   */
+  double evaluate(const Level& level, const std::vector<gtsam::Point2>& points, const gtsam::Pose2& pose, gtsam::Matrix& H, gtsam::Vector& b) const;
+
+  /**
+   * Run damped Gauss-Newton on a single pyramid level
+   * @return The mean occupancy evidence at the scan endpoints
+   */
+  double optimize(const Level& level, const std::vector<gtsam::Point2>& points, gtsam::Pose2& pose, gtsam::Matrix& hessian) const;
+
+  size_t level_count_;
+  size_t iterations_;
+  double min_score_;
+  gtsam::Pose3 base_T_laser_;
+
+  std::vector<Level> levels_; ///< Finest level first
+  gtsam::Point2 origin_; ///< World position of the lower-left corner of the map
+};
+
+} // namespace scan_to_map
+
+} // namespace mapping
+
+#endif // SCAN_TO_MAP_MATCHER_H
@@ -10,6 +10,8 @@
 #include <gtsam/geometry/Pose3.h>
 #include <gtsam/geometry/Pose2.h>
 #include <gtsam/geometry/Point2.h>
+#include <vector>
+#include <cmath>
 
 namespace mapping {
 
@@ -42,6 +44,17 @@ public:
    */
   void updateMap(ProbabilityMap& map, const gtsam::Point2& sensor_origin, const gtsam::Point2& laser_return) const;
 
+  /**
+   * Update the rows [row_begin, row_end) of the map with a single laser return. Cells outside of
+   * the row range are skipped, so disjoint row bands of the same map may be updated concurrently.
+   * @param map The map to update
+   * @param sensor_origin The position of the sensor in the world frame
+   * @param laser_return The position of the laser return in the world frame
+   * @param row_begin The first map row to update
+   * @param row_end One past the last map row to update
+   */
+  void updateMap(ProbabilityMap& map, const gtsam::Point2& sensor_origin, const gtsam::Point2& laser_return, int row_begin, int row_end) const;
+
   /**
    * Update the map with a single laser scan message
    * @param map The map to update
@@ -51,6 +64,24 @@ public:
    */
   void updateMap(ProbabilityMap& map, const sensor_msgs::LaserScan& scan, const gtsam::Pose2& world_T_base, const gtsam::Pose3& base_T_laser) const;
 
+  /**
+   * Project a laser scan message into world frame points
+   * @param scan The laser scan message to project
+   * @param world_T_base The pose (2D) of the robot/base in the world frame
+   * @param base_T_laser The pose (3D) of the laser in the robot/base frame
+   * @param sensor_origin Output position of the sensor in the world frame
+   * @return The world frame position of every valid laser return
+   */
+  std::vector<gtsam::Point2> projectScan(const sensor_msgs::LaserScan& scan, const gtsam::Pose2& world_T_base, const gtsam::Pose3& base_T_laser, gtsam::Point2& sensor_origin) const;
+
+  /**
+   * Return the distance past a laser return, in map cells, updated by the sensor model
+   * @param cell_size The map cell size in meters
+   */
+  size_t kernelSize(double cell_size) const {
+    return std::ceil(3.0 * range_sigma_ / cell_size);
+  }
+
 protected:
 
   double range_sigma_; ///< The measurement uncertainty of the laser
@@ -0,0 +1,139 @@
+/**
+ * submaps.h
+ */
+
+#ifndef SUBMAPS_H
+#define SUBMAPS_H
+
+#include <aslam_demo/mapping/probability_map.h>
+#include <aslam_demo/mapping/sensor_models.h>
+#include <aslam_demo/mapping/mapping_common.h>
+#include <gtsam/nonlinear/Values.h>
+#include <gtsam/geometry/Pose2.h>
+#include <gtsam/geometry/Pose3.h>
+#include <boost/shared_ptr.hpp>
+#include <set>
+#include <vector>
+
+namespace mapping {
+
+namespace submaps {
+
+/**
+ * A local probability map built from a fixed number of consecutive keyframes. The map is
+ * expressed in the frame of the anchor keyframe, so a pose graph correction only moves the
+ * submap as a rigid body instead of requiring the raw scans to be reinserted.
+ */
+struct Submap {
+  typedef boost::shared_ptr<Submap> shared_ptr;
+
+  gtsam::Key anchor; ///< Key of the keyframe defining the submap frame
+  ProbabilityMap map; ///< Local map, expressed in the anchor frame
+  size_t keyframes; ///< Number of keyframes fused into the local map
+  bool finished; ///< No further keyframes will be added to this submap
+  bool modified; ///< The local map changed since the last composition
+  bool placed; ///< The submap has been blended into the global map
+  gtsam::Pose2 placed_pose; ///< Anchor pose used during the last composition
+  std::vector<size_t> placed_tiles; ///< Global map tiles covered during the last composition
+};
+
+/**
+ * Maintains the set of keyframe submaps and composes the global map from them. Composition
+ * is incremental: only the tiles of the global map covered by submaps whose anchor pose moved
+ * (or whose contents changed) are recomputed.
+ */
+class SubmapCollection {
+public:
+
+  /**
+   * Constructor
+   * @param keyframes_per_submap The number of keyframes fused into each submap
+   * @param submap_radius The half-width of a new submap in meters, centered on the anchor
+   * @param cell_size The width and height of each submap cell in meters
+   * @param tile_size The width and height of each global map tile in cells
+   * @param scan_sigma The measurement error of the laser used by the sensor model
+   * @param time_tolerance The time tolerance used for timestamp <--> key conversions
+   */
+  SubmapCollection(size_t keyframes_per_submap = 20, double submap_radius = 8.0, double cell_size = 0.025,
+      size_t tile_size = 64, double scan_sigma = 0.01, double time_tolerance = 0.0001);
+
+  /**
+   * Fuse the scans of any keyframe not yet assigned to a submap. A new submap is started
+   * whenever the current one has received keyframes_per_submap keyframes.
+   * @param values The optimized poses. Must contain the anchor of every open submap.
+   * @param scans The set of available laser scans
+   * @param base_T_laser The pose (3D) of the laser in the robot/base frame
+   */
+  void insert(const gtsam::Values& values, const LaserScans& scans, const gtsam::Pose3& base_T_laser);
+
+  /**
+   * Blend the submaps into the global map at their current anchor poses. Only tiles touched
+   * by moved or modified submaps are recomputed.
+   * @param map The global map to update
+   * @param values The optimized poses
+   * @param pose_tolerance Anchor pose changes smaller than this are ignored
+   */
+  void compose(ProbabilityMap& map, const gtsam::Values& values, double pose_tolerance = 1e-3);
+
+  /**
+   * Return true if the pose was already fused into a submap, or skipped as a non-keyframe
+   */
+  bool assigned(gtsam::Key key) const {
+    return assigned_keys_.count(key) > 0;
+  }
+
+  /**
+   * Remove all submaps and cached placements
+   */
+  void clear();
+
+  /**
+   * Return the number of submaps
+   */
+  size_t size() const {
+    return submaps_.size();
+  }
+
+  /**
+   * Access the submaps
+   */
+  const std::vector<Submap::shared_ptr>& submaps() const {
+    return submaps_;
+  }
+
+protected:
+
+  /**
+   * Compute the global map tiles covered by a submap placed at the provided anchor pose
+   */
+  std::vector<size_t> computeTiles(const Submap& submap, const gtsam::Pose2& world_T_anchor, const ProbabilityMap& map) const;
+
+  /**
+   * Recompute the log-odds of a single global map tile from all of the overlapping submaps
+   */
+  void composeTile(ProbabilityMap& map, size_t tile) const;
+
+  size_t keyframes_per_submap_; ///< The number of keyframes fused into each submap
+  double submap_radius_; ///< The half-width of a new submap in meters
+  double cell_size_; ///< The submap cell size in meters
+  size_t tile_size_; ///< The global map tile size in cells
+  double time_tolerance_; ///< The time tolerance used for timestamp <--> key conversions
+  sensor_models::LaserScanModel laser_model_; ///< Sensor model used to fuse scans into submaps
+
+  std::vector<Submap::shared_ptr> submaps_; ///< All submaps, in keyframe order
+  std::set<gtsam::Key> assigned_keys_; ///< Keyframes already fused into a submap, and poses skipped as non-keyframes
+
+  size_t map_rows_; ///< Rows of the global map used for the current tile layout
+  size_t map_cols_; ///< Columns of the global map used for the current tile layout
+  double map_cell_size_; ///< Cell size of the global map used for the current tile layout
+  gtsam::Point2 map_origin_; ///< Origin of the global map used for the current tile layout
+  size_t tile_rows_; ///< Number of tile rows in the global map
+  size_t tile_cols_; ///< Number of tile columns in the global map
+  std::vector<std::vector<size_t> > tile_submaps_; ///< Indices of the submaps overlapping each tile
+};
+
+} // namespace submaps
+
+} // namespace mapping
+
+#endif // SUBMAPS_H
@@ -0,0 +1,164 @@
+/**
+ * time_series.h
+ */
+
+#ifndef TIME_SERIES_H
+#define TIME_SERIES_H
+
+#include <ros/ros.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace mapping {
+
+/**
+ * A bounded, time-sorted series of samples in contiguous storage. Lookups are binary searches.
+ * Two retention policies bound the series: at most capacity samples are kept, and samples older
+ * than max_age seconds behind the newest one are evicted. Eviction removes the oldest samples in
+ * blocks, so appending stays amortized O(1) while the storage remains a single vector.
+ */
+template<class T>
+class TimeSeries {
+public:
+  typedef std::pair<ros::Time, T> value_type;
+  typedef typename std::vector<value_type>::const_iterator const_iterator;
+
+  /**
+   * Constructor
+   * @param capacity The maximum number of samples kept
+   * @param max_age Samples older than this behind the newest sample are evicted, in seconds. Zero keeps samples of any age.
+   */
+  TimeSeries(size_t capacity = 1000, double max_age = 0.0) :
+      capacity_(std::max<size_t>(capacity, 1)), max_age_(max_age), begin_(0) {
+  }
+
+  /**
+   * Insert a sample. Samples normally arrive in time order and are appended; an older sample is
+   * inserted in place, and a sample with an existing timestamp replaces it.
+   */
+  void insert(const ros::Time& timestamp, const T& value) {
+    if(empty() || samples_.back().first < timestamp) {
+      samples_.push_back(value_type(timestamp, value));
+    } else {
+      typename std::vector<value_type>::iterator iter = std::lower_bound(samples_.begin() + begin_, samples_.end(), timestamp, Compare());
+      if(iter != samples_.end() && iter->first == timestamp) iter->second = value;
+      else samples_.insert(iter, value_type(timestamp, value));
+    }
+    evict();
+  }
+
+  bool empty() const {
+    return begin_ == samples_.size();
+  }
+
+  size_t size() const {
+    return samples_.size() - begin_;
+  }
+
+  void clear() {
+    samples_.clear();
+    begin_ = 0;
+  }
+
+  const_iterator begin() const {
+    return samples_.begin() + begin_;
+  }
+
+  const_iterator end() const {
+    return samples_.end();
+  }
+
+  const value_type& front() const {
+    return samples_[begin_];
+  }
+
+  const value_type& back() const {
+    return samples_.back();
+  }
+
+  /**
+   * The first sample not older than the timestamp
+   */
+  const_iterator lower_bound(const ros::Time& timestamp) const {
+    return std::lower_bound(begin(), end(), timestamp, Compare());
+  }
+
+  /**
+   * The first sample newer than the timestamp
+   */
+  const_iterator upper_bound(const ros::Time& timestamp) const {
+    return std::upper_bound(begin(), end(), timestamp, Compare());
+  }
+
+  /**
+   * The sample closest in time, or NULL if the series is empty
+   */
+  const value_type* nearest(const ros::Time& timestamp) const {
+    if(empty()) return NULL;
+    const_iterator after = lower_bound(timestamp);
+    if(after == end()) return &back();
+    if(after == begin()) return &*after;
+    const_iterator before = after - 1;
+    return ((timestamp - before->first) < (after->first - timestamp)) ? &*before : &*after;
+  }
+
+  /**
+   * Interpolate between the two samples around the timestamp. Outside of the series, the first or
+   * last sample is used on its own.
+   * @param timestamp The time to look up
+   * @param interpolator Called as interpolator(before, after, fraction), with fraction in [0, 1] from before to after
+   * @param result [output] The value returned by the interpolator
+   * @return False if the series is empty
+   */
+  template<class Interpolator, class Result>
+  bool interpolate(const ros::Time& timestamp, const Interpolator& interpolator, Result& result) const {
+    if(empty()) return false;
+    const_iterator after = lower_bound(timestamp);
+    if(after == end()) {
+      result = interpolator(back(), back(), 0.0);
+    } else if(after == begin() || after->first == timestamp) {
+      result = interpolator(*after, *after, 0.0);
+    } else {
+      const_iterator before = after - 1;
+      double fraction = (timestamp - before->first).toSec() / (after->first - before->first).toSec();
+      result = interpolator(*before, *after, fraction);
+    }
+    return true;
+  }
+
+protected:
+
+  struct Compare {
+    bool operator()(const value_type& sample, const ros::Time& timestamp) const {
+      return sample.first < timestamp;
+    }
+    bool operator()(const ros::Time& timestamp, const value_type& sample) const {
+      return timestamp < sample.first;
+    }
+  };
+
+  /**
+   * Apply the retention policies. Evicted samples are only marked, and physically removed once they
+   * make up a quarter of the storage.
+   */
+  void evict() {
+    while(size() > capacity_) ++begin_;
+    if(max_age_ > 0.0) {
+      while(size() > 1 && (samples_.back().first - samples_[begin_].first).toSec() > max_age_) ++begin_;
+    }
+    if(begin_ > 0 && begin_ >= samples_.size() / 4) {
+      samples_.erase(samples_.begin(), samples_.begin() + begin_);
+      begin_ = 0;
+    }
+  }
+
+  size_t capacity_;
+  double max_age_;
+  std::vector<value_type> samples_;
+  size_t begin_; ///< Index of the oldest retained sample
+};
+
+} // namespace mapping
+
+#endif // TIME_SERIES_H
@@ -79,7 +79,7 @@ void AslamBase::updateFromOccMap(nav_msgs::OccupancyGrid& occupancy_grid,gtsam::
 }
 
 
-void AslamBase::updateFromProbMap(mapping::ProbabilityMap& probability_map,gtsam::Pose2 current_pose) {
+void AslamBase::updateFromProbMap(const mapping::ProbabilityMap& probability_map,gtsam::Pose2 current_pose) {
   ROS_INFO_STREAM("Entered OOO");
   //costmap2dros_.resetLayers();
   probability_map_.reset(probability_map);
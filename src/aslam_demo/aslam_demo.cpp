@@ -7,6 +7,12 @@ AslamDemo::AslamDemo(ros::NodeHandle& n):n_(n),time_tolerance(0.0001),key_genera
     current_pose_(gtsam::Pose2(0.0,0.0,0.0)),
     base_name_("base_footprint"),
     laser_link_("camera_depth_frame"),
+    keyframe_selector_(5.0,0.2,0.2,0.3,0.25),
+    odomreadings_(6000,60.0),
+    trueodomreadings_(20000,60.0),
+    odom_preintegrator_(gtsam::Vector::Constant(6,0.001)),
+    scan_queue_(10,ScanQueue::DropOldest),
+    match_queue_(200,MatchQueue::Block),
 aslam_(nullptr) {
   ROS_INFO_STREAM("AslamDemo Object");
 
@@ -16,7 +22,7 @@ aslam_(nullptr) {
   tf_init_thread_ = std::make_shared<std::thread>(boost::bind(&AslamDemo::tfInit,this));
   navigation_thread_ = std::make_shared<std::thread>(boost::bind(&AslamDemo::spawnAslam,this,n));
 
-	laser_sub_ = n_.subscribe<sensor_msgs::LaserScan>("/scan",1000000,boost::bind(&AslamDemo::scanCallback,this,_1));
+	laser_sub_ = n_.subscribe<sensor_msgs::LaserScan>("/scan",10,boost::bind(&AslamDemo::scanCallback,this,_1));
 	odometry_sub_ = n_.subscribe<nav_msgs::Odometry>("/odom",1000,boost::bind(&AslamDemo::odomCallback,this,_1));
 	gazebo_model_state_sub_ = n_.subscribe<gazebo_msgs::ModelStates>("/gazebo/model_states",1000,boost::bind(&AslamDemo::gazeboModelStateCallback,this,_1));
 ///	f = std::bind(&AslamDemo::tac, this, _1, _2);
@@ -37,10 +43,96 @@ aslam_(nullptr) {
 	current_pose_ = gtsam::Pose2(0.0,0.0,0.0);
 	transform.setIdentity();
 
+  // The matcher keeps the converted scans of recent matches; keyframes are reused by loop closures
+  // Matches that pass the loose covariance checks but leave most points unexplained are rejected by the overlap check.
+  // Consecutive matches use the cheap Hessian covariance; loop closures keep CSM's full covariance.
+  scan_matcher_ = std::make_shared<mapping::csm::ScanMatcher>(base_T_laser_,.1,64,100000000000000,1000000000000000,.5,.1,mapping::csm::HessianCovariance);
+  // Loop closures are refined on the factor thread with their own matcher, which keeps the keyframes it converted
+  loop_closure_scan_matcher_ = std::make_shared<mapping::csm::ScanMatcher>(base_T_laser_,.1,64,100000000000000,1000000000000000,.4,.1);
+  loop_closure_matcher_ = mapping::correlative::CorrelativeScanMatcher(.05,1.0,.5,6,.55,base_T_laser_);
+  scan_to_map_matcher_ = mapping::scan_to_map::ScanToMapMatcher(3,10,.25,base_T_laser_);
+  feature_matcher_ = mapping::features::FeatureScanMatcher(base_T_laser_);
+
+  // Scan match debug logging is off unless a log file is configured
+  ros::NodeHandle private_n("~");
+  std::string csm_debug_log;
+  int csm_debug_sample_interval,csm_debug_max_records;
+  private_n.param<std::string>("csm_debug_log",csm_debug_log,"");
+  private_n.param("csm_debug_sample_interval",csm_debug_sample_interval,10);
+  private_n.param("csm_debug_max_records",csm_debug_max_records,0);
+  if(!csm_debug_log.empty()) {
+    csm_recorder_ = std::make_shared<mapping::csm::ScanMatchRecorder>(csm_debug_log,64,1081,csm_debug_sample_interval,csm_debug_max_records);
+  }
+
+  // Scans are used unfiltered unless a filter configuration is given
+  std::string scan_filter_config;
+  private_n.param<std::string>("scan_filter_config",scan_filter_config,"");
+  if(!scan_filter_config.empty()) {
+    try {
+      scan_filter_chain_ = mapping::laserscan::readFilterConfiguration(scan_filter_config);
+    }
+    catch(std::exception &ex) {
+      ROS_ERROR("%s",ex.what());
+    }
+  }
+
+  // Scans are matched against their predecessor with PL-ICP unless another front end is selected
+  std::string front_end;
+  private_n.param<std::string>("front_end",front_end,"scan_to_scan");
+  if(front_end == "scan_to_map") {
+    front_end_ = ScanToMap;
+  } else if(front_end == "scan_to_keyframe") {
+    front_end_ = ScanToKeyframe;
+  } else if(front_end == "features") {
+    front_end_ = Features;
+  } else if(front_end != "scan_to_scan") {
+    ROS_ERROR_STREAM("Unknown front end '" << front_end << "', using scan_to_scan.");
+  }
+  // Batches are added to an iSAM2 Bayes tree unless the batch Levenberg-Marquardt back end is selected
+  std::string back_end;
+  private_n.param<std::string>("back_end",back_end,"isam2");
+  if(back_end == "batch") {
+    back_end_ = Batch;
+  } else if(back_end == "fixed_lag") {
+    back_end_ = FixedLag;
+  } else if(back_end != "isam2") {
+    ROS_ERROR_STREAM("Unknown back end '" << back_end << "', using isam2.");
+  }
+  double smoother_lag;
+  private_n.param("smoother_lag",smoother_lag,30.0);
+  fixed_lag_smoother_ = mapping::optimization::FixedLagSmoother(smoother_lag,parameters_);
+  // Only the latest pose covariance is computed online; it scales the loop closure search radius.
+  // The batch back end keeps no factorization, so its exact marginals would refactor the whole graph every cycle.
+  std::string covariance_mode;
+  private_n.param<std::string>("covariance_mode",covariance_mode,back_end_ == Batch ? "conditional" : "exact");
+  if(covariance_mode == "conditional") {
+    covariance_mode_ = mapping::optimization::ConditionalCovariance;
+  } else if(covariance_mode != "exact") {
+    ROS_ERROR_STREAM("Unknown covariance mode '" << covariance_mode << "', using exact.");
+  }
+  private_n.param("loop_closure_radius",loop_closure_radius_,loop_closure_radius_);
+  private_n.param("loop_closure_max_radius",loop_closure_max_radius_,loop_closure_max_radius_);
+  // Each batch of matches is reduced to its keyframe poses before it enters the graph
+  private_n.param("reduce_graph",reduce_graph_,reduce_graph_);
+  double reduction_distance,reduction_rotation,reduction_interval;
+  private_n.param("reduction_distance",reduction_distance,1.0);
+  private_n.param("reduction_rotation",reduction_rotation,0.5);
+  private_n.param("reduction_interval",reduction_interval,10.0);
+  graph_reducer_ = mapping::optimization::PoseGraphReducer(reduction_distance,reduction_rotation,reduction_interval);
+  private_n.param("stationary_distance",stationary_distance_,stationary_distance_);
+  private_n.param("stationary_rotation",stationary_rotation_,stationary_rotation_);
+  private_n.param("keyframe_distance",keyframe_distance_,keyframe_distance_);
+  private_n.param("keyframe_rotation",keyframe_rotation_,keyframe_rotation_);
+  private_n.param("scan_to_map_max_deviation",scan_to_map_max_deviation_,scan_to_map_max_deviation_);
+
   map_service_client_ = n_.serviceClient<nav_msgs::GetMap>("static_map");
   model_state_client_ = n_.serviceClient<gazebo_msgs::GetModelState>("gazebo/get_model_state");
 
    // slam_thread_ = std::thread(&AslamDemo::slamHandler,this);
+  isactive_map_thread_ = true;
+  map_thread_ = std::thread(&AslamDemo::mapBuilder,this);
+  match_thread_ = std::thread(&AslamDemo::matchStage,this);
+  factor_thread_ = std::thread(&AslamDemo::factorStage,this);
 }
 
 void AslamDemo::getMapCallback (nav_msgs::GetMap::Request &req, nav_msgs::GetMap::Response &res) {
@@ -55,7 +147,8 @@ void AslamDemo::tfInit() {
     fromGtsamPose2toTf(current_pose_,transform);
     tf_broadcaster_.sendTransform(tf::StampedTransform(transform.inverse(), ros::Time::now(), base_name_,"/map" ));
   //  ROS_INFO_STREAM("Cell"<<current_map_publishable_.info.resolution);
-    map_pub_.publish(current_map_publishable_);
+    std::shared_ptr<const nav_msgs::OccupancyGrid> grid = std::atomic_load(&front_grid_);
+    if(grid) map_pub_.publish(*grid);
     published = true;
     ros::Duration(4.0).sleep();
    // tf_broadcaster_.sendTransform(tf::StampedTransform(tf::Transform::getIdentity(), ros::Time::now()+ros::Duration(5.0), "/base_link","/map" ));
@@ -72,7 +165,8 @@ void AslamDemo::spawnAslam(ros::NodeHandle& n) {
   initialized = true;
   }
   while(!map_ready);
-  doAslamStuff(prob_map_);
+  std::shared_ptr<const mapping::ProbabilityMap> map = std::atomic_load(&front_map_);
+  doAslamStuff(*map);
   }
 }
 
@@ -86,29 +180,48 @@ void AslamDemo::gazeboModelStateCallback(const gazebo_msgs::ModelStates::ConstPt
 		  odom_temp.pose.pose = input->pose[i];
 		  odom_temp.pose.pose.position.z = 0.0;
 		  odom_temp.twist.twist = input->twist[i];
-		  trueodomreadings_[ros::Time::now()] = odom_temp;
+		  std::lock_guard<std::mutex> lock(odom_mutex_);
+		  trueodomreadings_.insert(odom_temp.header.stamp,odom_temp);
+		  odom_preintegrator_.add(odom_temp);
 		}
 	}
 }
 
 
-void AslamDemo::doScanMatch(sensor_msgs::LaserScan& latest_scan,sensor_msgs::LaserScan& current_scan,mapping::RelativePoseEstimates& relative_poses) {
-  struct sm_params csm_params;
-
-      //Enter the transform form base_link to laser_link
-  nav_msgs::Odometry odom1 = getCorrespondingOdom(latest_scan.header.stamp,odomreadings_);
-  nav_msgs::Odometry odom2 = getCorrespondingOdom(current_scan.header.stamp,odomreadings_);
+gtsam::Pose2 AslamDemo::computeOdomGuess(const ros::Time& time1,const ros::Time& time2) {
+  gtsam::Pose2 pose1, pose2;
+  {
+    std::lock_guard<std::mutex> lock(odom_mutex_);
+    if(!mapping::odometry::interpolatePose(odomreadings_,time1,pose1) || !mapping::odometry::interpolatePose(odomreadings_,time2,pose2)) {
+      return gtsam::Pose2(0.0,0.0,0.0);
+    }
+  }
 
-  gtsam::Pose2 initial_pose = getRelativeOdom(odom1,odom2);
-  if (std::isnan(initial_pose.x()) || std::isnan(initial_pose.x()) || std::isnan(initial_pose.x())) {
+  gtsam::Pose2 initial_pose = pose1.between(pose2);
+  if (std::isnan(initial_pose.x()) || std::isnan(initial_pose.y()) || std::isnan(initial_pose.theta())) {
     initial_pose =  gtsam::Pose2(0.0,0.0,0.0);
   }
+  return initial_pose;
+}
+
+bool AslamDemo::computeOdomMotion(const ros::Time& time1,const ros::Time& time2,gtsam::Pose2& motion) {
+  gtsam::Pose2 pose1, pose2;
+  {
+    std::lock_guard<std::mutex> lock(odom_mutex_);
+    // Outside the buffer the interpolation clamps to its ends, which understates the motion
+    if(odomreadings_.empty() || time1 < odomreadings_.front().first || time2 > odomreadings_.back().first) return false;
+    if(!mapping::odometry::interpolatePose(odomreadings_,time1,pose1) || !mapping::odometry::interpolatePose(odomreadings_,time2,pose2)) return false;
+  }
+  motion = pose1.between(pose2);
+  return !(std::isnan(motion.x()) || std::isnan(motion.y()) || std::isnan(motion.theta()));
+}
+
+void AslamDemo::doScanMatch(const sensor_msgs::LaserScan& latest_scan,const sensor_msgs::LaserScan& current_scan,mapping::RelativePoseEstimates& relative_poses) {
+      //Enter the transform form base_link to laser_link
+  gtsam::Pose2 initial_pose = computeOdomGuess(latest_scan.header.stamp,current_scan.header.stamp);
   mapping::RelativePoseEstimate laser_pose;
   try {
-    laser_pose = mapping::csm::computeLaserScanMatch(latest_scan,
-        current_scan,
-    csm_params,
-    initial_pose,base_T_laser_,.1,100000000000000,1000000000000000,"../");
+    laser_pose = scan_matcher_->match(latest_scan,current_scan,initial_pose,csm_recorder_.get());
     //laser_pose.relative_pose.print("Laser Scan Match:");
      // laser_poses_.push_back(laser_pose);
     relative_poses.push_back(laser_pose);
@@ -120,33 +233,181 @@ void AslamDemo::doScanMatch(sensor_msgs::LaserScan& latest_scan,sensor_msgs::Las
 
 }
 
+bool AslamDemo::doScanToMapMatch(const sensor_msgs::LaserScan& latest_scan,const sensor_msgs::LaserScan& current_scan,mapping::RelativePoseEstimates& relative_poses) {
+  // The pyramid is only rebuilt when the map builder has swapped in a new snapshot
+  std::shared_ptr<const mapping::ProbabilityMap> map = std::atomic_load(&front_map_);
+  if(!map) return false;
+  if(map != front_end_map_) {
+    scan_to_map_matcher_.setMap(*map);
+    front_end_map_ = map;
+
+    // The dead-reckoned pose drifts away from the map; restart it from the latest optimized pose and the odometry since
+    std::shared_ptr<const std::pair<ros::Time,gtsam::Pose2> > anchor = std::atomic_load(&front_end_anchor_);
+    if(anchor && anchor->first <= latest_scan.header.stamp) {
+      gtsam::Pose2 odom1, odom2;
+      std::lock_guard<std::mutex> lock(odom_mutex_);
+      if(mapping::odometry::interpolatePose(odomreadings_,anchor->first,odom1) && mapping::odometry::interpolatePose(odomreadings_,latest_scan.header.stamp,odom2)) {
+        front_end_pose_ = anchor->second*odom1.between(odom2);
+      }
+    }
+  }
+
+  gtsam::Pose2 initial_pose = front_end_pose_*computeOdomGuess(latest_scan.header.stamp,current_scan.header.stamp);
+  gtsam::Pose2 map_pose;
+  gtsam::Matrix map_cov;
+  if(!scan_to_map_matcher_.match(current_scan,initial_pose,map_pose,map_cov)) return false;
+  if(initial_pose.localCoordinates(map_pose).norm() > scan_to_map_max_deviation_) {
+    ROS_DEBUG("Scan-to-map match deviation from the odometry guess is too large.");
+    return false;
+  }
+
+  // The map pose is turned into a relative pose so the factor stage is unchanged; its covariance is
+  // expressed in the frame of the previous pose
+  mapping::RelativePoseEstimate laser_pose;
+  laser_pose.timestamp1 = latest_scan.header.stamp;
+  laser_pose.timestamp2 = current_scan.header.stamp;
+  laser_pose.relative_pose = front_end_pose_.between(map_pose);
+  gtsam::Matrix rotation = gtsam::eye(3);
+  rotation.block(0,0,2,2) = front_end_pose_.rotation().matrix().transpose();
+  laser_pose.cov = rotation*map_cov*rotation.transpose();
+  relative_poses.push_back(laser_pose);
+  return true;
+}
+
+bool AslamDemo::doFeatureMatch(const sensor_msgs::LaserScan& latest_scan,const sensor_msgs::LaserScan& current_scan,mapping::RelativePoseEstimates& relative_poses) {
+  // The features of the reference scan are kept from the previous match
+  if(previous_features_.timestamp != latest_scan.header.stamp) {
+    previous_features_ = feature_matcher_.extractFeatures(latest_scan);
+  }
+  mapping::features::ScanFeatures current_features = feature_matcher_.extractFeatures(current_scan);
+
+  gtsam::Pose2 initial_pose = computeOdomGuess(latest_scan.header.stamp,current_scan.header.stamp);
+  bool matched = true;
+  try {
+    relative_poses.push_back(feature_matcher_.match(previous_features_,current_features,initial_pose));
+  }
+  catch(std::exception &ex) {
+    ROS_DEBUG("%s",ex.what());
+    matched = false;
+  }
+  previous_features_ = current_features;
+  return matched;
+}
+
 void AslamDemo::scanCallback(const sensor_msgs::LaserScan::ConstPtr& scan_ptr) {
-	if (laserscans_.empty()) {
-		laserscans_[scan_ptr->header.stamp] = *scan_ptr;
-		return;
+	// The front end runs on the pipeline threads; the callback only hands the scan over
+	scan_queue_.push(scan_ptr);
+}
+
+void AslamDemo::matchStage() {
+	sensor_msgs::LaserScan::ConstPtr scan_ptr;
+	while(scan_queue_.pop(scan_ptr)) {
+		// Filter once; the matcher and the mapper both see the filtered scan
+		if(!scan_filter_chain_.empty()) {
+			// Filter into a buffer that no longer backs previous_scan_; copying into it reuses its storage
+			sensor_msgs::LaserScan::Ptr filtered_scan;
+			for(const auto& buffer : filtered_scans_) {
+				if(buffer.use_count() == 1) {
+					filtered_scan = buffer;
+					break;
+				}
+			}
+			if(!filtered_scan) {
+				filtered_scan.reset(new sensor_msgs::LaserScan());
+				filtered_scans_.push_back(filtered_scan);
+			}
+			*filtered_scan = *scan_ptr;
+			scan_filter_chain_.apply(*filtered_scan);
+			scan_ptr = filtered_scan;
+		}
+		if (!previous_scan_) {
+			previous_scan_ = scan_ptr;
+			storeKeyframe(scan_ptr);
+			continue;
+		}
+		// Scans taken while the robot stands still add no constraint. In keyframe mode, scans are only
+		// matched once the robot has moved far enough from the reference keyframe. Without odometry
+		// covering both scans the motion is unknown, and the scan is matched.
+		gtsam::Pose2 motion;
+		if(computeOdomMotion(previous_scan_->header.stamp,scan_ptr->header.stamp,motion)) {
+			double distance = motion.t().norm();
+			double rotation = std::fabs(motion.theta());
+			bool stationary = (distance < stationary_distance_ && rotation < stationary_rotation_);
+			bool keyframe_pending = (front_end_ == ScanToKeyframe && distance < keyframe_distance_ && rotation < keyframe_rotation_);
+			if(stationary || keyframe_pending) {
+				++skipped_scans_;
+				continue;
+			}
+		}
+
+		// Scans dropped by the queue are bridged by matching against the last processed scan
+		mapping::RelativePoseEstimates relative_poses;
+		bool matched = false;
+		if(front_end_ == ScanToMap) {
+			matched = doScanToMapMatch(*previous_scan_,*scan_ptr,relative_poses);
+		} else if(front_end_ == Features) {
+			matched = doFeatureMatch(*previous_scan_,*scan_ptr,relative_poses);
+		}
+		if(!matched) {
+			doScanMatch(*previous_scan_,*scan_ptr,relative_poses);
+		}
+		for(const auto& relative_pose: relative_poses) {
+			front_end_pose_ = front_end_pose_*relative_pose.relative_pose;
+			match_queue_.push(relative_pose);
+		}
+		previous_scan_ = scan_ptr;
+		storeKeyframe(scan_ptr);
 	}
-	sensor_msgs::LaserScan latest_scan = laserscans_.rbegin()->second;
-	sensor_msgs::LaserScan current_scan = *scan_ptr;
-	doScanMatch(latest_scan,current_scan,laser_pose_cache_);
+}
+
+void AslamDemo::factorStage() {
+	mapping::RelativePoseEstimate relative_pose;
+	while(match_queue_.pop(relative_pose)) {
+		laser_pose_cache_.push_back(relative_pose);
+		{
+			// Every matched scan becomes a pose; the preintegrator closes an odometry increment there
+			std::lock_guard<std::mutex> lock(odom_mutex_);
+			odom_preintegrator_.declareKeyframe(relative_pose.timestamp1);
+			odom_preintegrator_.declareKeyframe(relative_pose.timestamp2);
+		}
 
     if (laser_pose_cache_.size()%40 == 0) {
       missing_scan_counter_ = 0;
-      time_ = latest_scan.header.stamp;
+      time_ = relative_pose.timestamp1;
       ros::Time curr_time = ros::Time::now();
     	slam(curr_time);
+
+      ScanQueue::Metrics scan_metrics = scan_queue_.metrics();
+      MatchQueue::Metrics match_metrics = match_queue_.metrics();
+      ROS_DEBUG_STREAM("Scan queue: depth " << scan_metrics.depth << ", high water " << scan_metrics.high_water_mark << ", dropped " << scan_metrics.dropped << " of " << scan_metrics.pushed + scan_metrics.dropped
+          << ". Match queue: depth " << match_metrics.depth << ", high water " << match_metrics.high_water_mark << ". Skipped " << skipped_scans_ << " scans without enough motion.");
     }
     else if(missing_scan_counter_ > 50){
-      time_ = latest_scan.header.stamp;
+      time_ = relative_pose.timestamp1;
     }
   missing_scan_counter_ ++;
+	}
+}
+
+void AslamDemo::storeKeyframe(const sensor_msgs::LaserScan::ConstPtr& scan_ptr) {
+	// Only keyframes are kept for map insertion and loop closure
+	gtsam::Pose2 odom_pose;
+	{
+		std::lock_guard<std::mutex> lock(odom_mutex_);
+		if(!mapping::odometry::interpolatePose(odomreadings_,scan_ptr->header.stamp,odom_pose)) return;
+	}
+	if(!keyframe_selector_.check(scan_ptr->header.stamp,odom_pose,scan_ptr.get(),base_T_laser_)) return;
+
+	std::lock_guard<std::mutex> lock(scans_mutex_);
 	laserscans_[scan_ptr->header.stamp] = *scan_ptr;
+	ROS_DEBUG_STREAM("Keyframe " << keyframe_selector_.selected() << " of " << keyframe_selector_.tested() << " scans at " << scan_ptr->header.stamp);
 }
 
 
 void AslamDemo::slamHandler() {
 	std::unique_lock<std::mutex> lk(slam_mutex);
 	while(isactive_slam_thread_) {
-		slam_cv.wait(lk,[&](){return (laser_poses_.size() % 200 == 0 && !isactive_slam_thread_);});
+		slam_cv.wait(lk,[&](){return (processed_matches_ % 200 == 0 && !isactive_slam_thread_);});
 		if (!isactive_slam_thread_) {
 			return;
 		}
@@ -156,21 +417,13 @@ void AslamDemo::slamHandler() {
 
 void AslamDemo::odomCallback(const nav_msgs::Odometry::ConstPtr& odom_ptr) {
 	nav_msgs::Odometry odom = *odom_ptr;
-	if (odomreadings_.empty()) {
-		odomreadings_[odom.header.stamp] = odom;
-		return;
-	}
-	odomreadings_[odom.header.stamp] = odom;
-
-	if(!trueodomreadings_.empty()) {
-//ROS_INFO_STREAM("Odom Stream:"<<odom.pose.pose.position<<"\t"<<getCorrespondingOdom(odom.header.stamp,trueodomreadings_).pose.pose.position);
-	}
-
+	std::lock_guard<std::mutex> lock(odom_mutex_);
+	odomreadings_.insert(odom.header.stamp,odom);
 }
 
 void AslamDemo::createZeroInitialGuess() {
 	initial_guess_.clear();
-	gtsam::KeySet keys = factor_graph_.keys();
+	gtsam::KeySet keys = graph_manager_.graph().keys();
 	for (auto const iter: keys) {
 		initial_guess_.insert(iter,gtsam::Pose2(0.0,0.0,0.0));
 	}
@@ -181,6 +434,46 @@ void AslamDemo::connectWithOdometry(gtsam::NonlinearFactorGraph& factor_graph,gt
 
   ROS_INFO_STREAM("Connect with odom entered");
 	gtsam::KeySet keys = factor_graph.keys();
+	if(keys.empty()) return;
+
+	// The preintegrator has the increments between consecutive matched scans ready. They are used when
+	// they chain through every pose of the batch; otherwise the odometry history is searched below.
+	mapping::RelativePoseEstimates increments;
+	{
+		std::lock_guard<std::mutex> lock(odom_mutex_);
+		odom_preintegrator_.collect(key_generator_.extractTimestamp(*keys.rbegin()) + ros::Duration(time_tolerance),increments);
+	}
+	if(reduce_graph_) {
+		// The increments run between all matched scans; compose them through the poses the reducer dropped
+		mapping::Timestamps kept;
+		for(const auto& increment : increments) {
+			if(keys.count(key_generator_.generateKey(factors::key_type::Pose2,increment.timestamp1))) kept.insert(increment.timestamp1);
+			if(keys.count(key_generator_.generateKey(factors::key_type::Pose2,increment.timestamp2))) kept.insert(increment.timestamp2);
+		}
+		increments = graph_reducer_.restrictTo(increments,kept);
+	}
+	gtsam::KeySet increment_keys;
+	bool chained = !increments.empty();
+	for(const auto& increment : increments) {
+		gtsam::Key key1 = key_generator_.generateKey(factors::key_type::Pose2,increment.timestamp1);
+		gtsam::Key key2 = key_generator_.generateKey(factors::key_type::Pose2,increment.timestamp2);
+		if(!increment_keys.empty() && key1 != *increment_keys.rbegin()) chained = false;
+		increment_keys.insert(key1);
+		increment_keys.insert(key2);
+	}
+	if(chained && std::includes(increment_keys.begin(),increment_keys.end(),keys.begin(),keys.end())) {
+		factor_graph.push_back(mapping::odometry::createOdometryFactors(increments,time_tolerance));
+		gtsam::Pose2 curr_pose = current_pose_;
+		initial_guess.insert(*increment_keys.begin(),curr_pose);
+		for(const auto& increment : increments) {
+			curr_pose = curr_pose.compose(increment.relative_pose);
+			gtsam::Key key = key_generator_.generateKey(factors::key_type::Pose2,increment.timestamp2);
+			if(!initial_guess.exists(key)) initial_guess.insert(key,curr_pose);
+		}
+		return;
+	}
+	ROS_DEBUG_STREAM("Preintegrated odometry does not cover the batch; interpolating the odometry history.");
+
 	mapping::Timestamps extracted_timestamps,timestamps;
 	gtsam::Vector sigmas(6);
 	double time_threshold = 5.0;
@@ -219,7 +512,11 @@ void AslamDemo::connectWithOdometry(gtsam::NonlinearFactorGraph& factor_graph,gt
 	if(!timestamps.size()) return;
 
 	//mapping::RelativePoseEstimates relative_estimates = mapping::odometry::computeRelativePoses(odomreadings_,timestamps,sigmas,time_tolerance);
-  mapping::RelativePoseEstimates relative_estimates = mapping::odometry::computeRelativePoses(trueodomreadings_,timestamps,sigmas,time_tolerance);
+  mapping::RelativePoseEstimates relative_estimates;
+  {
+    std::lock_guard<std::mutex> lock(odom_mutex_);
+    relative_estimates = mapping::odometry::computeRelativePoses(trueodomreadings_,timestamps,sigmas,time_tolerance);
+  }
 
 	gtsam::NonlinearFactorGraph odom_graph = mapping::odometry::createOdometryFactors(relative_estimates,time_tolerance,keys);
 
@@ -250,9 +547,17 @@ void AslamDemo::fromGtsamPose2toTf(const gtsam::Pose2 &pose2, tf::Transform &tra
 }
 
 void AslamDemo::updateKDTree(const gtsam::Values& values) {
+	// Every pose is in the tree once; poses moved by the optimizer are re-inserted at their new position
 	for(auto const iter: values) {
 		gtsam::Pose2 pose = values.at<gtsam::Pose2>(iter.key);
 		poseNode node(pose.x(),pose.y(),pose.theta(),iter.key);
+		auto inserted = kdtree_nodes_.insert(std::make_pair(iter.key,node));
+		if(!inserted.second) {
+			poseNode& previous = inserted.first->second;
+			if(previous.distance_to(node) < .05 && std::fabs(previous.d[2] - node.d[2]) < .05) continue;
+			pose_tree_.erase(previous);
+			previous = node;
+		}
 		pose_tree_.insert(node);
 	}
 }
@@ -260,11 +565,38 @@ void AslamDemo::updateKDTree(const gtsam::Values& values) {
 void AslamDemo::searchForLoopClosure(gtsam::NonlinearFactorGraph& factor_graph,gtsam::Values& values) {
   if(factor_graph.size()) return;
 
+  // Candidate pairs are collected first and verified as one batch on all cores
+  std::vector<const sensor_msgs::LaserScan*> candidate_scans1,candidate_scans2;
+  std::vector<gtsam::Pose2> candidate_guesses,original_guesses;
+  std::map<mapping::TimestampPair,std::pair<gtsam::Key,gtsam::Key> > candidate_keys;
+  mapping::RelativePoseEstimates cached_matches;
+
+  // The latest pose is the least certain one; its position uncertainty bounds the drift any pair can have accumulated
+  double limit = loop_closure_radius_;
+  if(!pose_with_cov_.empty()) {
+    const gtsam::Matrix& cov = pose_with_cov_.rbegin()->second;
+    limit = std::min(std::max(limit,3.0*std::sqrt(cov(0,0) + cov(1,1))),loop_closure_max_radius_);
+  }
+
+  // New poses are searched once. Older poses near the latest one are searched again, since the optimization may
+  // have brought them within range of an earlier pose; their pairs hit the cache unless the guess has changed.
+  std::set<gtsam::Key> query_keys;
   for(auto const iter: values) {
-    gtsam::Pose2 pose = values.at<gtsam::Pose2>(iter.key);
-    poseNode input(pose.x(),pose.y(),pose.theta(),iter.key);
+    if(iter.key > loop_closure_queried_key_) query_keys.insert(iter.key);
+  }
+  if(!values.empty()) {
+    gtsam::Pose2 latest = extractLatestPose(values);
+    std::vector<poseNode> nearby;
+    pose_tree_.find_within_range(poseNode(latest.x(),latest.y(),latest.theta(),0),limit,std::back_insert_iterator<std::vector<poseNode> >(nearby));
+    for(const auto& node: nearby) {
+      if(values.exists(node.key_)) query_keys.insert(node.key_);
+    }
+  }
+
+  for(gtsam::Key query_key: query_keys) {
+    gtsam::Pose2 pose = values.at<gtsam::Pose2>(query_key);
+    poseNode input(pose.x(),pose.y(),pose.theta(),query_key);
     std::vector<poseNode> neighbours;
-    double limit = 1.0;
     pose_tree_.find_within_range(input,limit,std::back_insert_iterator<std::vector<poseNode> >(neighbours));
     if (!neighbours.size()) continue;
 //    std::pair<tree_type::const_iterator,double> found = pose_tree_.find_nearest(input);
@@ -284,20 +616,33 @@ void AslamDemo::searchForLoopClosure(gtsam::NonlinearFactorGraph& factor_graph,g
       }
     }
     if(min_angle_dist == 100.0) continue;
-    auto iter1 = laserscans_.lower_bound(input_time);
-    auto iter2 = laserscans_.lower_bound(max_node_stamp);
-
-    if(iter1 != laserscans_.end() && iter2 != laserscans_.end()) {
-
-      mapping::RelativePoseEstimates relative_poses;
-      doScanMatch(iter1->second,iter2->second,relative_poses);
+    // A pair that already has a loop closure factor is not matched again
+    if(graph_manager_.hasLoopClosure(input.key_,maxNode.key_)) continue;
+    // Only keyframe poses have a scan to match. Keyframes are never erased, so the pointers stay valid.
+    const sensor_msgs::LaserScan* scan1;
+    const sensor_msgs::LaserScan* scan2;
+    {
+      std::lock_guard<std::mutex> lock(scans_mutex_);
+      scan1 = mapping::map::findMapScan(laserscans_,input_time,time_tolerance);
+      scan2 = mapping::map::findMapScan(laserscans_,max_node_stamp,time_tolerance);
+    }
 
-      if(relative_poses.size() != 0) {
-        const gtsam::Pose2 relative_pose = relative_poses.begin()->relative_pose;
-        gtsam::noiseModel::Base::shared_ptr noise_model(gtsam::noiseModel::Gaussian::Covariance(relative_poses.begin()->cov, true));
-        gtsam::NonlinearFactor::shared_ptr factor(new factors::LaserScanFactor(input.key_, maxNode.key_, relative_pose, noise_model));
-        factor_graph.push_back(factor);
+    if(scan1 && scan2 && scan1 != scan2
+        && candidate_keys.insert(std::make_pair(mapping::TimestampPair(scan1->header.stamp,scan2->header.stamp),std::make_pair(input.key_,maxNode.key_))).second) {
+      // The current estimates give the guess; their drift is what the correlative search absorbs
+      gtsam::Pose2 guess = pose.between(gtsam::Pose2(maxNode.d[0],maxNode.d[1],maxNode.d[2]));
+
+      // Pairs already evaluated with a similar guess are not matched again, whatever the outcome was
+      mapping::RelativePoseEstimate cached_match;
+      bool cached_valid;
+      if(loop_closure_cache_.lookup(scan1->header.stamp,scan2->header.stamp,guess,cached_match,cached_valid)) {
+        if(cached_valid) cached_matches.push_back(cached_match);
+        continue;
       }
+      candidate_scans1.push_back(scan1);
+      candidate_scans2.push_back(scan2);
+      candidate_guesses.push_back(guess);
+      original_guesses.push_back(guess);
     }
 
    /* poseNode output;
@@ -335,12 +680,102 @@ void AslamDemo::searchForLoopClosure(gtsam::NonlinearFactorGraph& factor_graph,g
       ROS_INFO_STREAM("KDTree search failed!!");
     }*/
   }
+  if(!values.empty()) loop_closure_queried_key_ = std::max(loop_closure_queried_key_,*values.keys().rbegin());
+  ROS_DEBUG_STREAM("Loop closure cache: " << cached_matches.size() << " cached matches, " << candidate_scans1.size() << " new candidates, "
+      << loop_closure_cache_.hits() << " hits and " << loop_closure_cache_.misses() << " misses in total.");
+
+  // The features of each keyframe are extracted once; a candidate pair then costs a few dozen feature comparisons
+  std::vector<const sensor_msgs::LaserScan*> new_keyframes;
+  for(size_t i = 0; i < candidate_scans1.size(); ++i) {
+    for(const sensor_msgs::LaserScan* scan: {candidate_scans1[i],candidate_scans2[i]}) {
+      if(keyframe_features_.insert(std::make_pair(scan->header.stamp,mapping::features::ScanFeatures())).second) new_keyframes.push_back(scan);
+    }
+  }
+  mapping::parallelFor(new_keyframes.size(),0,[&](size_t i) {
+    keyframe_features_.at(new_keyframes[i]->header.stamp) = feature_matcher_.extractFeatures(*new_keyframes[i]);
+  });
+
+  // Candidates whose features agree take the feature match as their ICP guess. The others fall back to searching
+  // the whole drift window with the correlative matcher; only candidates either one accepts are refined by ICP.
+  std::vector<char> accepted(candidate_scans1.size(),0);
+  mapping::parallelFor(candidate_scans1.size(),0,[&](size_t i) {
+    try {
+      candidate_guesses[i] = feature_matcher_.match(keyframe_features_.at(candidate_scans1[i]->header.stamp),
+          keyframe_features_.at(candidate_scans2[i]->header.stamp),candidate_guesses[i]).relative_pose;
+      accepted[i] = 1;
+      return;
+    } catch(std::exception &) {
+      // Too few features correspond, e.g. in cluttered areas
+    }
+    gtsam::Pose2 correlative_pose;
+    double score;
+    if(loop_closure_matcher_.match(*candidate_scans1[i],*candidate_scans2[i],candidate_guesses[i],correlative_pose,score)) {
+      candidate_guesses[i] = correlative_pose;
+      accepted[i] = 1;
+    }
+  });
+  size_t accepted_count = 0;
+  for(size_t i = 0; i < accepted.size(); ++i) {
+    if(!accepted[i]) {
+      loop_closure_cache_.insertFailure(candidate_scans1[i]->header.stamp,candidate_scans2[i]->header.stamp,original_guesses[i]);
+      continue;
+    }
+    candidate_scans1[accepted_count] = candidate_scans1[i];
+    candidate_scans2[accepted_count] = candidate_scans2[i];
+    candidate_guesses[accepted_count] = candidate_guesses[i];
+    original_guesses[accepted_count] = original_guesses[i];
+    ++accepted_count;
+  }
+  ROS_DEBUG_STREAM("Correlative matching accepted " << accepted_count << " of " << accepted.size() << " loop closure candidates.");
+  candidate_scans1.resize(accepted_count);
+  candidate_scans2.resize(accepted_count);
+  candidate_guesses.resize(accepted_count);
+  original_guesses.resize(accepted_count);
+
+  mapping::RelativePoseEstimates relative_poses;
+  if(accepted_count) {
+    // ICP and the overlap check run one candidate at a time; CSM serializes sm_icp anyway
+    for(size_t i = 0; i < accepted_count; ++i) {
+      try {
+        relative_poses.push_back(loop_closure_scan_matcher_->match(*candidate_scans1[i],*candidate_scans2[i],candidate_guesses[i]));
+      } catch(std::exception &ex) {
+        ROS_DEBUG("Loop closure rejected: %s",ex.what());
+      }
+    }
+
+    // Remember the outcome of every candidate under the guess it was looked up with
+    std::map<mapping::TimestampPair,const mapping::RelativePoseEstimate*> verified;
+    for(const auto& relative_pose: relative_poses) {
+      verified[mapping::TimestampPair(relative_pose.timestamp1,relative_pose.timestamp2)] = &relative_pose;
+    }
+    for(size_t i = 0; i < accepted_count; ++i) {
+      const ros::Time& timestamp1 = candidate_scans1[i]->header.stamp;
+      const ros::Time& timestamp2 = candidate_scans2[i]->header.stamp;
+      auto match = verified.find(mapping::TimestampPair(timestamp1,timestamp2));
+      if(match != verified.end()) {
+        loop_closure_cache_.insert(timestamp1,timestamp2,original_guesses[i],*match->second);
+      } else {
+        loop_closure_cache_.insertFailure(timestamp1,timestamp2,original_guesses[i]);
+      }
+    }
+  }
+  relative_poses.insert(relative_poses.end(),cached_matches.begin(),cached_matches.end());
+
+  for(const auto& relative_pose: relative_poses) {
+    const std::pair<gtsam::Key,gtsam::Key>& keys = candidate_keys[mapping::TimestampPair(relative_pose.timestamp1,relative_pose.timestamp2)];
+    gtsam::noiseModel::Base::shared_ptr noise_model(gtsam::noiseModel::Gaussian::Covariance(relative_pose.cov, true));
+    gtsam::NonlinearFactor::shared_ptr factor(new factors::LaserScanFactor(keys.first, keys.second, relative_pose.relative_pose, noise_model));
+    factor_graph.push_back(factor);
+  }
 }
 
 void AslamDemo::getTrueEstimates(gtsam::Values& input_estimates,gtsam::Values& true_estimates) {
+	std::lock_guard<std::mutex> lock(odom_mutex_);
 	for(auto const iter: input_estimates) {
 		ros::Time timestamp = key_generator_.extractTimestamp(iter.key);
-		nav_msgs::Odometry corresponding_odom = getCorrespondingOdom(timestamp,trueodomreadings_);
+		const nav_msgs::Odometry* odom = getCorrespondingOdom(timestamp,trueodomreadings_);
+		if(!odom) return;
+		const nav_msgs::Odometry& corresponding_odom = *odom;
 		tf::Quaternion q(corresponding_odom.pose.pose.orientation.x,corresponding_odom.pose.pose.orientation.y,corresponding_odom.pose.pose.orientation.z,corresponding_odom.pose.pose.orientation.w);
 		double roll,pitch,yaw;
 		FromQuaternionToRPY(q,roll,pitch,yaw);
@@ -359,69 +794,132 @@ void AslamDemo::slam(ros::Time& time) {
 		return;
 	}
 //	factor_graph_ = mapping::laserscan::createLaserScanFactors(laser_poses_,time_tolerance);
-	gtsam::NonlinearFactorGraph factor_graph = mapping::laserscan::createLaserScanFactors(laser_pose_cache_,time_tolerance);
+	// Poses without a keyframe scan only chain the matches; their matches are composed into one per keyframe pair.
+	// The end of the batch is kept, as the next batch starts from it.
+	mapping::RelativePoseEstimates matches = laser_pose_cache_;
+	if(reduce_graph_) {
+		mapping::Timestamps required,kept;
+		required.insert(laser_pose_cache_.back().timestamp2);
+		{
+			std::lock_guard<std::mutex> lock(scans_mutex_);
+			for(const auto& match : laser_pose_cache_) {
+				if(laserscans_.count(match.timestamp2)) required.insert(match.timestamp2);
+			}
+		}
+		matches = graph_reducer_.reduce(laser_pose_cache_,required,kept);
+	}
+	gtsam::NonlinearFactorGraph factor_graph = mapping::laserscan::createLaserScanFactors(matches,time_tolerance);
 	gtsam::Values initial_guess,pose_estimates;
 //	connectWithOdometry(factor_graph_);
 	connectWithOdometry(factor_graph,initial_guess);
 //	ROS_INFO_STREAM("Initial Guess"<<initial_guess_.size());
-	if(!mapping::optimization::validateFactorGraph(factor_graph,initial_guess)) {
+	if(!graph_manager_.validate(factor_graph,initial_guess)) {
 	//if(!mapping::optimization::validateFactorGraph(factor_graph_,initial_guess_)) {
 		ROS_INFO_STREAM("Not Validated!!");
 		return;
 	}
 
 //	pose_estimates_ = mapping::optimization::optimizeFactorGraph(factor_graph_,initial_guess_,parameters_);
-	pose_estimates = mapping::optimization::optimizeFactorGraph(factor_graph,initial_guess,parameters_);
+	// Consecutive batches share their boundary pose. A batch that shares none, such as the first one,
+	// is anchored at its initial guess so the full graph stays well determined.
+	bool connected = false;
+	for(const auto& key_value : initial_guess) {
+		if(graph_manager_.exists(key_value.key)) {
+			connected = true;
+			break;
+		}
+	}
+	if(!connected) {
+		gtsam::Key first_key = *initial_guess.keys().begin();
+		gtsam::Vector sigmas(3);
+		sigmas<<0.001,0.001,0.001;
+		factor_graph.push_back(gtsam::NonlinearFactor::shared_ptr(new gtsam::PriorFactor<gtsam::Pose2>(first_key,initial_guess.at<gtsam::Pose2>(first_key),gtsam::noiseModel::Diagonal::Sigmas(sigmas))));
+	}
+	graph_manager_.addFactors(factor_graph);
+	graph_manager_.addValues(initial_guess);
+	pose_estimates = optimizeGraph(0);
 //	gtsam::Values true_estimates;
 //	getTrueEstimates(pose_estimates,true_estimates);
 //	pose_estimates = true_estimates;
 	current_pose_ = extractLatestPose(pose_estimates);
 	current_pose_.print("Current Pose: ");
-	if(loops_ % skip_loopclosure_ ) searchForLoopClosure(factor_graph_,pose_estimates);
+	try {
+		std::set<gtsam::Key> latest_key;
+		latest_key.insert(*pose_estimates.keys().rbegin());
+		pose_with_cov_ = computePoseCovariances(latest_key);
+	} catch(std::exception &ex) {
+		ROS_WARN("%s",ex.what());
+		pose_with_cov_.clear();
+	}
+
+	// Loop closures are optimized right away; the extra steps let the incremental back end relinearize the loop
+	gtsam::NonlinearFactorGraph loop_closures;
+	if(loops_ % skip_loopclosure_ ) searchForLoopClosure(loop_closures,pose_estimates);
+	if(loop_closures.size() && graph_manager_.addLoopClosures(loop_closures)) {
+		for(const auto& key_value : optimizeGraph(2)) {
+			if(pose_estimates.exists(key_value.key)) pose_estimates.update(key_value.key,key_value.value);
+			else pose_estimates.insert(key_value.key,key_value.value);
+		}
+		current_pose_ = extractLatestPose(pose_estimates);
+	}
+	// The scan-to-map front end restarts from this pose when it picks up the next map
+	std::atomic_store(&front_end_anchor_, std::shared_ptr<const std::pair<ros::Time,gtsam::Pose2> >(
+			std::make_shared<std::pair<ros::Time,gtsam::Pose2> >(key_generator_.extractTimestamp(*pose_estimates.keys().rbegin()),current_pose_)));
 	updateKDTree(pose_estimates);
 	if (!pose_estimates.size()) {
 		return;
 	}
-	//pose_with_cov_ = mapping::optimization::computeCovariances(factor_graph_,pose_estimates_);
 	loops_ ++;
 
-//	pose_estimates_.print("Pose Estimates");
-//	prob_map_.clear();
-	if (!map_initialized_) {
-			prob_map_ = mapping::map::createEmptyMap(pose_estimates,.025,15.0);
-			map_initialized_ = true;
+	// Hand the new estimates to the map builder thread. Jobs that were not picked up yet are merged.
+	{
+		std::lock_guard<std::mutex> lock(map_mutex_);
+		for(const auto& key_value : pose_estimates) {
+			if(map_job_.exists(key_value.key)) map_job_.update(key_value.key, key_value.value);
+			else map_job_.insert(key_value.key, key_value.value);
+		}
+		map_job_pending_ = true;
 	}
-  std::string filename = "currmap";
-
-	mapping::map::buildMap(prob_map_,pose_estimates,laserscans_,base_T_laser_,.01,time_tolerance,filename);
-
-	ROS_INFO_STREAM("Map Initialized");
-	ROS_INFO_STREAM("Map Formed!!");
-
-	prob_map_.occupancyGrid(current_map_);
+	map_cv_.notify_one();
 
-	prob_map_.getPublishableMap(current_map_,current_map_publishable_);
- // mapping::map::writeMap(filename,current_map_publishable_,0.2,0.8);
-	prob_map_.occupancyGrid(filename);
 	tflistflag_ = true;
-	map_ready = true;
-	//prob_map_.print("Prob Map");
 	tf::Transform transform;
 	fromGtsamPose2toTf(current_pose_,transform);
 	tf_broadcaster_.sendTransform(tf::StampedTransform(transform.inverse(), time,base_name_,"map" ));
  // tf_broadcaster_.sendTransform(tf::StampedTransform(transform, ros::Time::now(), "base_link","map" ));
 
-
-	ROS_INFO_STREAM("Map Formed"<<prob_map_.origin());
-//	current_map_  = fromGtsamMatrixToROS(occupancy_map);
-	map_pub_.publish(current_map_publishable_);
-	//doAslamStuff(prob_map_);
-//	pose_estimates_.insert(pose_estimates);
-	factor_graph_.push_back(factor_graph);
-	laser_poses_.insert(laser_poses_.end(),laser_pose_cache_.begin(),laser_pose_cache_.end());
+	// The matches live on in the graph; only their count is kept
+	processed_matches_ += laser_pose_cache_.size();
 	laser_pose_cache_.clear();
 }
 
+gtsam::Values AslamDemo::optimizeGraph(size_t extra_iterations) {
+	gtsam::Values pose_estimates;
+	if(back_end_ == Incremental) {
+		// Only the delta since the last cycle is handed to the Bayes tree
+		pose_estimates = incremental_optimizer_.update(graph_manager_.newFactors(),graph_manager_.newValues(),extra_iterations);
+	} else if(back_end_ == FixedLag) {
+		std::map<gtsam::Key,ros::Time> timestamps;
+		for(const auto& key_value : graph_manager_.newValues()) {
+			timestamps[key_value.key] = key_generator_.extractTimestamp(key_value.key);
+		}
+		pose_estimates = fixed_lag_smoother_.update(graph_manager_.newFactors(),graph_manager_.newValues(),timestamps);
+	} else {
+		pose_estimates = mapping::optimization::optimizeFactorGraph(graph_manager_.graph(),graph_manager_.values(),parameters_,&ordering_cache_);
+	}
+	graph_manager_.commit(pose_estimates);
+	return pose_estimates;
+}
+
+mapping::optimization::Covariances AslamDemo::computePoseCovariances(const std::set<gtsam::Key>& keys) const {
+	if(back_end_ == Incremental) {
+		return incremental_optimizer_.computeCovariances(keys,covariance_mode_);
+	} else if(back_end_ == FixedLag) {
+		return fixed_lag_smoother_.computeCovariances(keys,covariance_mode_);
+	}
+	return mapping::optimization::computeCovariances(graph_manager_.graph(),graph_manager_.values(),keys,covariance_mode_);
+}
+
 gtsam::Pose2 AslamDemo::getRelativeOdom(nav_msgs::Odometry &odom1,nav_msgs::Odometry &odom2) {
 	gtsam::Pose2 pose;
 
@@ -429,20 +927,87 @@ gtsam::Pose2 AslamDemo::getRelativeOdom(nav_msgs::Odometry &odom1,nav_msgs::Odom
 	return pose;
 }
 
-nav_msgs::Odometry AslamDemo::getCorrespondingOdom(const ros::Time &time_stamp,mapping::Odometry& odomreadings) {
-	nav_msgs::Odometry odom;
-	while(odomreadings.empty());
-	auto iter = odomreadings.upper_bound(time_stamp);
-	if (iter != odomreadings.end()) {
-		odom = iter->second;
+const nav_msgs::Odometry* AslamDemo::getCorrespondingOdom(const ros::Time &time_stamp,const mapping::TimeSeries<nav_msgs::Odometry>& odomreadings) const {
+	const mapping::TimeSeries<nav_msgs::Odometry>::value_type* sample = odomreadings.nearest(time_stamp);
+	return sample ? &sample->second : NULL;
+}
+
+void AslamDemo::copyKeyframeScans(const gtsam::Values& poses,mapping::LaserScans& scans) {
+	std::lock_guard<std::mutex> lock(scans_mutex_);
+	if(laserscans_.empty()) return;
+	for(const auto& key_value : poses) {
+		if(key_generator_.extractKeyType(key_value.key) != factors::key_type::Pose2) continue;
+		if(use_submaps_ && submaps_.assigned(key_value.key)) continue;
+		ros::Time timestamp = key_generator_.computeQuantizedTimestamp(key_generator_.extractTimestamp(key_value.key));
+		const sensor_msgs::LaserScan* scan = mapping::map::findMapScan(laserscans_,timestamp,time_tolerance);
+		if(scan) scans.insert(std::make_pair(scan->header.stamp,*scan));
 	}
-	else {
-		odom = std::prev(iter,1)->second;
+	// The newest keyframe tells the submaps which poses will never get a scan
+	scans.insert(*laserscans_.rbegin());
+}
+
+void AslamDemo::mapBuilder() {
+	while(isactive_map_thread_) {
+		// Wait for new pose estimates
+		gtsam::Values pose_estimates;
+		{
+			std::unique_lock<std::mutex> lock(map_mutex_);
+			map_cv_.wait(lock,[&](){return map_job_pending_ || !isactive_map_thread_;});
+			if (!isactive_map_thread_) {
+				return;
+			}
+			pose_estimates = map_job_;
+			map_job_.clear();
+			map_job_pending_ = false;
+		}
+
+		mapping::Timer timer;
+		timer.start();
+
+		// prob_map_ is the back buffer; only this thread touches it
+		if (!map_initialized_) {
+			prob_map_ = mapping::map::createEmptyMap(pose_estimates,.025,15.0);
+			map_initialized_ = true;
+		}
+		std::string filename = "currmap";
+
+		// Keep the latest estimate of every pose; submap anchors from earlier cycles are looked up here
+		for(const auto& key_value : pose_estimates) {
+			if(pose_estimates_.exists(key_value.key)) pose_estimates_.update(key_value.key, key_value.value);
+			else pose_estimates_.insert(key_value.key, key_value.value);
+		}
+
+		// The raycasting runs on a copy of the keyframes it needs, so the match stage and the loop closure
+		// search can keep using laserscans_ meanwhile
+		mapping::LaserScans scans;
+		if(use_submaps_) {
+			copyKeyframeScans(pose_estimates_,scans);
+			submaps_.insert(pose_estimates_,scans,base_T_laser_);
+			submaps_.compose(prob_map_,pose_estimates_);
+		} else {
+			copyKeyframeScans(pose_estimates,scans);
+			mapping::map::buildMapParallel(prob_map_,pose_estimates,scans,base_T_laser_,.01,time_tolerance);
+		}
+
+		// Swap the finished map into the front buffer
+		std::shared_ptr<mapping::ProbabilityMap> map = std::make_shared<mapping::ProbabilityMap>();
+		*map = prob_map_;
+		std::shared_ptr<nav_msgs::OccupancyGrid> grid = std::make_shared<nav_msgs::OccupancyGrid>();
+		prob_map_.occupancyGrid(current_map_);
+		prob_map_.getPublishableMap(current_map_,*grid);
+		std::atomic_store(&front_map_, std::shared_ptr<const mapping::ProbabilityMap>(map));
+		std::atomic_store(&front_grid_, std::shared_ptr<const nav_msgs::OccupancyGrid>(grid));
+		map_ready = true;
+
+		map_pub_.publish(*grid);
+		prob_map_.occupancyGrid(filename);
+
+		timer.stop();
+		ROS_DEBUG_STREAM("Map built from " << pose_estimates.size() << " poses in " << timer.elapsed() << " seconds.");
 	}
-	return odom;
 }
 
-void AslamDemo::doAslamStuff(mapping::ProbabilityMap& map) {
+void AslamDemo::doAslamStuff(const mapping::ProbabilityMap& map) {
   /*std::vector<std::pair<int,int> > f,g;
   aslam_->getFrontierCells(occupancy_grid,f);
   ROS_INFO_STREAM("Frontier Size"<<f.size());
@@ -468,6 +1033,18 @@ void AslamDemo::fromTftoGtsamPose(gtsam::Pose3 &pose3, const tf::Transform &tran
 AslamDemo::~AslamDemo() {
 //	isactive_slam_thread_ = false;
 //	if(slam_thread_.joinable()) slam_thread_.join();
+	{
+		std::lock_guard<std::mutex> lock(map_mutex_);
+		isactive_map_thread_ = false;
+	}
+	map_cv_.notify_one();
+	if(map_thread_.joinable()) map_thread_.join();
+
+	// Let the pipeline drain and stop
+	scan_queue_.close();
+	if(match_thread_.joinable()) match_thread_.join();
+	match_queue_.close();
+	if(factor_thread_.joinable()) factor_thread_.join();
 }
 }
 
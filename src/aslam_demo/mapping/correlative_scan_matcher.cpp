@@ -0,0 +1,226 @@
+/**
+ * correlative_scan_matcher.cpp
+ */
+
+#include <aslam_demo/mapping/correlative_scan_matcher.h>
+#include <aslam_demo/mapping/timer.h>
+#include <ros/ros.h>
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+
+namespace mapping {
+
+namespace correlative {
+
+/* ************************************************************************* */
+std::vector<gtsam::Point2> scanToPoints(const sensor_msgs::LaserScan& scan, const gtsam::Pose3& base_T_laser) {
+  gtsam::Pose2 base_T_laser2(base_T_laser.x(), base_T_laser.y(), base_T_laser.rotation().yaw());
+
+  std::vector<gtsam::Point2> points;
+  points.reserve(scan.ranges.size());
+  for(size_t i = 0; i < scan.ranges.size(); ++i) {
+    double range = scan.ranges[i];
+    if(!(range >= scan.range_min && range < scan.range_max)) continue;
+    double angle = scan.angle_min + i*scan.angle_increment;
+    points.push_back(base_T_laser2.transform_from(gtsam::Point2(range*std::cos(angle), range*std::sin(angle))));
+  }
+  return points;
+}
+
+/* ************************************************************************* */
+CorrelativeScanMatcher::CorrelativeScanMatcher(double resolution, double linear_window, double angular_window,
+    size_t depth, double min_score, const gtsam::Pose3& base_T_laser) :
+    resolution_(resolution), linear_window_(linear_window), angular_window_(angular_window),
+    depth_(std::max<size_t>(depth, 1)), min_score_(min_score), base_T_laser_(base_T_laser), sigma_(2.0*resolution) {
+}
+
+/* ************************************************************************* */
+CorrelativeScanMatcher::PrecomputationGrids CorrelativeScanMatcher::computeGrids(const std::vector<gtsam::Point2>& points) const {
+  PrecomputationGrids grids;
+
+  // Size the grid to the reference points plus the smoothing kernel
+  int kernel = std::ceil(3.0*sigma_ / resolution_);
+  int x_min = std::numeric_limits<int>::max();
+  int x_max = std::numeric_limits<int>::min();
+  int y_min = std::numeric_limits<int>::max();
+  int y_max = std::numeric_limits<int>::min();
+  for(size_t i = 0; i < points.size(); ++i) {
+    int x = std::floor(points[i].x() / resolution_);
+    int y = std::floor(points[i].y() / resolution_);
+    x_min = std::min(x_min, x);
+    x_max = std::max(x_max, x);
+    y_min = std::min(y_min, y);
+    y_max = std::max(y_max, y);
+  }
+  // Pooled blocks starting below the data must still see it, so pad the low side by the largest block
+  int padding = (1 << (depth_ - 1)) - 1;
+  grids.x_min = x_min - kernel - padding;
+  grids.y_min = y_min - kernel - padding;
+  grids.width = (x_max - x_min) + 2*kernel + padding + 1;
+  grids.height = (y_max - y_min) + 2*kernel + padding + 1;
+  grids.levels.resize(depth_);
+
+  // Level 0: each cell holds the Gaussian likelihood of its distance to the closest reference point
+  std::vector<float>& base = grids.levels[0];
+  base.assign(grids.width*grids.height, 0.0f);
+  double inv_two_sigma2 = 1.0 / (2.0*sigma_*sigma_);
+  for(size_t i = 0; i < points.size(); ++i) {
+    int cx = std::floor(points[i].x() / resolution_) - grids.x_min;
+    int cy = std::floor(points[i].y() / resolution_) - grids.y_min;
+    for(int y = cy - kernel; y <= cy + kernel; ++y) {
+      for(int x = cx - kernel; x <= cx + kernel; ++x) {
+        double dx = (x + grids.x_min + 0.5)*resolution_ - points[i].x();
+        double dy = (y + grids.y_min + 0.5)*resolution_ - points[i].y();
+        float likelihood = std::exp(-(dx*dx + dy*dy)*inv_two_sigma2);
+        float& cell = base[y*grids.width + x];
+        cell = std::max(cell, likelihood);
+      }
+    }
+  }
+
+  // Level h: the maximum over a 2^h block, built by doubling the block of level h-1
+  for(size_t level = 1; level < depth_; ++level) {
+    const std::vector<float>& previous = grids.levels[level-1];
+    std::vector<float>& current = grids.levels[level];
+    current.assign(grids.width*grids.height, 0.0f);
+    int step = 1 << (level - 1);
+    for(int y = 0; y < grids.height; ++y) {
+      for(int x = 0; x < grids.width; ++x) {
+        float value = previous[y*grids.width + x];
+        if(x + step < grids.width) value = std::max(value, previous[y*grids.width + x + step]);
+        if(y + step < grids.height) {
+          value = std::max(value, previous[(y + step)*grids.width + x]);
+          if(x + step < grids.width) value = std::max(value, previous[(y + step)*grids.width + x + step]);
+        }
+        current[y*grids.width + x] = value;
+      }
+    }
+  }
+
+  return grids;
+}
+
+/* ************************************************************************* */
+double CorrelativeScanMatcher::scoreCandidate(const PrecomputationGrids& grids, size_t level, const std::vector<std::pair<int,int> >& cells, int x_offset, int y_offset) const {
+  double score = 0.0;
+  for(size_t i = 0; i < cells.size(); ++i) {
+    score += grids.value(level, cells[i].first + x_offset, cells[i].second + y_offset);
+  }
+  return cells.empty() ? 0.0 : score / cells.size();
+}
+
+/* ************************************************************************* */
+void CorrelativeScanMatcher::branchAndBound(const PrecomputationGrids& grids, const std::vector<std::vector<std::pair<int,int> > >& rotated_cells,
+    std::vector<Candidate>& candidates, size_t level, int window, Candidate& best) const {
+
+  // Explore the most promising blocks first, so the best score rises quickly
+  std::sort(candidates.begin(), candidates.end(), std::greater<Candidate>());
+
+  for(size_t i = 0; i < candidates.size(); ++i) {
+    const Candidate& candidate = candidates[i];
+    if(candidate.score <= best.score) return;
+
+    if(level == 0) {
+      best = candidate;
+      continue;
+    }
+
+    // Split the block into its four children at the next finer level
+    size_t child_level = level - 1;
+    int step = 1 << child_level;
+    std::vector<Candidate> children;
+    children.reserve(4);
+    for(int dy = 0; dy <= step; dy += step) {
+      for(int dx = 0; dx <= step; dx += step) {
+        Candidate child;
+        child.rotation = candidate.rotation;
+        child.x_offset = candidate.x_offset + dx;
+        child.y_offset = candidate.y_offset + dy;
+        if(child.x_offset > window || child.y_offset > window) continue;
+        child.score = scoreCandidate(grids, child_level, rotated_cells[child.rotation], child.x_offset, child.y_offset);
+        children.push_back(child);
+      }
+    }
+    branchAndBound(grids, rotated_cells, children, child_level, window, best);
+  }
+}
+
+/* ************************************************************************* */
+bool CorrelativeScanMatcher::match(const sensor_msgs::LaserScan& reference, const sensor_msgs::LaserScan& scan,
+    const gtsam::Pose2& initial_guess, gtsam::Pose2& relative_pose, double& score) const {
+
+  Timer timer;
+  timer.start();
+
+  std::vector<gtsam::Point2> reference_points = scanToPoints(reference, base_T_laser_);
+  std::vector<gtsam::Point2> scan_points = scanToPoints(scan, base_T_laser_);
+  if(reference_points.empty() || scan_points.empty()) return false;
+
+  PrecomputationGrids grids = computeGrids(reference_points);
+
+  // Choose the angular step so the farthest point moves by at most one cell
+  double max_range = 0.0;
+  for(size_t i = 0; i < scan_points.size(); ++i) {
+    max_range = std::max(max_range, scan_points[i].norm());
+  }
+  double angular_step = std::max(1e-3, std::acos(std::max(-1.0, 1.0 - resolution_*resolution_ / (2.0*max_range*max_range))));
+  int angular_steps = std::ceil(angular_window_ / angular_step);
+  int window = std::ceil(linear_window_ / resolution_);
+
+  // Discretize the scan at every search rotation, around the initial guess
+  std::vector<std::vector<std::pair<int,int> > > rotated_cells(2*angular_steps + 1);
+  std::vector<double> rotations(2*angular_steps + 1);
+  for(int k = -angular_steps; k <= angular_steps; ++k) {
+    size_t rotation = k + angular_steps;
+    rotations[rotation] = initial_guess.theta() + k*angular_step;
+    gtsam::Pose2 pose(initial_guess.x(), initial_guess.y(), rotations[rotation]);
+    std::vector<std::pair<int,int> >& cells = rotated_cells[rotation];
+    cells.reserve(scan_points.size());
+    for(size_t i = 0; i < scan_points.size(); ++i) {
+      gtsam::Point2 point = pose.transform_from(scan_points[i]);
+      cells.push_back(std::make_pair((int)std::floor(point.x() / resolution_), (int)std::floor(point.y() / resolution_)));
+    }
+  }
+
+  // Tile the translation window with blocks of the coarsest level
+  size_t top_level = depth_ - 1;
+  int top_step = 1 << top_level;
+  std::vector<Candidate> candidates;
+  for(size_t rotation = 0; rotation < rotated_cells.size(); ++rotation) {
+    for(int y_offset = -window; y_offset <= window; y_offset += top_step) {
+      for(int x_offset = -window; x_offset <= window; x_offset += top_step) {
+        Candidate candidate;
+        candidate.rotation = rotation;
+        candidate.x_offset = x_offset;
+        candidate.y_offset = y_offset;
+        candidate.score = scoreCandidate(grids, top_level, rotated_cells[rotation], x_offset, y_offset);
+        candidates.push_back(candidate);
+      }
+    }
+  }
+
+  // Only matches above the minimum score are of interest
+  Candidate best;
+  best.rotation = angular_steps;
+  best.x_offset = 0;
+  best.y_offset = 0;
+  best.score = min_score_;
+  branchAndBound(grids, rotated_cells, candidates, top_level, window, best);
+
+  timer.stop();
+  ROS_DEBUG_STREAM("Correlative scan match from " << reference.header.stamp << " to " << scan.header.stamp << " searched " << candidates.size()
+      << " coarse candidates in " << timer.elapsed() << " seconds. Best score: " << best.score);
+
+  // The bound never beat the minimum score
+  if(best.score <= min_score_) return false;
+
+  relative_pose = gtsam::Pose2(initial_guess.x() + best.x_offset*resolution_, initial_guess.y() + best.y_offset*resolution_, rotations[best.rotation]);
+  score = best.score;
+  return true;
+}
+
+} // namespace correlative
+
+} // namespace mapping
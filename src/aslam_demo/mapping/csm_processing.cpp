@@ -9,9 +9,9 @@ extern "C" {
   #include <csm/icp/icp.h>
 }
 #include <ros/ros.h>
-#include <boost/geometry/index/rtree.hpp>
-#include <boost/geometry/geometries/point_xy.hpp>
-#include <boost/geometry.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <fstream>
 
 #ifdef _OPENMP
@@ -23,17 +23,13 @@ namespace mapping {
 namespace csm {
 
 /* ************************************************************************* */
-RelativePoseEstimate computeLaserScanMatch(
-    const sensor_msgs::LaserScan& scan1,
-    const sensor_msgs::LaserScan& scan2,
-    struct sm_params& csm_params,
-    const gtsam::Pose2& initial_pose,
-    const gtsam::Pose3& base_T_laser,
-    double laserscan_sigma,
-    double covariance_trace_threshold ,
-    double initial_guess_error_threshold ,
-    const std::string& csm_filename)
-{
+std::mutex& icpMutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+/* ************************************************************************* */
+void setDefaultParameters(struct sm_params& csm_params) {
   csm_params.use_point_to_line_distance = true;
   csm_params.use_corr_tricks = true;
   csm_params.max_iterations = 1000;
@@ -66,6 +62,109 @@ RelativePoseEstimate computeLaserScanMatch(
   csm_params.use_ml_weights = false; // Use the computed alpha angle to weight the correspondences. Must compute the angle for this to work.
   csm_params.use_sigma_weights = false; // Use the "readings_sigma" field to weight the correspondences. If false, no weight is used. If all the weights are the same, this is identical to not weighting them.
   csm_params.debug_verify_tricks = false; // Do not run the debug check
+}
+
+/* ************************************************************************* */
+void setCovarianceMode(struct sm_params& csm_params, CovarianceMode mode) {
+  csm_params.do_compute_covariance = (mode == FullCovariance);
+}
+
+/* ************************************************************************* */
+gtsam::Matrix computeMatchCovariance(const struct sm_params& csm_params, sm_result& output, CovarianceMode mode) {
+  gtsam::Matrix cov = gtsam::zeros(3,3);
+
+  if(mode == FullCovariance) {
+    for(size_t m = 0; m < 3; ++m) {
+      for(size_t n = 0; n < 3; ++n) {
+        cov(m,n) = gsl_matrix_get(output.cov_x_m, m, n);
+      }
+    }
+    // Release the matrices CSM allocated for the covariance
+    gsl_matrix_free(output.cov_x_m);
+    gsl_matrix_free(output.dx_dy1_m);
+    gsl_matrix_free(output.dx_dy2_m);
+    output.cov_x_m = NULL;
+    output.dx_dy1_m = NULL;
+    output.dx_dy2_m = NULL;
+    return cov;
+  }
+
+  const LDP ref = csm_params.laser_ref;
+  const LDP sens = csm_params.laser_sens;
+  double c = std::cos(output.x[2]);
+  double s = std::sin(output.x[2]);
+
+  // Accumulate the Hessian of the final correspondences and their residuals
+  gtsam::Matrix H = gtsam::zeros(3,3);
+  double squared_error = 0.0;
+  double squared_range = 0.0;
+  size_t count = 0;
+  for(int i = 0; i < sens->nrays; ++i) {
+    if(!sens->valid[i] || !sens->corr[i].valid) continue;
+    double px = sens->points[i].p[0];
+    double py = sens->points[i].p[1];
+    double qx = c*px - s*py + output.x[0];
+    double qy = s*px + c*py + output.x[1];
+    const double* p1 = ref->points[sens->corr[i].j1].p;
+    const double* p2 = ref->points[sens->corr[i].j2].p;
+
+    // The point-to-line residual along the normal of the reference segment
+    double nx = -(p2[1] - p1[1]);
+    double ny = p2[0] - p1[0];
+    double norm = std::sqrt(nx*nx + ny*ny);
+    if(norm < 1e-9) continue;
+    nx /= norm;
+    ny /= norm;
+    double residual = nx*(qx - p1[0]) + ny*(qy - p1[1]);
+    double J[3] = { nx, ny, nx*(-s*px - c*py) + ny*(c*px - s*py) };
+    if(mode == HessianCovariance) {
+      for(size_t m = 0; m < 3; ++m) {
+        for(size_t n = 0; n < 3; ++n) {
+          H(m,n) += J[m]*J[n];
+        }
+      }
+    }
+    squared_error += residual*residual;
+    squared_range += px*px + py*py;
+    ++count;
+  }
+  if(count <= 3) {
+    throw std::runtime_error("Not enough correspondences to estimate the scan match covariance.");
+  }
+
+  // The residual variance, never below the configured measurement noise
+  double variance = std::max(squared_error / (count - 3), csm_params.sigma*csm_params.sigma);
+
+  if(mode == FixedShapeCovariance) {
+    // Normals spread evenly over all directions: E[n n^T] = I/2, and the rotation lever arm is the range
+    H(0,0) = 0.5*count;
+    H(1,1) = 0.5*count;
+    H(2,2) = squared_range;
+  }
+
+  if(std::fabs(H.determinant()) < 1e-12) {
+    throw std::runtime_error("The scan match Hessian is singular.");
+  }
+  cov = variance*H.inverse();
+  return cov;
+}
+
+/* ************************************************************************* */
+RelativePoseEstimate computeLaserScanMatch(
+    const sensor_msgs::LaserScan& scan1,
+    const sensor_msgs::LaserScan& scan2,
+    struct sm_params& csm_params,
+    const gtsam::Pose2& initial_pose,
+    const gtsam::Pose3& base_T_laser,
+    double laserscan_sigma,
+    double covariance_trace_threshold ,
+    double initial_guess_error_threshold ,
+    const std::string& csm_filename,
+    ScanMatchRecorder* recorder,
+    CovarianceMode covariance_mode)
+{
+  setDefaultParameters(csm_params);
+  setCovarianceMode(csm_params, covariance_mode);
 
   // Set the laser transformation (and determine if it is inverted)
   double roll = base_T_laser.rotation().roll();
@@ -110,7 +209,26 @@ RelativePoseEstimate computeLaserScanMatch(
   }
   // Use CSM to do the scan matching
   sm_result output;
-  sm_icp(&csm_params, &output);
+  {
+    std::lock_guard<std::mutex> lock(icpMutex());
+    sm_icp(&csm_params, &output);
+  }
+
+  // If requested, queue the match for asynchronous logging. Failed matches bypass the sampling.
+  if(recorder) {
+    recorder->record(csm_params.laser_ref, csm_params.laser_sens, scan1.header.stamp, scan2.header.stamp, !output.valid);
+  }
+
+  // The approximate covariances need the final correspondences, so they are computed before the laser data is released
+  gtsam::Matrix cov;
+  std::string covariance_error;
+  if(output.valid) {
+    try {
+      cov = computeMatchCovariance(csm_params, output, covariance_mode);
+    } catch(const std::exception& e) {
+      covariance_error = e.what();
+    }
+  }
 
   // Release allocated memory
   ld_free(csm_params.laser_ref);
@@ -120,6 +238,9 @@ RelativePoseEstimate computeLaserScanMatch(
   if(!output.valid) {
     throw(std::runtime_error("CSM was unable to find a valid scan match from " + boost::lexical_cast<std::string>(scan1.header.stamp.toSec()) + " to " + boost::lexical_cast<std::string>(scan2.header.stamp.toSec())));
   }
+  if(!covariance_error.empty()) {
+    throw std::runtime_error(covariance_error);
+  }
 
   // Transform the scan match pose back to robot coordinates
   gtsam::Pose2 relative_pose;
@@ -137,17 +258,7 @@ RelativePoseEstimate computeLaserScanMatch(
   match.timestamp1 = scan1.header.stamp;
   match.timestamp2 = scan2.header.stamp;
   match.relative_pose = relative_pose;
-  match.cov = gtsam::zeros(3,3);
-  for(size_t m = 0; m < 3; ++m) {
-    for(size_t n = 0; n < 3; ++n) {
-      match.cov(m,n) = gsl_matrix_get(output.cov_x_m, m, n);
-    }
-  }
-
-  // Release additional allocated memory
-  gsl_matrix_free(output.cov_x_m);
-  gsl_matrix_free(output.dx_dy1_m);
-  gsl_matrix_free(output.dx_dy2_m);
+  match.cov = cov;
 
   // Add some error detection
   double initial_guess_error = initial_pose.localCoordinates(match.relative_pose).norm();
@@ -334,155 +445,125 @@ RelativePoseEstimate computeLaserScanMatch(
   return matches;
 }
 */
-///* ************************************************************************* */
-//size_t ComputeScanCorrespondences(const gtsam::Pose2 relative_pose, const sensor_msgs::LaserScan& scan1, const sensor_msgs::LaserScan& scan2, double correspondence_distance) {
-//  // Create the output value
-//  size_t correspondence_count = 0;
-//
-//  // Create an R-Tree for efficient 2-D geometry lookups
-//  typedef boost::geometry::model::d2::point_xy<double, boost::geometry::cs::cartesian> PointType;
-//  typedef std::pair<PointType, size_t> RTreeValueType;
-//  boost::geometry::index::rtree<RTreeValueType, boost::geometry::index::linear<16> > rtree;
-//
-//  // Insert the laser points from scan1
-//  for(size_t i = 0; i < scan1.ranges.size(); ++i) {
-//    double angle = scan1.angle_min + i*scan1.angle_increment;
-//    double x = scan1.ranges.at(i)*cos(angle);
-//    double y = scan1.ranges.at(i)*sin(angle);
-//    rtree.insert(std::make_pair(PointType(x,y), i));
-//  }
-//
-//  // Loop over the laser points from scan2, checking if a point from scan1 is close
-//  for(size_t i = 0; i < scan2.ranges.size(); ++i) {
-//    // Compute the transformed laserscan point
-//    double angle = scan2.angle_min + i*scan2.angle_increment + relative_pose.theta();
-//    double x = scan2.ranges.at(i)*cos(angle) + relative_pose.x();
-//    double y = scan2.ranges.at(i)*sin(angle) + relative_pose.y();
-//    PointType query_point(x,y);
-//
-//    // Query the R-Tree for the nearest point from scan1
-//    std::vector<RTreeValueType> returned_values;
-//    rtree.query(boost::geometry::index::nearest(query_point, 1), std::back_inserter(returned_values));
-//
-//    // Check the distance
-//    if(!returned_values.empty() && boost::geometry::distance(query_point, returned_values[0].first) < correspondence_distance) {
-//      ++correspondence_count;
-//    }
-//  }
-//
-//  return correspondence_count;
-//}
-
-///* ************************************************************************* */
-//size_t ComputeScanCorrespondences(const gtsam::Pose2 relative_pose, const sensor_msgs::LaserScan& scan1, const sensor_msgs::LaserScan& scan2, double correspondence_distance) {
-//  // Create the output value
-//  size_t correspondence_count = 0;
-//
-//  // Create an occupancy grid
-//  double delta = 2*correspondence_distance;
-//  size_t grid_size = 2*std::floor(scan1.range_max/delta) + 1;
-//  size_t center = std::floor(scan1.range_max/delta);
-//  unsigned char grid[grid_size][grid_size];
-//  memset(grid, 0, sizeof(grid[0][0])*grid_size*grid_size);
-//
-//  // Insert the laser points from scan1 into the occupancy grid
-//  for(size_t i = 0; i < scan1.ranges.size(); ++i) {
-//    double angle = scan1.angle_min + i*scan1.angle_increment;
-//    double x = scan1.ranges.at(i)*cos(angle);
-//    double y = scan1.ranges.at(i)*sin(angle);
-//    size_t u = (x/delta + 0.5) + center;
-//    size_t v = (y/delta + 0.5) + center;
-//    grid[u][v] = 1;
-//  }
-//
-//  // Loop over the laser points from scan2, checking if the grid cell is occupied
-//  for(size_t i = 0; i < scan2.ranges.size(); ++i) {
-//    // Compute the transformed laserscan point
-//    double angle = scan2.angle_min + i*scan2.angle_increment + relative_pose.theta();
-//    double x = scan2.ranges.at(i)*cos(angle) + relative_pose.x();
-//    double y = scan2.ranges.at(i)*sin(angle) + relative_pose.y();
-//    size_t u = (x/delta + 0.5) + center;
-//    size_t v = (y/delta + 0.5) + center;
-//    if(grid[u][v]) {
-//      ++correspondence_count;
-//    }
-//  }
-//
-//  return correspondence_count;
-//}
-
-///* ************************************************************************* */
-//RelativePoseEstimates FilterLowOverlapMatches(const AugmentedScans& augmented_scans, const RelativePoseEstimates& relative_pose_estimates, double correspondence_distance, size_t minimum_correspondences, const std::string& debug_log) {
-//  RelativePoseEstimates valid_relative_pose_estimates;
-//  valid_relative_pose_estimates.reserve(relative_pose_estimates.size());
-//
-//  Timer timer;
-//  timer.start();
-//
-//  if(augmented_scans.empty()) {
-//    throw std::runtime_error("No augmented scans available to compute overlaps.");
-//  }
-//
-//  if(relative_pose_estimates.empty()) {
-//    throw std::runtime_error("No relative poses available to compute overlaps.");
-//  }
-//
-//  std::ofstream logfile;
-//  if(!debug_log.empty()) {
-//    // create an output file
-//    boost::filesystem::path file_path(debug_log);
-//    boost::filesystem::create_directories(file_path.parent_path());
-//    logfile.open(debug_log.c_str());
-//  }
-//
-//  // Loop over each pair, checking that the provided relative pose does result in a high amount of overlap between scans
-//  for(size_t i = 0; i < relative_pose_estimates.size(); ++i) {
-//
-//    // Check if a relative pose was computed successfully
-//    if(relative_pose_estimates.at(i).timestamp1 == ros::Time() && relative_pose_estimates.at(i).timestamp2 == ros::Time()) {
-//      continue;
-//    }
-//
-//    // Look up the corresponding laserscan data
-//    AugmentedScans::const_iterator augmented_scans1_iter = augmented_scans.find(relative_pose_estimates.at(i).timestamp1);
-//    AugmentedScans::const_iterator augmented_scans2_iter = augmented_scans.find(relative_pose_estimates.at(i).timestamp2);
-//
-//    if(augmented_scans1_iter == augmented_scans.end() || augmented_scans2_iter == augmented_scans.end()) {
-//      std::cout << "Could not find augmented scan data for the provided relative pose: timestamp1: " << relative_pose_estimates.at(i).timestamp1 << ", timestamp2: " << relative_pose_estimates.at(i).timestamp2 << std::endl;
-//      continue;
-//    }
-//
-//    // Access to the scan messages
-//    const sensor_msgs::LaserScan& scan1 = augmented_scans1_iter->second.scan;
-//    const sensor_msgs::LaserScan& scan2 = augmented_scans2_iter->second.scan;
-//
-//    // Compute the number of scan-scan correspondences
-//    size_t correspondence_count = ComputeScanCorrespondences(relative_pose_estimates.at(i).relative_pose, scan1, scan2, correspondence_distance);
-//
-//    // Check the number of valid correspondences. If there are not enough points, delete the relative pose
-//    if(correspondence_count > minimum_correspondences) {
-//      valid_relative_pose_estimates.push_back(relative_pose_estimates.at(i));
-//    }
-//
-//    if(logfile.is_open()) {
-//      logfile << relative_pose_estimates.at(i).timestamp1 << " " << relative_pose_estimates.at(i).timestamp2 << " " << correspondence_count << std::endl;
-//    }
-//
-//    // Print a progress message
-//    printProgressBar("  Validating Laserscan Matches: ", 100 * (double)(i) / relative_pose_estimates.size());
-//  }
-//
-//  // Close the debug log file
-//  if(logfile.is_open()) {
-//    logfile.close();
-//  }
-//
-//  // Add the results to the output
-//  timer.stop();
-//  std::cout << ", Valid Laserscan Matches: " << valid_relative_pose_estimates.size() << ", Time: " << timer.elapsed() << std::endl;
-//
-//  return valid_relative_pose_estimates;
-//}
+/* ************************************************************************* */
+size_t computeScanCorrespondences(const gtsam::Pose2& relative_pose, const sensor_msgs::LaserScan& scan1, const sensor_msgs::LaserScan& scan2,
+    double correspondence_distance, const gtsam::Pose3& base_T_laser, size_t* valid_points) {
+
+  if(correspondence_distance <= 0.0) {
+    throw std::runtime_error("The correspondence distance must be positive.");
+  }
+
+  // Both scans are compared in the robot frame of timestamp1
+  gtsam::Pose2 base_T_laser2(base_T_laser.x(), base_T_laser.y(), base_T_laser.rotation().yaw());
+  gtsam::Pose2 base1_T_laser2 = relative_pose*base_T_laser2;
+  double inverse_cell = 1.0 / correspondence_distance;
+
+  // Bound the grid by the valid endpoints of scan1, plus one cell for the dilation
+  int x_min = std::numeric_limits<int>::max();
+  int x_max = std::numeric_limits<int>::min();
+  int y_min = std::numeric_limits<int>::max();
+  int y_max = std::numeric_limits<int>::min();
+  for(size_t i = 0; i < scan1.ranges.size(); ++i) {
+    double range = scan1.ranges[i];
+    if(!(range >= scan1.range_min && range < scan1.range_max)) continue;
+    double angle = scan1.angle_min + i*scan1.angle_increment;
+    gtsam::Point2 point = base_T_laser2.transform_from(gtsam::Point2(range*std::cos(angle), range*std::sin(angle)));
+    int x = std::floor(point.x()*inverse_cell);
+    int y = std::floor(point.y()*inverse_cell);
+    x_min = std::min(x_min, x);
+    x_max = std::max(x_max, x);
+    y_min = std::min(y_min, y);
+    y_max = std::max(y_max, y);
+  }
+  if(valid_points) *valid_points = 0;
+  if(x_min > x_max) return 0;
+  x_min -= 1;
+  y_min -= 1;
+  size_t width = x_max - x_min + 2;
+  size_t height = y_max - y_min + 2;
+
+  // Insert the endpoints of scan1 into the bitset grid, marking the 3x3 neighbourhood of each
+  std::vector<uint64_t> grid((width*height + 63) / 64, 0);
+  for(size_t i = 0; i < scan1.ranges.size(); ++i) {
+    double range = scan1.ranges[i];
+    if(!(range >= scan1.range_min && range < scan1.range_max)) continue;
+    double angle = scan1.angle_min + i*scan1.angle_increment;
+    gtsam::Point2 point = base_T_laser2.transform_from(gtsam::Point2(range*std::cos(angle), range*std::sin(angle)));
+    size_t x = (int)std::floor(point.x()*inverse_cell) - x_min;
+    size_t y = (int)std::floor(point.y()*inverse_cell) - y_min;
+    for(size_t v = y - 1; v <= y + 1; ++v) {
+      for(size_t u = x - 1; u <= x + 1; ++u) {
+        size_t bit = v*width + u;
+        grid[bit >> 6] |= (uint64_t(1) << (bit & 63));
+      }
+    }
+  }
+
+  // Probe the grid with the transformed endpoints of scan2
+  size_t correspondence_count = 0;
+  size_t point_count = 0;
+  for(size_t i = 0; i < scan2.ranges.size(); ++i) {
+    double range = scan2.ranges[i];
+    if(!(range >= scan2.range_min && range < scan2.range_max)) continue;
+    ++point_count;
+    double angle = scan2.angle_min + i*scan2.angle_increment;
+    gtsam::Point2 point = base1_T_laser2.transform_from(gtsam::Point2(range*std::cos(angle), range*std::sin(angle)));
+    int x = (int)std::floor(point.x()*inverse_cell) - x_min;
+    int y = (int)std::floor(point.y()*inverse_cell) - y_min;
+    if(x < 0 || y < 0 || x >= (int)width || y >= (int)height) continue;
+    size_t bit = y*width + x;
+    if(grid[bit >> 6] & (uint64_t(1) << (bit & 63))) {
+      ++correspondence_count;
+    }
+  }
+
+  if(valid_points) *valid_points = point_count;
+  return correspondence_count;
+}
+
+/* ************************************************************************* */
+double computeScanOverlap(const gtsam::Pose2& relative_pose, const sensor_msgs::LaserScan& scan1, const sensor_msgs::LaserScan& scan2,
+    double correspondence_distance, const gtsam::Pose3& base_T_laser) {
+  size_t valid_points = 0;
+  size_t correspondence_count = computeScanCorrespondences(relative_pose, scan1, scan2, correspondence_distance, base_T_laser, &valid_points);
+  return valid_points ? (double)correspondence_count / valid_points : 0.0;
+}
+
+/* ************************************************************************* */
+RelativePoseEstimates filterLowOverlapMatches(const LaserScans& scans, const RelativePoseEstimates& relative_pose_estimates, double correspondence_distance,
+    double minimum_overlap, const gtsam::Pose3& base_T_laser) {
+
+  Timer timer;
+  timer.start();
+
+  RelativePoseEstimates valid_relative_pose_estimates;
+  valid_relative_pose_estimates.reserve(relative_pose_estimates.size());
+
+  // Loop over each pair, checking that the provided relative pose does result in a high amount of overlap between scans
+  for(size_t i = 0; i < relative_pose_estimates.size(); ++i) {
+    const RelativePoseEstimate& estimate = relative_pose_estimates[i];
+
+    // Look up the corresponding laserscan data
+    LaserScans::const_iterator scan1 = scans.find(estimate.timestamp1);
+    LaserScans::const_iterator scan2 = scans.find(estimate.timestamp2);
+    if(scan1 == scans.end() || scan2 == scans.end()) {
+      ROS_WARN_STREAM("Could not find scan data for the relative pose from " << estimate.timestamp1 << " to " << estimate.timestamp2);
+      continue;
+    }
+
+    double overlap = computeScanOverlap(estimate.relative_pose, scan1->second, scan2->second, correspondence_distance, base_T_laser);
+    if(overlap >= minimum_overlap) {
+      valid_relative_pose_estimates.push_back(estimate);
+    } else {
+      ROS_DEBUG_STREAM("Rejected the scan match from " << estimate.timestamp1 << " to " << estimate.timestamp2 << " with an overlap of " << overlap);
+    }
+  }
+
+  timer.stop();
+  ROS_DEBUG_STREAM("Overlap check kept " << valid_relative_pose_estimates.size() << " of " << relative_pose_estimates.size() << " scan matches in " << timer.elapsed() << " seconds.");
+
+  return valid_relative_pose_estimates;
+}
 
 /* ************************************************************************* */
 void streamCsmScan(std::ofstream& stream, struct laser_data* scan) {
@@ -0,0 +1,348 @@
+/**
+ * feature_scan_matcher.cpp
+ */
+
+#include <aslam_demo/mapping/feature_scan_matcher.h>
+#include <aslam_demo/mapping/correlative_scan_matcher.h>
+#include <aslam_demo/mapping/timer.h>
+#include <ros/ros.h>
+#include <boost/lexical_cast.hpp>
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+
+namespace mapping {
+
+namespace features {
+
+/* ************************************************************************* */
+static double wrapAngle(double angle) {
+  return std::atan2(std::sin(angle), std::cos(angle));
+}
+
+/* ************************************************************************* */
+static bool fitLine(const std::vector<gtsam::Point2>& points, size_t first, size_t last, LineSegment& line) {
+  size_t count = last - first + 1;
+
+  // Total least squares: the line direction is the principal axis of the point scatter
+  double mx = 0.0, my = 0.0;
+  for(size_t i = first; i <= last; ++i) {
+    mx += points[i].x();
+    my += points[i].y();
+  }
+  mx /= count;
+  my /= count;
+  double sxx = 0.0, syy = 0.0, sxy = 0.0;
+  for(size_t i = first; i <= last; ++i) {
+    double dx = points[i].x() - mx;
+    double dy = points[i].y() - my;
+    sxx += dx*dx;
+    syy += dy*dy;
+    sxy += dx*dy;
+  }
+  double angle = 0.5*std::atan2(2.0*sxy, sxx - syy);
+  gtsam::Point2 direction(std::cos(angle), std::sin(angle));
+
+  // Orient the segment in scan order and clip it to the projections of the end points
+  double t_first = (points[first].x() - mx)*direction.x() + (points[first].y() - my)*direction.y();
+  double t_last = (points[last].x() - mx)*direction.x() + (points[last].y() - my)*direction.y();
+  if(t_last < t_first) {
+    direction = gtsam::Point2(-direction.x(), -direction.y());
+    t_first = -t_first;
+    t_last = -t_last;
+  }
+  line.start = gtsam::Point2(mx + t_first*direction.x(), my + t_first*direction.y());
+  line.end = gtsam::Point2(mx + t_last*direction.x(), my + t_last*direction.y());
+  line.direction = direction;
+  line.normal = gtsam::Point2(-direction.y(), direction.x());
+  line.offset = line.normal.x()*mx + line.normal.y()*my;
+  line.length = t_last - t_first;
+  line.points = count;
+  return line.length > 0.0;
+}
+
+/* ************************************************************************* */
+static double maxLineDistance(const std::vector<gtsam::Point2>& points, size_t first, size_t last, size_t& farthest) {
+  // Distance from the chord between the first and last point
+  double dx = points[last].x() - points[first].x();
+  double dy = points[last].y() - points[first].y();
+  double norm = std::sqrt(dx*dx + dy*dy);
+  double max_distance = 0.0;
+  farthest = first;
+  for(size_t i = first + 1; i < last; ++i) {
+    double px = points[i].x() - points[first].x();
+    double py = points[i].y() - points[first].y();
+    double distance = (norm > 0.0) ? std::fabs(dx*py - dy*px) / norm : std::sqrt(px*px + py*py);
+    if(distance > max_distance) {
+      max_distance = distance;
+      farthest = i;
+    }
+  }
+  return max_distance;
+}
+
+/* ************************************************************************* */
+static void splitCluster(const std::vector<gtsam::Point2>& points, size_t first, size_t last, double split_distance,
+    std::vector<std::pair<size_t,size_t> >& pieces) {
+  size_t farthest;
+  if(last - first >= 2 && maxLineDistance(points, first, last, farthest) > split_distance) {
+    splitCluster(points, first, farthest, split_distance, pieces);
+    splitCluster(points, farthest, last, split_distance, pieces);
+  } else {
+    pieces.push_back(std::make_pair(first, last));
+  }
+}
+
+/* ************************************************************************* */
+std::vector<LineSegment> extractLineSegments(const std::vector<gtsam::Point2>& points, double split_distance,
+    double break_distance, size_t min_points, double min_length) {
+
+  std::vector<LineSegment> lines;
+  if(points.size() < 2) return lines;
+
+  // Break the points into clusters at range discontinuities, then split each cluster
+  std::vector<std::pair<size_t,size_t> > pieces;
+  size_t cluster_start = 0;
+  for(size_t i = 1; i <= points.size(); ++i) {
+    if(i == points.size() || points[i].distance(points[i-1]) > break_distance) {
+      splitCluster(points, cluster_start, i - 1, split_distance, pieces);
+      cluster_start = i;
+    }
+  }
+
+  // Merge adjacent pieces of the same cluster when one line still fits both
+  std::vector<std::pair<size_t,size_t> > merged;
+  for(size_t i = 0; i < pieces.size(); ++i) {
+    if(!merged.empty() && merged.back().second == pieces[i].first) {
+      size_t farthest;
+      if(maxLineDistance(points, merged.back().first, pieces[i].second, farthest) <= split_distance) {
+        merged.back().second = pieces[i].second;
+        continue;
+      }
+    }
+    merged.push_back(pieces[i]);
+  }
+
+  for(size_t i = 0; i < merged.size(); ++i) {
+    if(merged[i].second - merged[i].first + 1 < min_points) continue;
+    LineSegment line;
+    if(fitLine(points, merged[i].first, merged[i].second, line) && line.length >= min_length) {
+      lines.push_back(line);
+    }
+  }
+  return lines;
+}
+
+/* ************************************************************************* */
+std::vector<Corner> extractCorners(const std::vector<LineSegment>& lines, double max_gap, double min_aperture) {
+  std::vector<Corner> corners;
+  for(size_t i = 1; i < lines.size(); ++i) {
+    const LineSegment& first = lines[i-1];
+    const LineSegment& second = lines[i];
+
+    // Intersect the two infinite lines
+    double determinant = first.normal.x()*second.normal.y() - first.normal.y()*second.normal.x();
+    double aperture = std::acos(std::max(-1.0, std::min(1.0, -(first.direction.x()*second.direction.x() + first.direction.y()*second.direction.y()))));
+    if(aperture < min_aperture || aperture > M_PI - min_aperture || std::fabs(determinant) < 1e-9) continue;
+    gtsam::Point2 position((first.offset*second.normal.y() - second.offset*first.normal.y()) / determinant,
+                           (second.offset*first.normal.x() - first.offset*second.normal.x()) / determinant);
+    if(position.distance(first.end) > max_gap || position.distance(second.start) > max_gap) continue;
+
+    // The bisector of the two arms, pointing from the corner along the segments
+    double bx = -first.direction.x() + second.direction.x();
+    double by = -first.direction.y() + second.direction.y();
+    Corner corner;
+    corner.position = position;
+    corner.orientation = std::atan2(by, bx);
+    corner.aperture = aperture;
+    corners.push_back(corner);
+  }
+  return corners;
+}
+
+/* ************************************************************************* */
+FeatureScanMatcher::FeatureScanMatcher(const gtsam::Pose3& base_T_laser, double max_linear_deviation, double max_angular_deviation,
+    double inlier_distance, double inlier_angle, double min_inlier_length, size_t max_hypotheses, double sigma) :
+    base_T_laser_(base_T_laser), max_linear_deviation_(max_linear_deviation), max_angular_deviation_(max_angular_deviation),
+    inlier_distance_(inlier_distance), inlier_angle_(inlier_angle), min_inlier_length_(min_inlier_length),
+    max_hypotheses_(std::max<size_t>(max_hypotheses, 1)), sigma_(sigma) {
+}
+
+/* ************************************************************************* */
+ScanFeatures FeatureScanMatcher::extractFeatures(const sensor_msgs::LaserScan& scan) const {
+  ScanFeatures features;
+  features.timestamp = scan.header.stamp;
+  features.lines = extractLineSegments(correlative::scanToPoints(scan, base_T_laser_));
+  features.corners = extractCorners(features.lines);
+  return features;
+}
+
+/* ************************************************************************* */
+double FeatureScanMatcher::scoreHypothesis(const ScanFeatures& features1, const ScanFeatures& features2, const gtsam::Pose2& pose,
+    std::vector<Correspondence>* correspondences) const {
+
+  double score = 0.0;
+  for(size_t j = 0; j < features2.lines.size(); ++j) {
+    const LineSegment& line2 = features2.lines[j];
+    gtsam::Point2 start = pose.transform_from(line2.start);
+    gtsam::Point2 end = pose.transform_from(line2.end);
+    double angle2 = std::atan2(line2.direction.y(), line2.direction.x()) + pose.theta();
+
+    // Credit the scan2 segment with its overlap with the best scan1 segment it lies on
+    double best_overlap = 0.0;
+    size_t best_line = 0;
+    for(size_t i = 0; i < features1.lines.size(); ++i) {
+      const LineSegment& line1 = features1.lines[i];
+      double angle = std::fabs(wrapAngle(angle2 - std::atan2(line1.direction.y(), line1.direction.x())));
+      if(std::min(angle, M_PI - angle) > inlier_angle_) continue;
+      if(std::fabs(line1.normal.x()*start.x() + line1.normal.y()*start.y() - line1.offset) > inlier_distance_) continue;
+      if(std::fabs(line1.normal.x()*end.x() + line1.normal.y()*end.y() - line1.offset) > inlier_distance_) continue;
+
+      double t_start = (start.x() - line1.start.x())*line1.direction.x() + (start.y() - line1.start.y())*line1.direction.y();
+      double t_end = (end.x() - line1.start.x())*line1.direction.x() + (end.y() - line1.start.y())*line1.direction.y();
+      double overlap = std::min(std::max(t_start, t_end), line1.length + inlier_distance_) - std::max(std::min(t_start, t_end), -inlier_distance_);
+      if(overlap > best_overlap) {
+        best_overlap = overlap;
+        best_line = i;
+      }
+    }
+
+    if(best_overlap > 0.0) {
+      score += best_overlap;
+      if(correspondences) {
+        Correspondence correspondence;
+        correspondence.line1 = best_line;
+        correspondence.line2 = j;
+        correspondences->push_back(correspondence);
+      }
+    }
+  }
+  return score;
+}
+
+/* ************************************************************************* */
+bool FeatureScanMatcher::refine(const ScanFeatures& features1, const ScanFeatures& features2, const std::vector<Correspondence>& correspondences,
+    gtsam::Pose2& pose, gtsam::Matrix& covariance) const {
+
+  gtsam::Matrix H;
+  double squared_error = 0.0;
+  size_t count = 0;
+  for(size_t iteration = 0; iteration < 5; ++iteration) {
+    double c = std::cos(pose.theta());
+    double s = std::sin(pose.theta());
+
+    // Gauss-Newton on the distances of the scan2 segment endpoints from the scan1 lines
+    H = gtsam::zeros(3,3);
+    gtsam::Vector b = gtsam::zero(3);
+    squared_error = 0.0;
+    count = 0;
+    for(size_t k = 0; k < correspondences.size(); ++k) {
+      const LineSegment& line1 = features1.lines[correspondences[k].line1];
+      const LineSegment& line2 = features2.lines[correspondences[k].line2];
+      const gtsam::Point2* endpoints[2] = { &line2.start, &line2.end };
+      for(size_t e = 0; e < 2; ++e) {
+        double px = endpoints[e]->x();
+        double py = endpoints[e]->y();
+        double qx = c*px - s*py + pose.x();
+        double qy = s*px + c*py + pose.y();
+        double residual = line1.normal.x()*qx + line1.normal.y()*qy - line1.offset;
+        double J[3] = { line1.normal.x(), line1.normal.y(), line1.normal.x()*(-s*px - c*py) + line1.normal.y()*(c*px - s*py) };
+        for(size_t m = 0; m < 3; ++m) {
+          b(m) -= J[m]*residual;
+          for(size_t n = 0; n < 3; ++n) {
+            H(m,n) += J[m]*J[n];
+          }
+        }
+        squared_error += residual*residual;
+        ++count;
+      }
+    }
+
+    // Parallel walls only constrain two degrees of freedom
+    if(count <= 3 || std::fabs(H.determinant()) < 1e-9) return false;
+    gtsam::Vector delta = H.inverse()*b;
+    pose = gtsam::Pose2(pose.x() + delta(0), pose.y() + delta(1), wrapAngle(pose.theta() + delta(2)));
+    if(delta.norm() < 1e-6) break;
+  }
+
+  double variance = std::max(squared_error / (count - 3), sigma_*sigma_);
+  covariance = variance*H.inverse();
+  return true;
+}
+
+/* ************************************************************************* */
+RelativePoseEstimate FeatureScanMatcher::match(const sensor_msgs::LaserScan& scan1, const sensor_msgs::LaserScan& scan2, const gtsam::Pose2& initial_guess) const {
+  if(scan1.header.stamp == scan2.header.stamp) {
+    throw std::runtime_error("Cannot match a scan against itself.");
+  }
+  return match(extractFeatures(scan1), extractFeatures(scan2), initial_guess);
+}
+
+/* ************************************************************************* */
+RelativePoseEstimate FeatureScanMatcher::match(const ScanFeatures& features1, const ScanFeatures& features2, const gtsam::Pose2& initial_guess) const {
+
+  Timer timer;
+  timer.start();
+
+  // The initial guess is always a hypothesis, so scans without corners can still be aligned
+  gtsam::Pose2 best_pose = initial_guess;
+  double best_score = scoreHypothesis(features1, features2, initial_guess);
+
+  // Each pair of corners with a similar aperture gives a full pose hypothesis
+  size_t pair_count = features1.corners.size()*features2.corners.size();
+  bool sample = pair_count > max_hypotheses_;
+  size_t hypothesis_count = sample ? max_hypotheses_ : pair_count;
+  std::mt19937 generator(features1.timestamp.nsec ^ features2.timestamp.nsec);
+  std::uniform_int_distribution<size_t> distribution(0, pair_count ? pair_count - 1 : 0);
+  for(size_t h = 0; h < hypothesis_count; ++h) {
+    size_t index = sample ? distribution(generator) : h;
+    const Corner& corner1 = features1.corners[index / features2.corners.size()];
+    const Corner& corner2 = features2.corners[index % features2.corners.size()];
+    if(std::fabs(corner1.aperture - corner2.aperture) > 2.0*inlier_angle_) continue;
+
+    double theta = wrapAngle(corner1.orientation - corner2.orientation);
+    double c = std::cos(theta);
+    double s = std::sin(theta);
+    gtsam::Pose2 pose(corner1.position.x() - (c*corner2.position.x() - s*corner2.position.y()),
+                      corner1.position.y() - (s*corner2.position.x() + c*corner2.position.y()), theta);
+    if(std::fabs(wrapAngle(pose.theta() - initial_guess.theta())) > max_angular_deviation_) continue;
+    if(pose.t().distance(initial_guess.t()) > max_linear_deviation_) continue;
+
+    double score = scoreHypothesis(features1, features2, pose);
+    if(score > best_score) {
+      best_score = score;
+      best_pose = pose;
+    }
+  }
+
+  if(best_score < min_inlier_length_) {
+    throw std::runtime_error("Feature scan match from " + boost::lexical_cast<std::string>(features1.timestamp.toSec()) + " to "
+        + boost::lexical_cast<std::string>(features2.timestamp.toSec()) + " found too few corresponding segments.");
+  }
+
+  // Refine on the inliers of the best hypothesis
+  std::vector<Correspondence> correspondences;
+  scoreHypothesis(features1, features2, best_pose, &correspondences);
+  gtsam::Matrix covariance;
+  if(!refine(features1, features2, correspondences, best_pose, covariance)) {
+    throw std::runtime_error("Feature scan match from " + boost::lexical_cast<std::string>(features1.timestamp.toSec()) + " to "
+        + boost::lexical_cast<std::string>(features2.timestamp.toSec()) + " is degenerate.");
+  }
+
+  timer.stop();
+  ROS_DEBUG_STREAM("Feature scan match from " << features1.timestamp << " to " << features2.timestamp << " with " << features1.lines.size() << "/" << features2.lines.size()
+      << " lines and " << features1.corners.size() << "/" << features2.corners.size() << " corners in " << timer.elapsed() << " seconds. Inlier length: " << best_score);
+
+  // Create the output object
+  RelativePoseEstimate match;
+  match.timestamp1 = features1.timestamp;
+  match.timestamp2 = features2.timestamp;
+  match.relative_pose = best_pose;
+  match.cov = covariance;
+  return match;
+}
+
+} // namespace features
+
+} // namespace mapping
@@ -0,0 +1,65 @@
+/**
+ * graph_manager.cpp
+ */
+
+#include <aslam_demo/mapping/graph_manager.h>
+#include <boost/foreach.hpp>
+
+namespace mapping {
+
+namespace optimization {
+
+/* ************************************************************************* */
+GraphManager::GraphManager() {
+}
+
+/* ************************************************************************* */
+void GraphManager::addFactors(const gtsam::NonlinearFactorGraph& factors) {
+  validator_.add(factors, gtsam::Values());
+  BOOST_FOREACH(const gtsam::NonlinearFactor::shared_ptr& factor, factors) {
+    if(!factor) continue;
+    graph_.push_back(factor);
+    new_factors_.push_back(factor);
+  }
+}
+
+/* ************************************************************************* */
+size_t GraphManager::addLoopClosures(const gtsam::NonlinearFactorGraph& factors) {
+  gtsam::NonlinearFactorGraph added;
+  BOOST_FOREACH(const gtsam::NonlinearFactor::shared_ptr& factor, factors) {
+    if(!factor || factor->size() != 2) continue;
+    gtsam::Key key1 = factor->keys()[0];
+    gtsam::Key key2 = factor->keys()[1];
+    if(loop_closures_.insert(std::make_pair(std::min(key1, key2), std::max(key1, key2))).second) {
+      added.push_back(factor);
+    }
+  }
+  addFactors(added);
+  return added.size();
+}
+
+/* ************************************************************************* */
+size_t GraphManager::addValues(const gtsam::Values& values) {
+  size_t added = 0;
+  BOOST_FOREACH(const gtsam::Values::ConstKeyValuePair& key_value, values) {
+    if(values_.exists(key_value.key)) continue;
+    values_.insert(key_value.key, key_value.value);
+    new_values_.insert(key_value.key, key_value.value);
+    ++added;
+  }
+  validator_.add(gtsam::NonlinearFactorGraph(), values);
+  return added;
+}
+
+/* ************************************************************************* */
+void GraphManager::commit(const gtsam::Values& estimate) {
+  BOOST_FOREACH(const gtsam::Values::ConstKeyValuePair& key_value, estimate) {
+    if(values_.exists(key_value.key)) values_.update(key_value.key, key_value.value);
+  }
+  new_factors_ = gtsam::NonlinearFactorGraph();
+  new_values_.clear();
+}
+
+} // namespace optimization
+
+} // namespace mapping
@@ -0,0 +1,95 @@
+/**
+ * graph_reduction.cpp
+ */
+
+#include <aslam_demo/mapping/graph_reduction.h>
+#include <aslam_demo/mapping/timer.h>
+#include <cmath>
+
+namespace mapping {
+
+namespace optimization {
+
+/* ************************************************************************* */
+RelativePoseEstimate composeRelativePoses(const RelativePoseEstimate& estimate1, const RelativePoseEstimate& estimate2) {
+  RelativePoseEstimate composed;
+  composed.timestamp1 = estimate1.timestamp1;
+  composed.timestamp2 = estimate2.timestamp2;
+  gtsam::Matrix H1, H2;
+  composed.relative_pose = estimate1.relative_pose.compose(estimate2.relative_pose, H1, H2);
+  composed.cov = H1 * estimate1.cov * H1.transpose() + H2 * estimate2.cov * H2.transpose();
+  return composed;
+}
+
+/* ************************************************************************* */
+PoseGraphReducer::PoseGraphReducer(double max_distance, double max_rotation, double max_interval) :
+    max_distance_(max_distance), max_rotation_(max_rotation), max_interval_(max_interval) {
+}
+
+/* ************************************************************************* */
+RelativePoseEstimates PoseGraphReducer::reduce(const RelativePoseEstimates& estimates, const Timestamps& required, Timestamps& kept) const {
+  Timer timer;
+  timer.start();
+
+  RelativePoseEstimates reduced = compose(estimates, required, kept, true);
+
+  timer.stop();
+  ROS_DEBUG_STREAM("Reduced " << estimates.size() << " relative poses to " << reduced.size() << " in " << timer.elapsed() << " seconds.");
+
+  return reduced;
+}
+
+/* ************************************************************************* */
+RelativePoseEstimates PoseGraphReducer::restrictTo(const RelativePoseEstimates& estimates, const Timestamps& kept) const {
+  Timestamps restricted_kept;
+  return compose(estimates, kept, restricted_kept, false);
+}
+
+/* ************************************************************************* */
+RelativePoseEstimates PoseGraphReducer::compose(const RelativePoseEstimates& estimates, const Timestamps& required, Timestamps& kept, bool use_limits) const {
+  RelativePoseEstimates reduced;
+
+  // The path from the last kept pose to every pose reached so far. A kept pose has an empty path.
+  std::map<ros::Time, RelativePoseEstimate> paths;
+  for(size_t i = 0; i < estimates.size(); ++i) {
+    const RelativePoseEstimate& estimate = estimates[i];
+
+    // A pose that nothing leads to starts a new chain and is kept
+    std::map<ros::Time, RelativePoseEstimate>::const_iterator path1 = paths.find(estimate.timestamp1);
+    if(path1 == paths.end()) {
+      RelativePoseEstimate start;
+      start.timestamp1 = estimate.timestamp1;
+      start.timestamp2 = estimate.timestamp1;
+      start.cov = gtsam::zeros(3, 3);
+      path1 = paths.insert(std::make_pair(estimate.timestamp1, start)).first;
+      kept.insert(estimate.timestamp1);
+    }
+    RelativePoseEstimate path2 = composeRelativePoses(path1->second, estimate);
+
+    bool keep = (required.count(estimate.timestamp2) > 0) || (kept.count(estimate.timestamp2) > 0);
+    if(use_limits) {
+      keep = keep || path2.relative_pose.t().norm() > max_distance_
+          || std::fabs(path2.relative_pose.theta()) > max_rotation_
+          || (path2.timestamp2 - path2.timestamp1).toSec() > max_interval_;
+    }
+
+    if(keep) {
+      reduced.push_back(path2);
+      kept.insert(estimate.timestamp2);
+      RelativePoseEstimate start;
+      start.timestamp1 = estimate.timestamp2;
+      start.timestamp2 = estimate.timestamp2;
+      start.cov = gtsam::zeros(3, 3);
+      paths[estimate.timestamp2] = start;
+    } else if(!paths.count(estimate.timestamp2)) {
+      // A dropped pose reached a second time keeps its first path
+      paths[estimate.timestamp2] = path2;
+    }
+  }
+
+  return reduced;
+}
+
+} // namespace optimization
+
+} // namespace mapping
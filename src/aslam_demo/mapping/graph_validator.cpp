@@ -0,0 +1,149 @@
+/**
+ * graph_validator.cpp
+ */
+
+#include <aslam_demo/mapping/graph_validator.h>
+#include <aslam_demo/factors/key_generator.h>
+#include <ros/ros.h>
+#include <boost/foreach.hpp>
+#include <vector>
+
+namespace mapping {
+
+namespace optimization {
+
+/* ************************************************************************* */
+static gtsam::Key findRoot(gtsam::FastMap<gtsam::Key, gtsam::Key>& parent, gtsam::Key key) {
+  // A variable without an entry is its own root
+  gtsam::Key root = key;
+  gtsam::FastMap<gtsam::Key, gtsam::Key>::iterator iter = parent.find(root);
+  while(iter != parent.end() && iter->second != root) {
+    root = iter->second;
+    iter = parent.find(root);
+  }
+  // Point every variable on the path directly to the root
+  while(key != root) {
+    iter = parent.find(key);
+    key = iter->second;
+    iter->second = root;
+  }
+  return root;
+}
+
+/* ************************************************************************* */
+static void reportKeys(const std::vector<gtsam::Key>& keys, const std::string& problem) {
+  size_t reported = (keys.size() < 10) ? keys.size() : 5;
+  for(size_t i = 0; i < reported; ++i) {
+    ROS_ERROR_STREAM("Key " << factors::BnrTimestampKeyFormatter(keys[i]) << " " << problem << ".");
+  }
+  if(reported < keys.size()) {
+    ROS_ERROR_STREAM((keys.size() - reported) << " additional keys " << problem << ".");
+  }
+}
+
+/* ************************************************************************* */
+GraphValidator::GraphValidator() :
+    components_(0) {
+}
+
+/* ************************************************************************* */
+bool GraphValidator::check(const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values) const {
+
+  gtsam::FastSet<gtsam::Key> batch_value_keys;
+  BOOST_FOREACH(const gtsam::Values::ConstKeyValuePair& key_value, values) {
+    batch_value_keys.insert(key_value.key);
+  }
+
+  // Union-find over the components the batch touches. Known variables start from the root of their
+  // component in the graph, new variables from themselves.
+  gtsam::FastMap<gtsam::Key, gtsam::Key> batch_parent;
+  gtsam::FastSet<gtsam::Key> batch_factor_keys;
+  std::vector<gtsam::Key> missing_values;
+  BOOST_FOREACH(const gtsam::NonlinearFactor::shared_ptr& factor, factors) {
+    if(!factor || factor->keys().empty()) continue;
+    gtsam::Key first_root = findRoot(batch_parent, find(factor->keys().front()));
+    BOOST_FOREACH(gtsam::Key key, factor->keys()) {
+      if(batch_factor_keys.insert(key).second && !value_keys_.count(key) && !batch_value_keys.count(key)) {
+        missing_values.push_back(key);
+      }
+      gtsam::Key root = findRoot(batch_parent, find(key));
+      if(root != first_root) batch_parent[root] = first_root;
+    }
+  }
+  reportKeys(missing_values, "does not have a value");
+
+  // Check that every new value is involved in at least one factor
+  std::vector<gtsam::Key> missing_factors;
+  BOOST_FOREACH(gtsam::Key key, batch_value_keys) {
+    if(!factor_keys_.count(key) && !batch_factor_keys.count(key)) missing_factors.push_back(key);
+  }
+  reportKeys(missing_factors, "does not have a factor");
+
+  // Check that the batch forms a single component
+  std::vector<gtsam::Key> unconnected_keys;
+  gtsam::FastSet<gtsam::Key> batch_keys(batch_factor_keys);
+  batch_keys.insert(batch_value_keys.begin(), batch_value_keys.end());
+  if(!batch_keys.empty()) {
+    gtsam::Key component = findRoot(batch_parent, find(*batch_keys.begin()));
+    BOOST_FOREACH(gtsam::Key key, batch_keys) {
+      if(findRoot(batch_parent, find(key)) != component) unconnected_keys.push_back(key);
+    }
+  }
+  reportKeys(unconnected_keys, "is not connected");
+
+  return missing_values.empty() && missing_factors.empty() && unconnected_keys.empty();
+}
+
+/* ************************************************************************* */
+void GraphValidator::add(const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values) {
+  BOOST_FOREACH(const gtsam::Values::ConstKeyValuePair& key_value, values) {
+    value_keys_.insert(key_value.key);
+    insert(key_value.key);
+  }
+  BOOST_FOREACH(const gtsam::NonlinearFactor::shared_ptr& factor, factors) {
+    if(!factor || factor->keys().empty()) continue;
+    BOOST_FOREACH(gtsam::Key key, factor->keys()) {
+      factor_keys_.insert(key);
+      insert(key);
+      merge(factor->keys().front(), key);
+    }
+  }
+}
+
+/* ************************************************************************* */
+void GraphValidator::clear() {
+  value_keys_.clear();
+  factor_keys_.clear();
+  parent_.clear();
+  size_.clear();
+  components_ = 0;
+}
+
+/* ************************************************************************* */
+gtsam::Key GraphValidator::find(gtsam::Key key) const {
+  return findRoot(parent_, key);
+}
+
+/* ************************************************************************* */
+void GraphValidator::insert(gtsam::Key key) {
+  if(parent_.insert(std::make_pair(key, key)).second) {
+    size_[key] = 1;
+    ++components_;
+  }
+}
+
+/* ************************************************************************* */
+void GraphValidator::merge(gtsam::Key key1, gtsam::Key key2) {
+  gtsam::Key root1 = find(key1);
+  gtsam::Key root2 = find(key2);
+  if(root1 == root2) return;
+  if(size_[root1] < size_[root2]) std::swap(root1, root2);
+  parent_[root2] = root1;
+  size_[root1] += size_[root2];
+  size_.erase(root2);
+  --components_;
+}
+
+} // namespace optimization
+
+} // namespace mapping
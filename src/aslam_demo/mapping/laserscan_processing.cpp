@@ -7,13 +7,15 @@
 #include <aslam_demo/factors/laser_scan_factor.h>
 #include <aslam_demo/factors/key_generator.h>
 #include <laser_geometry/laser_geometry.h>
-#include <filters/filter_chain.h>
-//#include <yaml-cpp/yaml.h>
+#include <yaml-cpp/yaml.h>
 #include <boost/geometry/algorithms/intersection.hpp>
 #include <boost/geometry/algorithms/transform.hpp>
 #include <boost/geometry/geometries/polygon.hpp>
 #include <boost/geometry/geometries/point_xy.hpp>
 #include <boost/geometry/geometry.hpp>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 
 namespace mapping {
 
@@ -23,17 +25,19 @@ typedef boost::geometry::model::d2::point_xy<double, boost::geometry::cs::cartes
 typedef boost::geometry::model::polygon<PointType> PolygonType;
 
 /* ************************************************************************* */
-/*LaserScans sparsifyLaserScans(const LaserScans& scans, const Poses& poses, double time_delta_threshold, double distance_delta_threshold, double rotation_delta_threshold) {
+LaserScans sparsifyLaserScans(const LaserScans& scans, const Poses& poses, double time_delta_threshold, double distance_delta_threshold, double rotation_delta_threshold) {
   LaserScans sparse_scans;
 
   Timer timer;
   timer.start();
 
+  if(scans.empty()) {
+    return sparse_scans;
+  }
+
   bool extracted_first_scan = false;
   ros::Time previous_time = scans.begin()->first;
-  gtsam::Pose2 previous_pose = poses.at(previous_time);
-  const sensor_msgs::LaserScan& previous_scan = scans.at(previous_time);
-  size_t scan_counter = 0;
+  gtsam::Pose2 previous_pose;
   for(LaserScans::const_iterator iter = scans.begin(); iter != scans.end(); ++iter) {
 
     // Quick access to the scan
@@ -52,7 +56,7 @@ typedef boost::geometry::model::polygon<PointType> PolygonType;
     // Compute the time, distance, rotation change since the last extracted pose
     double time_delta = (current_time - previous_time).toSec();
     double distance_delta = current_pose.translation().distance(previous_pose.translation());
-    double rotation_delta = current_pose.rotation().between(previous_pose.rotation()).theta();
+    double rotation_delta = std::fabs(current_pose.rotation().between(previous_pose.rotation()).theta());
 
     // If any of the computed deltas exceed the configured thresholds, keep the scan
     if(    !extracted_first_scan
@@ -73,65 +77,258 @@ typedef boost::geometry::model::polygon<PointType> PolygonType;
 
   return sparse_scans;
 }
-*/
+
+/* ************************************************************************* */
+KeyframeSelector::KeyframeSelector(double time_delta_threshold, double distance_delta_threshold, double rotation_delta_threshold,
+    double coverage_threshold, double coverage_cell_size) :
+    time_delta_threshold_(time_delta_threshold), distance_delta_threshold_(distance_delta_threshold), rotation_delta_threshold_(rotation_delta_threshold),
+    coverage_threshold_(coverage_threshold), coverage_cell_size_(coverage_cell_size), has_keyframe_(false), tested_(0), selected_(0) {
+}
+
+/* ************************************************************************* */
+bool KeyframeSelector::check(const ros::Time& timestamp, const gtsam::Pose2& pose, const sensor_msgs::LaserScan* scan, const gtsam::Pose3& base_T_laser) {
+  ++tested_;
+
+  bool keep = !has_keyframe_;
+  if(!keep) {
+    // Compute the time, distance, rotation change since the last keyframe
+    double time_delta = (timestamp - keyframe_time_).toSec();
+    double distance_delta = pose.translation().distance(keyframe_pose_.translation());
+    double rotation_delta = std::fabs(pose.rotation().between(keyframe_pose_.rotation()).theta());
+    keep = (time_delta >= time_delta_threshold_)
+        || (distance_delta >= distance_delta_threshold_)
+        || (rotation_delta >= rotation_delta_threshold_);
+  }
+
+  // Check the predicted new-cell coverage
+  std::vector<uint64_t> cells;
+  bool use_coverage = (coverage_threshold_ > 0.0) && scan;
+  if(use_coverage) {
+    double new_coverage = computeNewCoverage(*scan, pose, base_T_laser, cells);
+    keep = keep || (new_coverage >= coverage_threshold_);
+  }
+
+  if(keep) {
+    has_keyframe_ = true;
+    keyframe_time_ = timestamp;
+    keyframe_pose_ = pose;
+    covered_cells_.insert(cells.begin(), cells.end());
+    ++selected_;
+  }
+
+  return keep;
+}
+
+/* ************************************************************************* */
+void KeyframeSelector::reset() {
+  has_keyframe_ = false;
+  covered_cells_.clear();
+  tested_ = 0;
+  selected_ = 0;
+}
+
+/* ************************************************************************* */
+double KeyframeSelector::computeNewCoverage(const sensor_msgs::LaserScan& scan, const gtsam::Pose2& pose, const gtsam::Pose3& base_T_laser, std::vector<uint64_t>& cells) const {
+
+  gtsam::Pose2 world_T_laser = pose * gtsam::Pose2(base_T_laser.x(), base_T_laser.y(), base_T_laser.rotation().yaw());
+
+  size_t valid = 0;
+  size_t uncovered = 0;
+  cells.reserve(scan.ranges.size());
+  for(size_t i = 0; i < scan.ranges.size(); ++i) {
+    double range = scan.ranges[i];
+    if(!(range >= scan.range_min && range < scan.range_max)) continue;
+    ++valid;
+
+    // Pack the coarse cell coordinates into a single key
+    double angle = scan.angle_min + i*scan.angle_increment;
+    gtsam::Point2 point = world_T_laser.transform_from(gtsam::Point2(range*std::cos(angle), range*std::sin(angle)));
+    int32_t x = std::floor(point.x() / coverage_cell_size_);
+    int32_t y = std::floor(point.y() / coverage_cell_size_);
+    uint64_t cell = (uint64_t(uint32_t(x)) << 32) | uint64_t(uint32_t(y));
+    cells.push_back(cell);
+
+    if(covered_cells_.find(cell) == covered_cells_.end()) ++uncovered;
+  }
+
+  return (valid > 0) ? double(uncovered) / valid : 0.0;
+}
+
+/* ************************************************************************* */
+void ScanFilterChain::addRangeClip(double min_range, double max_range, const std::string& name) {
+  Filter filter = Filter();
+  filter.type = RangeClip;
+  filter.name = name;
+  filter.min_range = min_range;
+  filter.max_range = max_range;
+  filters_.push_back(filter);
+}
+
+/* ************************************************************************* */
+void ScanFilterChain::addMedian(size_t window, const std::string& name) {
+  Filter filter = Filter();
+  filter.type = Median;
+  filter.name = name;
+  filter.window = window;
+  filters_.push_back(filter);
+}
+
+/* ************************************************************************* */
+void ScanFilterChain::addShadow(double min_angle, double max_angle, size_t window, const std::string& name) {
+  Filter filter = Filter();
+  filter.type = Shadow;
+  filter.name = name;
+  filter.min_angle = min_angle;
+  filter.max_angle = max_angle;
+  filter.window = std::max<size_t>(window, 1);
+  filters_.push_back(filter);
+}
+
+/* ************************************************************************* */
+void ScanFilterChain::addVoxel(double cell_size, const std::string& name) {
+  if(cell_size <= 0.0) {
+    throw std::runtime_error("The voxel filter cell size must be positive.");
+  }
+  Filter filter = Filter();
+  filter.type = Voxel;
+  filter.name = name;
+  filter.cell_size = cell_size;
+  filters_.push_back(filter);
+}
+
+/* ************************************************************************* */
+void ScanFilterChain::apply(sensor_msgs::LaserScan& scan) {
+  for(size_t i = 0; i < filters_.size(); ++i) {
+    const Filter& filter = filters_[i];
+    switch(filter.type) {
+      case RangeClip: applyRangeClip(filter, scan); break;
+      case Median: applyMedian(filter, scan); break;
+      case Shadow: applyShadow(filter, scan); break;
+      case Voxel: applyVoxel(filter, scan); break;
+    }
+  }
+}
+
 /* ************************************************************************* */
-/*XmlRpc::XmlRpcValue readFilterConfiguration(const std::string& filename) {
-  XmlRpc::XmlRpcValue xml_filters;
+void ScanFilterChain::applyRangeClip(const Filter& filter, sensor_msgs::LaserScan& scan) {
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  for(size_t i = 0; i < scan.ranges.size(); ++i) {
+    float range = scan.ranges[i];
+    if(!(range >= filter.min_range && range <= filter.max_range)) scan.ranges[i] = nan;
+  }
+}
 
-  // Error checking
-  if(!boost::filesystem::exists(filename)) {
-    throw std::runtime_error("LaserScan Filter configuration file does not exist.");
+/* ************************************************************************* */
+void ScanFilterChain::applyMedian(const Filter& filter, sensor_msgs::LaserScan& scan) {
+  if(filter.window == 0) return;
+  ranges_.assign(scan.ranges.begin(), scan.ranges.end());
+  window_.reserve(2*filter.window + 1);
+
+  // Removed readings stay removed and are left out of their neighbours' windows
+  int count = ranges_.size();
+  int half = filter.window;
+  for(int i = 0; i < count; ++i) {
+    if(std::isnan(ranges_[i])) continue;
+    window_.clear();
+    for(int j = std::max(0, i - half); j <= std::min(count - 1, i + half); ++j) {
+      if(!std::isnan(ranges_[j])) window_.push_back(ranges_[j]);
+    }
+    std::vector<float>::iterator middle = window_.begin() + window_.size()/2;
+    std::nth_element(window_.begin(), middle, window_.end());
+    scan.ranges[i] = *middle;
   }
+}
+
+/* ************************************************************************* */
+void ScanFilterChain::applyShadow(const Filter& filter, sensor_msgs::LaserScan& scan) {
+  removed_.assign(scan.ranges.size(), 0);
+
+  // The angle at the far point of the triangle formed by the sensor and two neighbouring returns.
+  // Veiling points between a foreground and a background object form very flat triangles.
+  int count = scan.ranges.size();
+  int window = filter.window;
+  for(int i = 0; i < count; ++i) {
+    float r1 = scan.ranges[i];
+    if(std::isnan(r1)) continue;
+    for(int j = std::max(0, i - window); j <= std::min(count - 1, i + window); ++j) {
+      float r2 = scan.ranges[j];
+      if(j == i || std::isnan(r2)) continue;
+      double beam_angle = std::fabs(j - i)*scan.angle_increment;
+      double angle = std::fabs(std::atan2(r2*std::sin(beam_angle), r1 - r2*std::cos(beam_angle)));
+      if(angle < filter.min_angle || angle > filter.max_angle) {
+        removed_[i] = 1;
+        break;
+      }
+    }
+  }
+
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  for(int i = 0; i < count; ++i) {
+    if(removed_[i]) scan.ranges[i] = nan;
+  }
+}
+
+/* ************************************************************************* */
+void ScanFilterChain::applyVoxel(const Filter& filter, sensor_msgs::LaserScan& scan) {
+  // Readings are ordered by angle, so readings that fall into the same cell are mostly adjacent
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  bool has_cell = false;
+  int last_x = 0;
+  int last_y = 0;
+  for(size_t i = 0; i < scan.ranges.size(); ++i) {
+    float range = scan.ranges[i];
+    if(!(range >= scan.range_min && range < scan.range_max)) continue;
+    double angle = scan.angle_min + i*scan.angle_increment;
+    int x = std::floor(range*std::cos(angle) / filter.cell_size);
+    int y = std::floor(range*std::sin(angle) / filter.cell_size);
+    if(has_cell && x == last_x && y == last_y) {
+      scan.ranges[i] = nan;
+    } else {
+      has_cell = true;
+      last_x = x;
+      last_y = y;
+    }
+  }
+}
+
+/* ************************************************************************* */
+ScanFilterChain readFilterConfiguration(const std::string& filename) {
+  ScanFilterChain filter_chain;
 
   // Parse the document assuming everything is correct. Catch any exceptions throw
   try {
     YAML::Node yaml_filters = YAML::LoadFile(filename);
 
-    size_t filter_count = 0;
     for(YAML::const_iterator yaml_filter_iter = yaml_filters.begin(); yaml_filter_iter != yaml_filters.end(); ++yaml_filter_iter) {
       const YAML::Node& yaml_filter = *yaml_filter_iter;
-      XmlRpc::XmlRpcValue xml_filter;
-
-      // Extract the filter name
-      std::string filter_name;
-      filter_name = yaml_filter["name"].as<std::string>();
-      xml_filter["name"] = filter_name;
-
-      // Extract the filter type
-      std::string filter_type;
-      filter_type = yaml_filter["type"].as<std::string>();
-      xml_filter["type"] = filter_type;
-
-      // Extract the filter params
-      if(yaml_filter["params"]) {
-        const YAML::Node& yaml_params = yaml_filter["params"];
-        XmlRpc::XmlRpcValue xml_params;
-
-        for(YAML::const_iterator yaml_param_iter = yaml_params.begin(); yaml_param_iter != yaml_params.end(); ++yaml_param_iter) {
-          std::string key = yaml_param_iter->first.as<std::string>();
-          try {
-            int value = yaml_param_iter->second.as<int>();
-            xml_params[key] = value;
-          } catch(const std::exception& e) {
-            double value = yaml_param_iter->second.as<double>();
-            xml_params[key] = value;
-          }
-        }
-        xml_filter["params"] = xml_params;
-      }
 
-      // Add filter to the filters collection
-      xml_filters[filter_count++] = xml_filter;
+      // Extract the filter name, type and params
+      std::string filter_name = yaml_filter["name"].as<std::string>();
+      std::string filter_type = yaml_filter["type"].as<std::string>();
+      YAML::Node yaml_params = yaml_filter["params"];
+
+      if(filter_type == "RangeClip") {
+        filter_chain.addRangeClip(yaml_params["min_range"].as<double>(0.0), yaml_params["max_range"].as<double>(std::numeric_limits<double>::max()), filter_name);
+      } else if(filter_type == "Median") {
+        filter_chain.addMedian(yaml_params["window"].as<size_t>(2), filter_name);
+      } else if(filter_type == "Shadow") {
+        filter_chain.addShadow(yaml_params["min_angle"].as<double>(10.0)*M_PI/180.0, yaml_params["max_angle"].as<double>(170.0)*M_PI/180.0,
+            yaml_params["window"].as<size_t>(1), filter_name);
+      } else if(filter_type == "Voxel") {
+        filter_chain.addVoxel(yaml_params["cell_size"].as<double>(0.05), filter_name);
+      } else {
+        throw std::runtime_error("Unknown filter type '" + filter_type + "' for filter '" + filter_name + "'.");
+      }
     }
   } catch(const std::exception& e) {
     throw std::runtime_error("Failed to parse scan filter YAML file. Error: " + std::string(e.what()));
   }
 
-  return xml_filters;
+  return filter_chain;
 }
-*/
+
 /* ************************************************************************* */
-/*LaserScans filterLaserScans(const LaserScans& scans, const std::string& filename) {
+LaserScans filterLaserScans(const LaserScans& scans, const std::string& filename) {
   LaserScans filtered_scans;
 
   Timer timer;
@@ -142,26 +339,13 @@ typedef boost::geometry::model::polygon<PointType> PolygonType;
   }
 
   // Read the YAML configuration file
-  XmlRpc::XmlRpcValue laser_filter_config = readFilterConfiguration(filename);
+  ScanFilterChain filter_chain = readFilterConfiguration(filename);
 
-  // Create Laser Scan Filters
-  filters::FilterChain<sensor_msgs::LaserScan> filter_chain("sensor_msgs::LaserScan");
-  bool filters_valid = filter_chain.configure(laser_filter_config, "root");
-  if(!filters_valid) {
-    throw std::runtime_error("Could not configure the scan filter chain.");
-  }
-
-  size_t scan_counter = 0;
   for(LaserScans::const_iterator iter = scans.begin(); iter != scans.end(); ++iter) {
-
-    // Quick access to the scan
-    const ros::Time& scan_time = iter->first;
-    const sensor_msgs::LaserScan& scan = iter->second;
-
     // Apply the filter chain
-    sensor_msgs::LaserScan filtered_scan;
-    filter_chain.update(scan, filtered_scan);
-    filtered_scans.insert(LaserScans::value_type(filtered_scan.header.stamp, filtered_scan));
+    sensor_msgs::LaserScan& filtered_scan = filtered_scans[iter->first];
+    filtered_scan = iter->second;
+    filter_chain.apply(filtered_scan);
   }
 
   // Add the results to the output
@@ -13,6 +13,9 @@
 #include <yaml-cpp/yaml.h>
 #include <boost/foreach.hpp>
 #include <boost/filesystem.hpp>
+#include <thread>
+#include <atomic>
+#include <functional>
 
 namespace mapping {
 
@@ -64,6 +67,36 @@ ProbabilityMap createEmptyMap(const gtsam::Values& values, double map_cell_size,
   return map;
 }
 
+/* ************************************************************************* */
+const sensor_msgs::LaserScan* findMapScan(const LaserScans& scans, const ros::Time& timestamp, double time_tolerance) {
+  LaserScans::const_iterator scans_begin;
+  LaserScans::const_iterator scans_lower_bound = scans.lower_bound(timestamp - ros::Duration(time_tolerance));
+  if (scans_lower_bound == scans.end()) return 0;
+  if(scans_lower_bound != scans.begin()) {
+    scans_begin = std::prev(scans_lower_bound,1);
+  }
+  else {
+    scans_begin = scans_lower_bound;
+  }
+  LaserScans::const_iterator scans_end   = scans.upper_bound(timestamp + ros::Duration(time_tolerance));
+  if (scans_end == scans.end()) return 0;
+
+  const sensor_msgs::LaserScan* scan = 0;
+  double min_delta = std::numeric_limits<double>::max();
+  for(LaserScans::const_iterator scans_iter = scans_begin; scans_iter != scans_end; ++scans_iter) {
+    double delta = std::fabs( (scans_iter->first - timestamp).toSec());
+    if(delta < min_delta) {
+      min_delta = delta;
+      scan = &(scans_iter->second);
+    }
+  }
+
+  // Poses without a scan inside the tolerance (e.g. non-keyframe poses) do not update the map
+  if(min_delta > time_tolerance) return 0;
+
+  return scan;
+}
+
 /* ************************************************************************* */
 void buildMap(ProbabilityMap& map, const gtsam::Values& values, const LaserScans& scans, const gtsam::Pose3& base_T_laser, double scan_sigma, double time_tolerance, const std::string& debug_path) {
 
@@ -89,29 +122,9 @@ void buildMap(ProbabilityMap& map, const gtsam::Values& values, const LaserScans
 
     // Only use Pose2 values
     if( key_type == factors::key_type::Pose2) {
-      LaserScans::const_iterator scans_begin;
       // Find the laserscan closest to the pose timestamp
-      LaserScans::const_iterator scans_lower_bound = scans.lower_bound(timestamp - ros::Duration(time_tolerance));
-      if (scans_lower_bound == scans.end()) continue;
-      if(scans_lower_bound != scans.begin()) {
-    	  scans_begin = std::prev(scans_lower_bound,1);
-      }
-      else {
-    	  scans_begin = scans_lower_bound;
-      }
-      LaserScans::const_iterator scans_end   = scans.upper_bound(timestamp + ros::Duration(time_tolerance));
-      if (scans_end == scans.end()) continue;
-
-      const sensor_msgs::LaserScan* scan = 0;
-      double min_delta = std::numeric_limits<double>::max();
-      for(LaserScans::const_iterator scans_iter = scans_begin; scans_iter != scans_end; ++scans_iter) {
-
-        double delta = std::fabs( (scans_iter->first - timestamp).toSec());
-        if(delta < min_delta) {
-          min_delta = delta;
-          scan = &(scans_iter->second);
-        }
-      }
+      const sensor_msgs::LaserScan* scan = findMapScan(scans, timestamp, time_tolerance);
+
       // If a scan was found, add it to the map
       if(scan) {
 
@@ -143,6 +156,82 @@ void buildMap(ProbabilityMap& map, const gtsam::Values& values, const LaserScans
 
 
 
+/* ************************************************************************* */
+void buildMapParallel(ProbabilityMap& map, const gtsam::Values& values, const LaserScans& scans, const gtsam::Pose3& base_T_laser, double scan_sigma, double time_tolerance, size_t threads, size_t band_size) {
+
+  Timer timer;
+  timer.start();
+
+  if(threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+  if(band_size == 0) band_size = 1;
+
+  // Create a laser model for map updates
+  sensor_models::LaserScanModel laser_model(scan_sigma, false);
+
+  // Create a key generator for timestamp <--> key conversions
+  factors::KeyGenerator key_generator(time_tolerance);
+
+  // Select the scan for every pose, in the same order as the serial version
+  std::vector<std::pair<gtsam::Pose2, const sensor_msgs::LaserScan*> > selected;
+  BOOST_FOREACH(const gtsam::Values::ConstKeyValuePair& key_value, values) {
+    if(key_generator.extractKeyType(key_value.key) == factors::key_type::Pose2) {
+      ros::Time timestamp = key_generator.computeQuantizedTimestamp(key_generator.extractTimestamp(key_value.key));
+      const sensor_msgs::LaserScan* scan = findMapScan(scans, timestamp, time_tolerance);
+      if(scan) {
+        selected.push_back(std::make_pair(static_cast<const gtsam::Pose2&>(key_value.value), scan));
+      }
+    }
+  }
+
+  // Project every scan into the world frame and compute the range of map rows its rays may touch
+  struct ProjectedScan {
+    gtsam::Point2 sensor_origin;
+    std::vector<gtsam::Point2> points;
+    int row_min;
+    int row_max;
+  };
+  std::vector<ProjectedScan> projected(selected.size());
+  double margin = (laser_model.kernelSize(map.cellSize()) + 1) * map.cellSize();
+  parallelFor(selected.size(), threads, [&](size_t i) {
+    ProjectedScan& scan = projected[i];
+    scan.points = laser_model.projectScan(*selected[i].second, selected[i].first, base_T_laser, scan.sensor_origin);
+    double y_min = scan.sensor_origin.y();
+    double y_max = scan.sensor_origin.y();
+    for(size_t j = 0; j < scan.points.size(); ++j) {
+      y_min = std::min(y_min, scan.points[j].y());
+      y_max = std::max(y_max, scan.points[j].y());
+    }
+    scan.row_min = std::floor((y_min - margin - map.origin().y()) / map.cellSize());
+    scan.row_max = std::floor((y_max + margin - map.origin().y()) / map.cellSize());
+  });
+
+  // Update each row band independently. Concurrent updates touch disjoint cells, so the
+  // shared entropy bookkeeping is suspended for the duration.
+  map.setEntropyTracking(false);
+  size_t bands = (map.rows() + band_size - 1) / band_size;
+  parallelFor(bands, threads, [&](size_t band) {
+    int row_begin = band * band_size;
+    int row_end = std::min(map.rows(), (band + 1) * band_size);
+    for(size_t i = 0; i < projected.size(); ++i) {
+      const ProjectedScan& scan = projected[i];
+      if(scan.row_max < row_begin || scan.row_min >= row_end) continue;
+      for(size_t j = 0; j < scan.points.size(); ++j) {
+        // Skip rays that cannot reach this band
+        double y_min = std::min(scan.sensor_origin.y(), scan.points[j].y()) - margin;
+        double y_max = std::max(scan.sensor_origin.y(), scan.points[j].y()) + margin;
+        if(std::floor((y_max - map.origin().y()) / map.cellSize()) < row_begin) continue;
+        if(std::floor((y_min - map.origin().y()) / map.cellSize()) >= row_end) continue;
+        laser_model.updateMap(map, scan.sensor_origin, scan.points[j], row_begin, row_end);
+      }
+    }
+  });
+  map.setEntropyTracking(true);
+  map.calcShannonEntropy();
+
+  timer.stop();
+  ROS_DEBUG_STREAM("Inserted " << selected.size() << " scans into " << bands << " map bands using " << threads << " threads in " << timer.elapsed() << " seconds.");
+}
+
 /* ************************************************************************* */
 /* ************************************************************************* */
 /* ************************************************************************* */
@@ -12,6 +12,8 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/filesystem.hpp>
 #include <fstream>
+#include <thread>
+#include <atomic>
 
 namespace mapping {
 
@@ -30,6 +32,24 @@ void printProgressBar(const std::string& title, int percent) {
   std::cout << "\r" << title << " [" << progress_bar << "] " << percent << "%" << std::flush;
 }
 
+/* ************************************************************************* */
+void parallelFor(size_t count, size_t threads, const std::function<void(size_t)>& function) {
+  if(threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> workers;
+  for(size_t worker = 0; worker < std::min(threads, count); ++worker) {
+    workers.push_back(std::thread([&]() {
+      for(size_t index = next++; index < count; index = next++) {
+        function(index);
+      }
+    }));
+  }
+  for(size_t i = 0; i < workers.size(); ++i) {
+    workers[i].join();
+  }
+}
+
 /* ************************************************************************* */
 void openBagfiles(const std::vector<std::string>& filenames, std::vector<rosbag::Bag>& bags) {
   // Check that at least one input bagfile was provided
@@ -94,7 +94,9 @@ namespace odometry {
 }
 */
 /* ************************************************************************* */
-RelativePoseEstimates computeRelativePoses(const Odometry& odometry, const Timestamps& timestamps, const gtsam::Vector& sigmas, double time_tolerance, double scale) {
+template<class OdometryContainer>
+static RelativePoseEstimates computeRelativePosesImpl(const OdometryContainer& odometry, const Timestamps& timestamps, const gtsam::Vector& sigmas, double time_tolerance, double scale) {
+  typedef typename OdometryContainer::const_iterator OdometryIterator;
   RelativePoseEstimates relative_poses;
 
   Timer timer;
@@ -134,8 +136,8 @@ RelativePoseEstimates computeRelativePoses(const Odometry& odometry, const Times
     // younger entry is simply computed as entry before.
     // Because the mapping system timestamps are quantized, an additional check is needed to catch situations where the raw odometry
     // timestamp is older than the target, but the quantized timestamp is equal.
-    Odometry::const_iterator odometry2_begin = odometry.upper_bound(timestamp1); if(key_generator.computeQuantizedTimestamp(odometry2_begin->first) <= timestamp1) ++odometry2_begin;
-    Odometry::const_iterator odometry2_end = odometry.lower_bound(timestamp2);   if(odometry2_end != odometry.end()) ++odometry2_end;
+    OdometryIterator odometry2_begin = odometry.upper_bound(timestamp1); if(key_generator.computeQuantizedTimestamp(odometry2_begin->first) <= timestamp1) ++odometry2_begin;
+    OdometryIterator odometry2_end = odometry.lower_bound(timestamp2);   if(odometry2_end != odometry.end()) ++odometry2_end;
 
     // Create a new relative pose structure
     RelativePoseEstimate relative_pose;
@@ -145,9 +147,9 @@ RelativePoseEstimates computeRelativePoses(const Odometry& odometry, const Times
     relative_pose.cov = gtsam::Matrix::Zero(3,3);
 
     // Loop over the incremental odometry information, accumulating the relative pose and covariance
-    for(Odometry::const_iterator odometry2_iter = odometry2_begin; odometry2_iter != odometry2_end; ++odometry2_iter) {
+    for(OdometryIterator odometry2_iter = odometry2_begin; odometry2_iter != odometry2_end; ++odometry2_iter) {
       // Get an iterator pointing to the previous entry
-      Odometry::const_iterator odometry1_iter = odometry2_iter; --odometry1_iter;
+      OdometryIterator odometry1_iter = odometry2_iter; --odometry1_iter;
 
       // Quantize the odometry timestamps
       ros::Time odometry_timestamp1 = key_generator.computeQuantizedTimestamp(odometry1_iter->first);
@@ -192,6 +194,16 @@ RelativePoseEstimates computeRelativePoses(const Odometry& odometry, const Times
   return relative_poses;
 }
 
+/* ************************************************************************* */
+RelativePoseEstimates computeRelativePoses(const Odometry& odometry, const Timestamps& timestamps, const gtsam::Vector& sigmas, double time_tolerance, double scale) {
+  return computeRelativePosesImpl(odometry, timestamps, sigmas, time_tolerance, scale);
+}
+
+/* ************************************************************************* */
+RelativePoseEstimates computeRelativePoses(const TimeSeries<nav_msgs::Odometry>& odometry, const Timestamps& timestamps, const gtsam::Vector& sigmas, double time_tolerance, double scale) {
+  return computeRelativePosesImpl(odometry, timestamps, sigmas, time_tolerance, scale);
+}
+
 /* ************************************************************************* */
 gtsam::Pose2 splitOdometry(const nav_msgs::Odometry& previous_message, const nav_msgs::Odometry& next_message, const ros::Time& timestamp1, const ros::Time& timestamp2) {
   gtsam::Pose2 relative_pose;
@@ -221,7 +233,29 @@ gtsam::Pose2 splitOdometry(const nav_msgs::Odometry& previous_message, const nav
 }
 
 /* ************************************************************************* */
-gtsam::NonlinearFactorGraph createOdometryFactors(const RelativePoseEstimates& relative_poses, double time_tolerance,gtsam::KeySet keys) {
+static gtsam::Pose2 messageToPose(const nav_msgs::Odometry& message) {
+  return gtsam::Pose2(message.pose.pose.position.x, message.pose.pose.position.y,
+      tf::getYaw(tf::Quaternion(message.pose.pose.orientation.x, message.pose.pose.orientation.y, message.pose.pose.orientation.z, message.pose.pose.orientation.w)));
+}
+
+/**
+ * Interpolates between two odometry messages in the tangent space of the first, as splitOdometry does
+ */
+struct PoseInterpolator {
+  gtsam::Pose2 operator()(const TimeSeries<nav_msgs::Odometry>::value_type& before, const TimeSeries<nav_msgs::Odometry>::value_type& after, double fraction) const {
+    gtsam::Pose2 pose1 = messageToPose(before.second);
+    if(fraction <= 0.0) return pose1;
+    return pose1.retract(fraction*pose1.localCoordinates(messageToPose(after.second)));
+  }
+};
+
+/* ************************************************************************* */
+bool interpolatePose(const TimeSeries<nav_msgs::Odometry>& odometry, const ros::Time& timestamp, gtsam::Pose2& pose) {
+  return odometry.interpolate(timestamp, PoseInterpolator(), pose);
+}
+
+/* ************************************************************************* */
+gtsam::NonlinearFactorGraph createOdometryFactors(const RelativePoseEstimates& relative_poses, double time_tolerance,const gtsam::KeySet& keys) {
   gtsam::NonlinearFactorGraph factors;
 
   Timer timer;
@@ -230,11 +264,16 @@ gtsam::NonlinearFactorGraph createOdometryFactors(const RelativePoseEstimates& r
   if(relative_poses.empty()) {
     throw std::runtime_error("No relative poses available for factor creation.");
   }
+  if(keys.size() <= relative_poses.size()) {
+    throw std::runtime_error("Odometry factor creation needs one more key than relative poses.");
+  }
 
   // Create a GTSAM Key Generator for creating variable names
   factors::KeyGenerator key_generator(time_tolerance);
 
-  // Loop over all of the odometry data, creating a factor for each relative pose
+  // Loop over all of the odometry data, creating a factor for each relative pose. The keys are walked
+  // alongside, since advancing a set iterator from the beginning for every factor is quadratic.
+  gtsam::KeySet::const_iterator key_iter = keys.begin();
   for(size_t i = 0; i < relative_poses.size(); ++i) {
 
     // (1) Create a noise model based on the previously calculated covariance matrix
@@ -243,8 +282,8 @@ gtsam::NonlinearFactorGraph createOdometryFactors(const RelativePoseEstimates& r
     // (2) Create a factor from the relative pose and cov
   //  gtsam::Key key1 = key_generator.generateKey(factors::key_type::Pose2, relative_poses[i].timestamp1);
   //  gtsam::Key key2 = key_generator.generateKey(factors::key_type::Pose2, relative_poses[i].timestamp2);
-    gtsam::Key key1 = *std::next(keys.begin(),i);
-    gtsam::Key key2 = *std::next(keys.begin(),i+1);
+    gtsam::Key key1 = *key_iter;
+    gtsam::Key key2 = *(++key_iter);
 
     gtsam::NonlinearFactor::shared_ptr factor(new factors::OdometryFactor(key1, key2, relative_poses[i].relative_pose, noise_model));
     factors.push_back(factor);
@@ -257,6 +296,181 @@ gtsam::NonlinearFactorGraph createOdometryFactors(const RelativePoseEstimates& r
   return factors;
 }
 
+/* ************************************************************************* */
+gtsam::NonlinearFactorGraph createOdometryFactors(const RelativePoseEstimates& relative_poses, double time_tolerance) {
+  gtsam::NonlinearFactorGraph factors;
+
+  if(relative_poses.empty()) {
+    throw std::runtime_error("No relative poses available for factor creation.");
+  }
+
+  // Create a GTSAM Key Generator for creating variable names
+  factors::KeyGenerator key_generator(time_tolerance);
+
+  // Each factor connects the poses at its own timestamps
+  for(size_t i = 0; i < relative_poses.size(); ++i) {
+    gtsam::Key key1 = key_generator.generateKey(factors::key_type::Pose2, relative_poses[i].timestamp1);
+    gtsam::Key key2 = key_generator.generateKey(factors::key_type::Pose2, relative_poses[i].timestamp2);
+    if(key1 == key2) continue;
+    gtsam::noiseModel::Base::shared_ptr noise_model = gtsam::noiseModel::Gaussian::Covariance(relative_poses[i].cov, true);
+    factors.push_back(gtsam::NonlinearFactor::shared_ptr(new factors::OdometryFactor(key1, key2, relative_poses[i].relative_pose, noise_model)));
+  }
+
+  return factors;
+}
+
+/* ************************************************************************* */
+OdometryPreintegrator::OdometryPreintegrator(const gtsam::Vector& sigmas, double history, double scale) :
+    G_(3,4), history_(history), scale_(scale), anchored_(false) {
+  G_(0,0) = sigmas(0); G_(0,1) = 0.0;       G_(0,2) = sigmas(1); G_(0,3) = sigmas(2);
+  G_(1,0) = 0.0;       G_(1,1) = sigmas(0); G_(1,2) = sigmas(1); G_(1,3) = sigmas(2);
+  G_(2,0) = sigmas(3); G_(2,1) = sigmas(3); G_(2,2) = sigmas(4); G_(2,3) = sigmas(5);
+}
+
+/* ************************************************************************* */
+void OdometryPreintegrator::integrate(const Sample& sample1, const Sample& sample2, const ros::Time& timestamp1, const ros::Time& timestamp2,
+    gtsam::Pose2& relative_pose, gtsam::Matrix& cov) const {
+  if(timestamp2 <= timestamp1) return;
+
+  // Interpolate within the message interval, as splitOdometry does
+  gtsam::Vector pose_delta = sample1.pose.localCoordinates(sample2.pose);
+  double time_delta = (sample2.timestamp - sample1.timestamp).toSec();
+  gtsam::Pose2 pose1 = sample1.pose.retract(((timestamp1 - sample1.timestamp).toSec() / time_delta)*pose_delta);
+  gtsam::Pose2 pose2 = sample1.pose.retract(((timestamp2 - sample1.timestamp).toSec() / time_delta)*pose_delta);
+  gtsam::Pose2 pose_increment = pose1.between(pose2);
+  pose_increment = gtsam::Pose2(pose_increment.x()*scale_, pose_increment.y()*scale_, pose_increment.theta());
+
+  // Accumulate the pose and covariance
+  gtsam::Matrix H2;
+  relative_pose = relative_pose.compose(pose_increment, boost::none, H2);
+  gtsam::Vector delta(4);
+  delta(0) = pose_increment.x();
+  delta(1) = pose_increment.y();
+  delta(2) = pose_increment.theta();
+  delta(3) = (timestamp2 - timestamp1).toSec();
+  cov = H2 * cov * H2.transpose() + (G_ * delta)*(G_ * delta).transpose();
+}
+
+/* ************************************************************************* */
+void OdometryPreintegrator::advance(size_t index) {
+  Sample& sample = samples_[index];
+  const Sample& previous = samples_[index - 1];
+  // Samples up to the keyframe carry no motion since the keyframe
+  if(previous.timestamp <= anchor_) {
+    sample.relative_pose = gtsam::Pose2::identity();
+    sample.cov = gtsam::zeros(3,3);
+  } else {
+    sample.relative_pose = previous.relative_pose;
+    sample.cov = previous.cov;
+  }
+  integrate(previous, sample, std::max(anchor_, previous.timestamp), sample.timestamp, sample.relative_pose, sample.cov);
+}
+
+/* ************************************************************************* */
+void OdometryPreintegrator::closeIncrement(const ros::Time& timestamp) {
+  // The first sample at or after the keyframe; the interval before it spans the keyframe
+  size_t index = std::lower_bound(samples_.begin(), samples_.end(), timestamp,
+      [](const Sample& sample, const ros::Time& t) { return sample.timestamp < t; }) - samples_.begin();
+  ros::Time keyframe = timestamp;
+  if(index == 0) {
+    ROS_WARN_STREAM("Keyframe at " << timestamp << " is older than the odometry history; using " << samples_.front().timestamp << " instead.");
+    keyframe = samples_.front().timestamp;
+    index = 1;
+  }
+
+  // The increment is the state at the sample before the keyframe plus the split interval. A keyframe
+  // that falls back onto the anchor closes nothing.
+  if(anchored_ && keyframe <= anchor_) return;
+  if(anchored_) {
+    const Sample& previous = samples_[index - 1];
+    RelativePoseEstimate increment;
+    increment.timestamp1 = anchor_;
+    increment.timestamp2 = keyframe;
+    increment.relative_pose = (previous.timestamp <= anchor_) ? gtsam::Pose2::identity() : previous.relative_pose;
+    increment.cov = (previous.timestamp <= anchor_) ? gtsam::Matrix(gtsam::zeros(3,3)) : previous.cov;
+    if(index < samples_.size()) {
+      integrate(previous, samples_[index], std::max(anchor_, previous.timestamp), keyframe, increment.relative_pose, increment.cov);
+    }
+    if(isnan(increment.relative_pose.x()) || isnan(increment.relative_pose.y()) || isnan(increment.relative_pose.theta())) {
+      increment.relative_pose = gtsam::Pose2(0.0,0.0,0.0);
+      increment.cov = gtsam::zeros(3,3);
+    }
+    finished_.push_back(increment);
+  }
+  anchor_ = keyframe;
+  anchored_ = true;
+
+  // Only the sample before the keyframe is needed to split later intervals; the samples after it
+  // are re-integrated from the keyframe, which only touches the messages of a late keyframe
+  samples_.erase(samples_.begin(), samples_.begin() + (index - 1));
+  for(size_t i = 1; i < samples_.size(); ++i) {
+    advance(i);
+  }
+}
+
+/* ************************************************************************* */
+void OdometryPreintegrator::add(const nav_msgs::Odometry& message) {
+  Sample sample;
+  sample.timestamp = message.header.stamp;
+  sample.pose = gtsam::Pose2(message.pose.pose.position.x, message.pose.pose.position.y, tf::getYaw(message.pose.pose.orientation));
+  sample.relative_pose = gtsam::Pose2::identity();
+  sample.cov = gtsam::zeros(3,3);
+  if(!samples_.empty() && sample.timestamp <= samples_.back().timestamp) return;
+  samples_.push_back(sample);
+  if(samples_.size() < 2) return;
+
+  // Fold the new interval into the running increment, then close the keyframes it reaches past
+  if(anchored_) advance(samples_.size() - 1);
+  while(!pending_.empty() && pending_.front() <= sample.timestamp) {
+    closeIncrement(pending_.front());
+    pending_.pop_front();
+  }
+
+  // Older samples are only kept for keyframes that are declared late
+  while(samples_.size() > 2 && (sample.timestamp - samples_[1].timestamp).toSec() > history_) {
+    samples_.pop_front();
+  }
+}
+
+/* ************************************************************************* */
+void OdometryPreintegrator::declareKeyframe(const ros::Time& timestamp) {
+  // Consecutive matches share a timestamp; a keyframe is only closed once
+  if(anchored_ && timestamp <= anchor_) return;
+  if(!pending_.empty() && timestamp <= pending_.back()) return;
+  if(!pending_.empty() || samples_.empty() || timestamp > samples_.back().timestamp) {
+    pending_.push_back(timestamp);
+  } else {
+    closeIncrement(timestamp);
+  }
+}
+
+/* ************************************************************************* */
+size_t OdometryPreintegrator::collect(const ros::Time& until, RelativePoseEstimates& increments) {
+  size_t count = 0;
+  while(count < finished_.size() && finished_[count].timestamp2 <= until) {
+    increments.push_back(finished_[count]);
+    ++count;
+  }
+  finished_.erase(finished_.begin(), finished_.begin() + count);
+  return count;
+}
+
+/* ************************************************************************* */
+RelativePoseEstimate OdometryPreintegrator::current() const {
+  RelativePoseEstimate increment;
+  increment.timestamp1 = anchor_;
+  increment.relative_pose = gtsam::Pose2::identity();
+  increment.cov = gtsam::zeros(3,3);
+  if(!samples_.empty()) {
+    increment.timestamp2 = samples_.back().timestamp;
+    if(anchored_ && samples_.back().timestamp > anchor_) {
+      increment.relative_pose = samples_.back().relative_pose;
+      increment.cov = samples_.back().cov;
+    }
+  }
+  return increment;
+}
+
 /* ************************************************************************* */
 } /// @namespace odometry
 
@@ -3,6 +3,7 @@
  */
 
 #include <aslam_demo/mapping/optimization_processing.h>
+#include <aslam_demo/mapping/graph_validator.h>
 #include <aslam_demo/mapping/mapping_common.h>
 #include <aslam_demo/mapping/timer.h>
 #include <aslam_demo/factors/odometry_factor.h>
@@ -11,7 +12,6 @@
 #include <aslam_demo/factors/key_generator.h>
 #include <gtsam/nonlinear/Marginals.h>
 #include <boost/filesystem.hpp>
-#include <queue>
 #include <fstream>
 
 namespace mapping {
@@ -20,86 +20,10 @@ namespace optimization {
 
 /* ************************************************************************* */
 bool validateFactorGraph(const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values) {
-
-  // Extract all of the keys from the factor graph and values
-  gtsam::FastSet<gtsam::Key> factor_keys = factors.keys();
-  gtsam::FastList<gtsam::Key> values_keys_list = values.keys();
-  gtsam::FastSet<gtsam::Key> values_keys(values_keys_list.begin(), values_keys_list.end());
-
-  // Check that all factor graph keys are contained in the values
-  std::vector<gtsam::Key> missing_values;
-  std::set_difference(factor_keys.begin(), factor_keys.end(), values_keys.begin(), values_keys.end(), std::back_inserter(missing_values));
-  bool all_keys_have_values = missing_values.empty();
-  for(size_t i = 0; i < missing_values.size(); ++i) {
-    ROS_ERROR_STREAM("Key " << factors::BnrTimestampKeyFormatter(missing_values.at(i)) << " does not have a value.");
-  }
-
-  // Check that all keys in the values structure are involved in at least one factor
-  std::vector<gtsam::Key> missing_factors;
-  std::set_difference(values_keys.begin(), values_keys.end(), factor_keys.begin(), factor_keys.end(), std::back_inserter(missing_factors));
-  bool all_keys_have_factors = missing_factors.empty();
-  for(size_t i = 0; i < missing_factors.size(); ++i) {
-    ROS_ERROR_STREAM("Key " << factors::BnrTimestampKeyFormatter(missing_factors.at(i)) << " does not have a factor.");
-  }
-
-  // Check that the graph is connected. This is done via a breadth-first search
-  bool graph_is_connected = false;
-  {
-    // Convert the factor graph to a "symbolic" version with sequentially numbered keys
-    gtsam::Ordering::shared_ptr ordering = values.orderingArbitrary();
-    gtsam::SymbolicFactorGraph::shared_ptr symbolic = factors.symbolic(*ordering);
-    // Compute the variable adjacency matrix
-    std::vector<std::set<gtsam::Index> > adjacency(ordering->size());
-    for(size_t factor_index = 0; factor_index < symbolic->size(); ++factor_index) {
-      if(symbolic->operator[](factor_index)) {
-        BOOST_FOREACH(const gtsam::Index key1, symbolic->operator[](factor_index)->keys()) {
-          BOOST_FOREACH(const gtsam::Index key2, symbolic->operator[](factor_index)->keys()) {
-            if(key1 != key2) adjacency[key1].insert(key2);
-          }
-        }
-      }
-    }
-    // Create a list of visited keys
-    std::vector<gtsam::Index> visited(values_keys.size(), false);
-    // Create a queue of pending keys to check
-    std::set<gtsam::Index> queue;
-    // Push the first key into the queue to start the search
-    if(!visited.empty()) queue.insert(0);
-    // Loop until we are out of keys in the queue
-    while(!queue.empty()) {
-      // Pop the next key off of the queue
-      gtsam::Index key = *queue.begin();
-      queue.erase(queue.begin());
-      // Mark the key as visited
-      visited.at(key) = true;
-      // Add all unvisited neighbors to the queue
-      BOOST_FOREACH(gtsam::Index adjacent_key, adjacency[key]) {
-        if(!visited[adjacent_key]) {
-          queue.insert(adjacent_key);
-        }
-      }
-    }
-    // Check for unvisited keys
-    std::vector<gtsam::Key> unvisited_keys;
-    for(size_t i = 0; i < visited.size(); ++i) {
-      if(!visited[i]) {
-        unvisited_keys.push_back(ordering->key(i));
-      }
-    }
-    if(unvisited_keys.size() < 10) {
-      for(size_t i = 0; i < unvisited_keys.size(); ++i) {
-        ROS_ERROR_STREAM("Key " << factors::BnrTimestampKeyFormatter(unvisited_keys[i]) << " is not connected.");
-      }
-    } else if(unvisited_keys.size() >= 10) {
-      for(size_t i = 0; i < 5; ++i) {
-        ROS_ERROR_STREAM("Key " << factors::BnrTimestampKeyFormatter(unvisited_keys[i]) << " is not connected.");
-      }
-      ROS_ERROR_STREAM((unvisited_keys.size() - 5) << " additional keys are not connected.");
-    }
-    graph_is_connected = (unvisited_keys.empty());
-  }
-
-  return graph_is_connected && all_keys_have_values && all_keys_have_factors;
+  // Checked as a single batch against an empty graph: one union-find pass instead of a search over
+  // an adjacency structure built for the purpose
+  GraphValidator validator;
+  return validator.check(factors, values);
 }
 
 /* ************************************************************************* */
@@ -148,7 +72,43 @@ void customOptimizationLoop(gtsam::LevenbergMarquardtOptimizer& optimizer) {
 }
 
 /* ************************************************************************* */
-gtsam::Values optimizeFactorGraph(const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values, const gtsam::LevenbergMarquardtParams& parameters) {
+OrderingCache::OrderingCache(double recompute_fraction) :
+    recompute_fraction_(recompute_fraction), colamd_size_(0) {
+}
+
+/* ************************************************************************* */
+const gtsam::Ordering& OrderingCache::update(const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values) {
+  // Append the new variables behind the cached ones
+  size_t appended = 0;
+  BOOST_FOREACH(const gtsam::Values::ConstKeyValuePair& key_value, values) {
+    if(!ordering_.exists(key_value.key)) {
+      ordering_.push_back(key_value.key);
+      ++appended;
+    }
+  }
+
+  // Variables in the ordering but not in the values were removed from the graph
+  bool removed = (ordering_.size() != values.size());
+  if(removed || ordering_.size() - colamd_size_ > recompute_fraction_ * colamd_size_) {
+    ordering_ = *factors.orderingCOLAMD(values);
+    colamd_size_ = ordering_.size();
+    ROS_DEBUG_STREAM("Recomputed the COLAMD ordering of " << colamd_size_ << " variables.");
+  } else if(appended > 0) {
+    ROS_DEBUG_STREAM("Appended " << appended << " variables to the cached ordering.");
+  }
+
+  return ordering_;
+}
+
+/* ************************************************************************* */
+void OrderingCache::clear() {
+  ordering_ = gtsam::Ordering();
+  colamd_size_ = 0;
+}
+
+/* ************************************************************************* */
+gtsam::Values optimizeFactorGraph(const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values, const gtsam::LevenbergMarquardtParams& parameters,
+    OrderingCache* ordering_cache) {
   gtsam::Values optimized_values;
 
   Timer timer;
@@ -158,7 +118,9 @@ gtsam::Values optimizeFactorGraph(const gtsam::NonlinearFactorGraph& factors, co
   double initial_error = 0;
   double final_error = 0;
   try{
-    gtsam::LevenbergMarquardtOptimizer optimizer(factors, values, parameters);
+    gtsam::LevenbergMarquardtParams optimizer_parameters = parameters;
+    if(ordering_cache) optimizer_parameters.ordering = ordering_cache->update(factors, values);
+    gtsam::LevenbergMarquardtOptimizer optimizer(factors, values, optimizer_parameters);
     initial_error = optimizer.error();
     // Use the custom optimization loop instead of the built-in 'optimizer.optimize()'. The built-in function
     // does not have a lower-bound on lambda, which can cause an infinite loop in rare situations.
@@ -195,6 +157,256 @@ Covariances computeCovariances(const gtsam::NonlinearFactorGraph& factors, const
   return covariances;
 }
 
+/* ************************************************************************* */
+static gtsam::Matrix conditionalCovariance(const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values, gtsam::Key key) {
+  // Gather the factors on the variable and the values they need, with the variable ordered first so
+  // its block is the top-left corner of the Hessian
+  gtsam::NonlinearFactorGraph local_factors;
+  gtsam::Ordering ordering;
+  gtsam::Values local_values;
+  ordering.push_back(key);
+  local_values.insert(key, values.at(key));
+  BOOST_FOREACH(const gtsam::NonlinearFactor::shared_ptr& factor, factors) {
+    if(!factor || std::find(factor->begin(), factor->end(), key) == factor->end()) continue;
+    local_factors.push_back(factor);
+    BOOST_FOREACH(gtsam::Key other, factor->keys()) {
+      if(!local_values.exists(other)) {
+        ordering.push_back(other);
+        local_values.insert(other, values.at(other));
+      }
+    }
+  }
+  if(local_factors.empty()) {
+    throw std::runtime_error("No factor constrains the variable.");
+  }
+
+  size_t dim = values.at(key).dim();
+  gtsam::Matrix information = local_factors.linearize(local_values, ordering)->augmentedHessian().topLeftCorner(dim, dim);
+  return information.inverse();
+}
+
+/* ************************************************************************* */
+Covariances computeCovariances(const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values, const std::set<gtsam::Key>& keys, CovarianceMode mode) {
+  Covariances covariances;
+  if(keys.empty()) return covariances;
+
+  Timer timer;
+  timer.start();
+
+  try {
+    if(mode == ConditionalCovariance) {
+      BOOST_FOREACH(gtsam::Key key, keys) {
+        covariances[key] = conditionalCovariance(factors, values, key);
+      }
+    } else {
+      gtsam::Marginals marginals(factors, values, gtsam::Marginals::CHOLESKY);
+      BOOST_FOREACH(gtsam::Key key, keys) {
+        covariances[key] = marginals.marginalCovariance(key);
+      }
+    }
+  } catch(const std::exception& e) {
+    throw std::runtime_error("An error occurred while computing marginal covariances: " + std::string(e.what()));
+  }
+
+  timer.stop();
+  ROS_DEBUG_STREAM("Computed " << covariances.size() << " covariances in " << timer.elapsed() << " seconds.");
+
+  return covariances;
+}
+
+/* ************************************************************************* */
+static gtsam::ISAM2Params incrementalParameters(double relinearize_threshold, int relinearize_skip) {
+  gtsam::ISAM2Params parameters;
+  parameters.relinearizeThreshold = relinearize_threshold;
+  parameters.relinearizeSkip = relinearize_skip;
+  return parameters;
+}
+
+/* ************************************************************************* */
+IncrementalOptimizer::IncrementalOptimizer(double relinearize_threshold, int relinearize_skip) :
+    isam_(incrementalParameters(relinearize_threshold, relinearize_skip)) {
+}
+
+/* ************************************************************************* */
+gtsam::Values IncrementalOptimizer::update(const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values, size_t extra_iterations) {
+
+  Timer timer;
+  timer.start();
+
+  // Only variables that are new to the Bayes tree get an initial value
+  gtsam::Values new_values;
+  BOOST_FOREACH(const gtsam::Values::ConstKeyValuePair& key_value, values) {
+    if(!exists(key_value.key)) new_values.insert(key_value.key, key_value.value);
+  }
+
+  gtsam::ISAM2Result result;
+  try {
+    result = isam_.update(factors, new_values);
+    for(size_t i = 0; i < extra_iterations; ++i) {
+      isam_.update();
+    }
+  } catch(const std::exception& e) {
+    throw std::runtime_error("An error occurred while incrementally optimizing the factor graph: " + std::string(e.what()));
+  }
+  gtsam::Values estimate = isam_.calculateEstimate();
+
+  timer.stop();
+  ROS_DEBUG_STREAM("Incrementally added " << factors.size() << " factors and " << new_values.size() << " variables in " << timer.elapsed() << " seconds. "
+      << result.variablesRelinearized << " variables relinearized, " << result.variablesReeliminated << " re-eliminated, "
+      << estimate.size() << " in total.");
+
+  return estimate;
+}
+
+/* ************************************************************************* */
+gtsam::Values IncrementalOptimizer::estimate() const {
+  return isam_.calculateEstimate();
+}
+
+/* ************************************************************************* */
+Covariances IncrementalOptimizer::computeCovariances(const std::set<gtsam::Key>& keys, CovarianceMode mode) const {
+  std::set<gtsam::Key> present;
+  BOOST_FOREACH(gtsam::Key key, keys) {
+    if(exists(key)) present.insert(key);
+  }
+  if(mode == ConditionalCovariance) {
+    return optimization::computeCovariances(isam_.getFactorsUnsafe(), isam_.getLinearizationPoint(), present, mode);
+  }
+
+  Covariances covariances;
+
+  Timer timer;
+  timer.start();
+
+  try {
+    BOOST_FOREACH(gtsam::Key key, present) {
+      covariances[key] = isam_.marginalCovariance(key);
+    }
+  } catch(const std::exception& e) {
+    throw std::runtime_error("An error occurred while computing marginal covariances: " + std::string(e.what()));
+  }
+
+  timer.stop();
+  ROS_DEBUG_STREAM("Recovered " << covariances.size() << " covariances from the Bayes tree in " << timer.elapsed() << " seconds.");
+
+  return covariances;
+}
+
+/* ************************************************************************* */
+FixedLagSmoother::FixedLagSmoother(double lag, const gtsam::LevenbergMarquardtParams& parameters) :
+    lag_(lag), parameters_(parameters) {
+}
+
+/* ************************************************************************* */
+gtsam::Values FixedLagSmoother::update(const gtsam::NonlinearFactorGraph& factors, const gtsam::Values& values, const std::map<gtsam::Key, ros::Time>& timestamps) {
+
+  Timer timer;
+  timer.start();
+
+  // Add the new variables to the window
+  BOOST_FOREACH(const gtsam::Values::ConstKeyValuePair& key_value, values) {
+    if(estimate_.exists(key_value.key)) continue;
+    std::map<gtsam::Key, ros::Time>::const_iterator timestamp = timestamps.find(key_value.key);
+    if(timestamp == timestamps.end()) {
+      throw std::runtime_error("The fixed-lag smoother needs the timestamp of every new variable.");
+    }
+    estimate_.insert(key_value.key, key_value.value);
+    timestamps_[key_value.key] = timestamp->second;
+  }
+
+  // Factors reaching back to variables that were already marginalized cannot be added any more
+  size_t dropped = 0;
+  BOOST_FOREACH(const gtsam::NonlinearFactor::shared_ptr& factor, factors) {
+    if(!factor) continue;
+    bool in_window = true;
+    BOOST_FOREACH(gtsam::Key key, factor->keys()) {
+      if(!estimate_.exists(key)) in_window = false;
+    }
+    if(in_window) factors_.push_back(factor);
+    else ++dropped;
+  }
+
+  estimate_ = optimizeFactorGraph(factors_, estimate_, parameters_);
+  gtsam::Values window_estimate = estimate_;
+
+  // Marginalize everything older than the lag behind the newest variable
+  std::set<gtsam::Key> old_keys;
+  if(!timestamps_.empty()) {
+    ros::Time latest = timestamps_.begin()->second;
+    for(std::map<gtsam::Key, ros::Time>::const_iterator iter = timestamps_.begin(); iter != timestamps_.end(); ++iter) {
+      latest = std::max(latest, iter->second);
+    }
+    for(std::map<gtsam::Key, ros::Time>::const_iterator iter = timestamps_.begin(); iter != timestamps_.end(); ++iter) {
+      if((latest - iter->second).toSec() > lag_) old_keys.insert(iter->first);
+    }
+  }
+  if(!old_keys.empty()) marginalize(old_keys);
+
+  timer.stop();
+  ROS_DEBUG_STREAM("Fixed-lag smoother update with " << factors.size() << " new factors (" << dropped << " dropped) in " << timer.elapsed() << " seconds. "
+      << old_keys.size() << " variables marginalized, " << estimate_.size() << " in the window.");
+
+  return window_estimate;
+}
+
+/* ************************************************************************* */
+Covariances FixedLagSmoother::computeCovariances(const std::set<gtsam::Key>& keys, CovarianceMode mode) const {
+  std::set<gtsam::Key> present;
+  BOOST_FOREACH(gtsam::Key key, keys) {
+    if(exists(key)) present.insert(key);
+  }
+  if(present.empty()) return Covariances();
+  return optimization::computeCovariances(factors_, estimate_, present, mode);
+}
+
+/* ************************************************************************* */
+void FixedLagSmoother::marginalize(const std::set<gtsam::Key>& keys) {
+
+  // Split the factors into those touching the marginalized variables and the rest
+  gtsam::NonlinearFactorGraph affected, remaining;
+  std::set<gtsam::Key> neighbours;
+  BOOST_FOREACH(const gtsam::NonlinearFactor::shared_ptr& factor, factors_) {
+    if(!factor) continue;
+    bool touches = false;
+    BOOST_FOREACH(gtsam::Key key, factor->keys()) {
+      if(keys.count(key)) touches = true;
+    }
+    if(touches) {
+      affected.push_back(factor);
+      BOOST_FOREACH(gtsam::Key key, factor->keys()) {
+        if(!keys.count(key)) neighbours.insert(key);
+      }
+    } else {
+      remaining.push_back(factor);
+    }
+  }
+
+  // Order the marginalized variables first, so eliminating the first frontals leaves the marginal
+  // on the neighbours
+  gtsam::Ordering ordering;
+  gtsam::Values linearization_point;
+  BOOST_FOREACH(gtsam::Key key, keys) {
+    ordering.push_back(key);
+    linearization_point.insert(key, estimate_.at(key));
+  }
+  BOOST_FOREACH(gtsam::Key key, neighbours) {
+    ordering.push_back(key);
+    linearization_point.insert(key, estimate_.at(key));
+  }
+
+  if(!neighbours.empty()) {
+    gtsam::GaussianFactorGraph::shared_ptr linear = affected.linearize(linearization_point, ordering);
+    gtsam::GaussianFactorGraph marginal = linear->eliminateFrontals(keys.size(), gtsam::EliminateQR).second;
+    remaining.push_back(gtsam::LinearContainerFactor::convertLinearGraph(marginal, ordering, linearization_point));
+  }
+
+  factors_ = remaining;
+  BOOST_FOREACH(gtsam::Key key, keys) {
+    estimate_.erase(key);
+    timestamps_.erase(key);
+  }
+}
+
 ///* ************************************************************************* */
 //void writeCovariances(const std::string& filename, double time_tolerance, const gtsam::Values& values, const Covariances& covariances) {
 //
@@ -432,12 +432,14 @@ void ProbabilityMap::update(int row, int col, double probability) {
       + boost::lexical_cast<std::string>(row) + "," + boost::lexical_cast<std::string>(col)
       + ") is not within the map bounds.");
 
-  double old_probability = this->at(row,col) + entropy_tol_;
-  double old_val = old_probability*log(old_probability) + (1 - old_probability)*log(1 - old_probability);
-  double new_probability = probability + entropy_tol_;
-  double new_val = new_probability*log(new_probability) + (1 - new_probability)*log(1 - new_probability);
-  if(!(std::isnan(old_val) || std::isnan(new_val))) {
-    shannon_entropy_ += old_val - new_val;
+  if(track_entropy_) {
+    double old_probability = this->at(row,col) + entropy_tol_;
+    double old_val = old_probability*log(old_probability) + (1 - old_probability)*log(1 - old_probability);
+    double new_probability = probability + entropy_tol_;
+    double new_val = new_probability*log(new_probability) + (1 - new_probability)*log(1 - new_probability);
+    if(!(std::isnan(old_val) || std::isnan(new_val))) {
+      shannon_entropy_ += old_val - new_val;
+    }
   }
 
   // Increment the log-odds entry by the provided probability value
@@ -446,6 +448,55 @@ void ProbabilityMap::update(int row, int col, double probability) {
   if(data_(row,col) < -MAX_LOG_ODDS) data_(row,col) = -MAX_LOG_ODDS;
 }
 
+/* ************************************************************************* */
+void ProbabilityMap::setLogOdds(int row, int col, double log_odds) {
+  // Bounds check
+  if(!inside(row,col)) throw std::runtime_error("Requested map coordinates ("
+      + boost::lexical_cast<std::string>(row) + "," + boost::lexical_cast<std::string>(col)
+      + ") is not within the map bounds.");
+
+  if(log_odds > +MAX_LOG_ODDS) log_odds = +MAX_LOG_ODDS;
+  if(log_odds < -MAX_LOG_ODDS) log_odds = -MAX_LOG_ODDS;
+  if(data_(row,col) == log_odds) return;
+
+  double old_probability = LogOddsToProbability(data_(row,col)) + entropy_tol_;
+  double old_val = old_probability*log(old_probability) + (1 - old_probability)*log(1 - old_probability);
+  double new_probability = LogOddsToProbability(log_odds) + entropy_tol_;
+  double new_val = new_probability*log(new_probability) + (1 - new_probability)*log(1 - new_probability);
+  if(!(std::isnan(old_val) || std::isnan(new_val))) {
+    shannon_entropy_ += old_val - new_val;
+  }
+
+  data_(row,col) = log_odds;
+}
+
+/* ************************************************************************* */
+void ProbabilityMap::shrinkToFit() {
+  int row_min = rows(), row_max = -1;
+  int col_min = cols(), col_max = -1;
+  for(int row = 0; row < (int)rows(); ++row) {
+    for(int col = 0; col < (int)cols(); ++col) {
+      if(data_(row,col) != 0.0) {
+        row_min = std::min(row_min, row);
+        row_max = std::max(row_max, row);
+        col_min = std::min(col_min, col);
+        col_max = std::max(col_max, col);
+      }
+    }
+  }
+
+  // Keep a single cell for an empty map
+  if(row_max < 0) {
+    row_min = row_max = 0;
+    col_min = col_max = 0;
+  }
+
+  gtsam::Matrix cropped = data_.block(row_min, col_min, row_max - row_min + 1, col_max - col_min + 1);
+  data_ = cropped;
+  origin_ = origin_ + gtsam::Point2(col_min * cell_size_, row_min * cell_size_);
+  calcShannonEntropy();
+}
+
 void ProbabilityMap::nanRecalc() {
   if(std::isnan(shannon_entropy_)) {
     calcShannonEntropy();
@@ -0,0 +1,95 @@
+/**
+ * scan_match_cache.cpp
+ */
+
+#include <aslam_demo/mapping/scan_match_cache.h>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace mapping {
+
+namespace csm {
+
+/* ************************************************************************* */
+bool ScanMatchCache::Key::operator<(const Key& other) const {
+  if(timestamp1 != other.timestamp1) return timestamp1 < other.timestamp1;
+  if(timestamp2 != other.timestamp2) return timestamp2 < other.timestamp2;
+  if(x != other.x) return x < other.x;
+  if(y != other.y) return y < other.y;
+  return theta < other.theta;
+}
+
+/* ************************************************************************* */
+ScanMatchCache::ScanMatchCache(size_t capacity, double translation_resolution, double rotation_resolution) :
+    capacity_(std::max<size_t>(capacity, 1)), translation_resolution_(translation_resolution),
+    rotation_resolution_(rotation_resolution), hits_(0), misses_(0) {
+  if(translation_resolution_ <= 0.0 || rotation_resolution_ <= 0.0) {
+    throw std::runtime_error("The scan match cache resolutions must be positive.");
+  }
+}
+
+/* ************************************************************************* */
+ScanMatchCache::Key ScanMatchCache::makeKey(const ros::Time& timestamp1, const ros::Time& timestamp2, const gtsam::Pose2& initial_guess) const {
+  Key key;
+  key.timestamp1 = timestamp1;
+  key.timestamp2 = timestamp2;
+  key.x = std::floor(initial_guess.x() / translation_resolution_ + 0.5);
+  key.y = std::floor(initial_guess.y() / translation_resolution_ + 0.5);
+  key.theta = std::floor(initial_guess.theta() / rotation_resolution_ + 0.5);
+  return key;
+}
+
+/* ************************************************************************* */
+bool ScanMatchCache::lookup(const ros::Time& timestamp1, const ros::Time& timestamp2, const gtsam::Pose2& initial_guess, RelativePoseEstimate& match, bool& valid) {
+  std::map<Key, Entry>::iterator iter = entries_.find(makeKey(timestamp1, timestamp2, initial_guess));
+  if(iter == entries_.end()) {
+    ++misses_;
+    return false;
+  }
+
+  ++hits_;
+  lru_.splice(lru_.begin(), lru_, iter->second.lru);
+  valid = iter->second.valid;
+  if(valid) match = iter->second.match;
+  return true;
+}
+
+/* ************************************************************************* */
+void ScanMatchCache::insert(const ros::Time& timestamp1, const ros::Time& timestamp2, const gtsam::Pose2& initial_guess, const RelativePoseEstimate& match) {
+  store(makeKey(timestamp1, timestamp2, initial_guess), true, match);
+}
+
+/* ************************************************************************* */
+void ScanMatchCache::insertFailure(const ros::Time& timestamp1, const ros::Time& timestamp2, const gtsam::Pose2& initial_guess) {
+  store(makeKey(timestamp1, timestamp2, initial_guess), false, RelativePoseEstimate());
+}
+
+/* ************************************************************************* */
+void ScanMatchCache::store(const Key& key, bool valid, const RelativePoseEstimate& match) {
+  std::map<Key, Entry>::iterator iter = entries_.find(key);
+  if(iter != entries_.end()) {
+    lru_.splice(lru_.begin(), lru_, iter->second.lru);
+  } else {
+    // Evict the least recently used outcome
+    if(entries_.size() >= capacity_) {
+      entries_.erase(lru_.back());
+      lru_.pop_back();
+    }
+    lru_.push_front(key);
+    iter = entries_.insert(std::make_pair(key, Entry())).first;
+    iter->second.lru = lru_.begin();
+  }
+  iter->second.valid = valid;
+  iter->second.match = match;
+}
+
+/* ************************************************************************* */
+void ScanMatchCache::clear() {
+  entries_.clear();
+  lru_.clear();
+}
+
+} /// @namespace csm
+
+} /// @namespace mapping
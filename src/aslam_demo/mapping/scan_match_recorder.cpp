@@ -0,0 +1,155 @@
+/**
+ * scan_match_recorder.cpp
+ */
+
+#include <aslam_demo/mapping/scan_match_recorder.h>
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+namespace mapping {
+
+namespace csm {
+
+/* ************************************************************************* */
+ScanMatchRecorder::ScanMatchRecorder(const std::string& filename, size_t capacity, size_t max_rays,
+    size_t sample_interval, size_t max_records) :
+    max_rays_(max_rays), sample_interval_(std::max<size_t>(sample_interval, 1)), max_records_(max_records),
+    enqueue_position_(0), dequeue_position_(0), match_counter_(0), accepted_(0), written_(0), dropped_(0),
+    file_(NULL), active_(true) {
+
+  // Round the capacity up to a power of two so the slot index is a mask
+  size_t slot_count = 2;
+  while(slot_count < capacity) slot_count <<= 1;
+  mask_ = slot_count - 1;
+
+  // Preallocate every slot, so record() never allocates
+  slots_.reset(new Slot[slot_count]);
+  for(size_t i = 0; i < slot_count; ++i) {
+    slots_[i].sequence.store(i, std::memory_order_relaxed);
+    ScanRecord* records[2] = { &slots_[i].reference, &slots_[i].scan };
+    for(size_t j = 0; j < 2; ++j) {
+      records[j]->theta.resize(max_rays_);
+      records[j]->readings.resize(max_rays_);
+      records[j]->valid.resize(max_rays_);
+    }
+  }
+
+  // Create the output file
+  boost::filesystem::path file_path(filename);
+  if(file_path.has_parent_path()) boost::filesystem::create_directories(file_path.parent_path());
+  file_ = std::fopen(filename.c_str(), "wb");
+  if(!file_) {
+    throw std::runtime_error("Unable to open the scan match log " + filename);
+  }
+  const char magic[4] = { 'C', 'S', 'M', 'R' };
+  uint32_t version = 1;
+  std::fwrite(magic, sizeof(magic), 1, file_);
+  std::fwrite(&version, sizeof(version), 1, file_);
+
+  writer_thread_ = std::thread(&ScanMatchRecorder::writeRecords, this);
+}
+
+/* ************************************************************************* */
+ScanMatchRecorder::~ScanMatchRecorder() {
+  active_ = false;
+  if(writer_thread_.joinable()) writer_thread_.join();
+  if(file_) std::fclose(file_);
+  ROS_DEBUG_STREAM("Scan match recorder wrote " << written_ << " records and dropped " << dropped_ << ".");
+}
+
+/* ************************************************************************* */
+bool ScanMatchRecorder::record(const struct laser_data* reference, const struct laser_data* scan, const ros::Time& timestamp1, const ros::Time& timestamp2,
+    bool force) {
+
+  // Apply the sampling and the record limit
+  size_t match = match_counter_.fetch_add(1, std::memory_order_relaxed);
+  bool sampled = (match % sample_interval_) == 0;
+  if(!sampled && !force) return false;
+  if(max_records_ > 0 && accepted_.load(std::memory_order_relaxed) >= max_records_) return false;
+
+  // Claim a slot
+  Slot* slot;
+  size_t position = enqueue_position_.load(std::memory_order_relaxed);
+  while(true) {
+    slot = &slots_[position & mask_];
+    size_t sequence = slot->sequence.load(std::memory_order_acquire);
+    intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+    if(difference == 0) {
+      if(enqueue_position_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+    } else if(difference < 0) {
+      // The ring is full; never block the matcher
+      ++dropped_;
+      return false;
+    } else {
+      position = enqueue_position_.load(std::memory_order_relaxed);
+    }
+  }
+
+  // Fill and publish the slot
+  slot->timestamp1 = timestamp1;
+  slot->timestamp2 = timestamp2;
+  copyScan(reference, slot->reference);
+  copyScan(scan, slot->scan);
+  slot->sequence.store(position + 1, std::memory_order_release);
+  ++accepted_;
+
+  return true;
+}
+
+/* ************************************************************************* */
+void ScanMatchRecorder::copyScan(const struct laser_data* source, ScanRecord& record) const {
+  size_t nrays = std::min<size_t>(std::max(source->nrays, 0), max_rays_);
+  record.nrays = nrays;
+  record.min_theta = source->min_theta;
+  record.max_theta = source->max_theta;
+  std::copy(source->odometry, source->odometry + 3, record.odometry);
+  std::copy(source->estimate, source->estimate + 3, record.estimate);
+  std::copy(source->theta, source->theta + nrays, record.theta.begin());
+  std::copy(source->readings, source->readings + nrays, record.readings.begin());
+  std::copy(source->valid, source->valid + nrays, record.valid.begin());
+}
+
+/* ************************************************************************* */
+void ScanMatchRecorder::writeScan(const ScanRecord& record) {
+  std::fwrite(&record.nrays, sizeof(record.nrays), 1, file_);
+  std::fwrite(&record.min_theta, sizeof(double), 1, file_);
+  std::fwrite(&record.max_theta, sizeof(double), 1, file_);
+  std::fwrite(record.odometry, sizeof(double), 3, file_);
+  std::fwrite(record.estimate, sizeof(double), 3, file_);
+  std::fwrite(record.theta.data(), sizeof(double), record.nrays, file_);
+  std::fwrite(record.readings.data(), sizeof(double), record.nrays, file_);
+  std::fwrite(record.valid.data(), sizeof(int32_t), record.nrays, file_);
+}
+
+/* ************************************************************************* */
+void ScanMatchRecorder::writeRecords() {
+  // Single consumer: drain published slots, and keep draining after shutdown until the ring is empty
+  while(true) {
+    size_t position = dequeue_position_.load(std::memory_order_relaxed);
+    Slot& slot = slots_[position & mask_];
+    size_t sequence = slot.sequence.load(std::memory_order_acquire);
+
+    if(sequence != position + 1) {
+      if(!active_) break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      continue;
+    }
+
+    int64_t stamps[4] = { slot.timestamp1.sec, slot.timestamp1.nsec, slot.timestamp2.sec, slot.timestamp2.nsec };
+    std::fwrite(stamps, sizeof(int64_t), 4, file_);
+    writeScan(slot.reference);
+    writeScan(slot.scan);
+    ++written_;
+
+    // Release the slot to the producers
+    dequeue_position_.store(position + 1, std::memory_order_relaxed);
+    slot.sequence.store(position + mask_ + 1, std::memory_order_release);
+  }
+  std::fflush(file_);
+}
+
+} /// @namespace csm
+
+} /// @namespace mapping
@@ -0,0 +1,166 @@
+/**
+ * scan_matcher.cpp
+ */
+
+#include <aslam_demo/mapping/scan_matcher.h>
+#include <csm_ros/csm_ros.h>
+extern "C" {
+  #include <csm/icp/icp.h>
+}
+#include <boost/lexical_cast.hpp>
+#include <algorithm>
+#include <stdexcept>
+
+namespace mapping {
+
+namespace csm {
+
+/* ************************************************************************* */
+ScanMatcher::ScanMatcher(const gtsam::Pose3& base_T_laser, double laserscan_sigma, size_t cache_size,
+    double covariance_trace_threshold, double initial_guess_error_threshold, double minimum_overlap, double correspondence_distance,
+    CovarianceMode covariance_mode) :
+    base_T_laser_(base_T_laser), laser_T_base_(base_T_laser.inverse()), laserscan_sigma_(laserscan_sigma),
+    cache_size_(std::max<size_t>(cache_size, 2)), covariance_trace_threshold_(covariance_trace_threshold),
+    initial_guess_error_threshold_(initial_guess_error_threshold), minimum_overlap_(minimum_overlap),
+    correspondence_distance_(correspondence_distance), covariance_mode_(covariance_mode), cache_hits_(0), cache_misses_(0) {
+
+  setDefaultParameters(csm_params_);
+  setCovarianceMode(csm_params_, covariance_mode_);
+
+  // Set the laser transformation (and determine if it is inverted)
+  double roll = base_T_laser_.rotation().roll();
+  double pitch = base_T_laser_.rotation().pitch();
+  laser_inverted_ = (roll > 3.0) || (roll < -3.0) || (pitch > 3.0) || (pitch < -3.0);
+  csm_params_.laser[0] = base_T_laser_.x();
+  csm_params_.laser[1] = base_T_laser_.y();
+  csm_params_.laser[2] = base_T_laser_.rotation().yaw();
+}
+
+/* ************************************************************************* */
+ScanMatcher::~ScanMatcher() {
+  clearCache();
+}
+
+/* ************************************************************************* */
+void ScanMatcher::clearCache() {
+  for(std::map<ros::Time, CachedScan>::iterator iter = cache_.begin(); iter != cache_.end(); ++iter) {
+    ld_free(iter->second.data);
+  }
+  cache_.clear();
+  lru_.clear();
+}
+
+/* ************************************************************************* */
+LDP ScanMatcher::acquire(const sensor_msgs::LaserScan& scan, const ros::Time& keep) {
+
+  std::map<ros::Time, CachedScan>::iterator iter = cache_.find(scan.header.stamp);
+  if(iter != cache_.end()) {
+    // Restore the rays invalidated by the previous match and mark as most recently used
+    ++cache_hits_;
+    CachedScan& cached = iter->second;
+    std::copy(cached.valid.begin(), cached.valid.end(), cached.data->valid);
+    lru_.splice(lru_.begin(), lru_, cached.lru);
+    return cached.data;
+  }
+  ++cache_misses_;
+
+  // Evict the least recently used scan, except the one needed by the current match
+  if(cache_.size() >= cache_size_) {
+    std::list<ros::Time>::iterator victim = std::prev(lru_.end());
+    if(*victim == keep) --victim;
+    std::map<ros::Time, CachedScan>::iterator evicted = cache_.find(*victim);
+    ld_free(evicted->second.data);
+    cache_.erase(evicted);
+    lru_.erase(victim);
+  }
+
+  // Convert the ROS laserscan message into a CSM laser structure (Note: This allocates memory)
+  CachedScan& cached = cache_[scan.header.stamp];
+  cached.data = csm_ros::toCsmLaserData(scan, laserscan_sigma_, laser_inverted_);
+  cached.valid.assign(cached.data->valid, cached.data->valid + cached.data->nrays);
+  lru_.push_front(scan.header.stamp);
+  cached.lru = lru_.begin();
+
+  return cached.data;
+}
+
+/* ************************************************************************* */
+RelativePoseEstimate ScanMatcher::match(const sensor_msgs::LaserScan& scan1, const sensor_msgs::LaserScan& scan2,
+    const gtsam::Pose2& initial_pose, ScanMatchRecorder* recorder) {
+
+  if(scan1.header.stamp == scan2.header.stamp) {
+    throw std::runtime_error("Cannot match a scan against itself.");
+  }
+
+  // Transform the initial pose into laserscan coordinates
+  gtsam::Pose2 first_guess;
+  {
+    gtsam::Pose3 map_T_base2 = gtsam::Pose3(gtsam::Rot3::Rz(initial_pose.theta()), gtsam::Point3(initial_pose.x(), initial_pose.y(), 0.0));
+    gtsam::Pose3 delta = laser_T_base_*map_T_base2*base_T_laser_;
+    first_guess = gtsam::Pose2(delta.translation().x(), delta.translation().y(), delta.rotation().yaw());
+  }
+
+  // Look up the CSM laser structures
+  csm_params_.laser_ref  = acquire(scan1, scan2.header.stamp);
+  csm_params_.laser_sens = acquire(scan2, scan1.header.stamp);
+  // Set the min and max allowed laser range
+  csm_params_.min_reading = std::min<double>(scan1.range_min, scan2.range_min);
+  csm_params_.max_reading = std::max<double>(scan1.range_max, scan2.range_max);
+  // Calculate an initial guess based on odometry
+  csm_params_.first_guess[0] = first_guess.x();
+  csm_params_.first_guess[1] = first_guess.y();
+  csm_params_.first_guess[2] = first_guess.theta();
+  // Also write the first guess into the odometry for debugging
+  csm_params_.laser_ref->odometry[0] = 0.0;
+  csm_params_.laser_ref->odometry[1] = 0.0;
+  csm_params_.laser_ref->odometry[2] = 0.0;
+  csm_params_.laser_sens->odometry[0] = csm_params_.first_guess[0];
+  csm_params_.laser_sens->odometry[1] = csm_params_.first_guess[1];
+  csm_params_.laser_sens->odometry[2] = csm_params_.first_guess[2];
+
+  // Use CSM to do the scan matching. In FullCovariance mode, CSM allocates the output covariance matrices on every call.
+  sm_result output;
+  {
+    std::lock_guard<std::mutex> lock(icpMutex());
+    sm_icp(&csm_params_, &output);
+  }
+
+  // If requested, queue the match for asynchronous logging. Failed matches bypass the sampling.
+  if(recorder) {
+    recorder->record(csm_params_.laser_ref, csm_params_.laser_sens, scan1.header.stamp, scan2.header.stamp, !output.valid);
+  }
+
+  // Check if the match was successful
+  if(!output.valid) {
+    throw(std::runtime_error("CSM was unable to find a valid scan match from " + boost::lexical_cast<std::string>(scan1.header.stamp.toSec()) + " to " + boost::lexical_cast<std::string>(scan2.header.stamp.toSec())));
+  }
+
+  // Transform the scan match pose back to robot coordinates
+  gtsam::Pose2 relative_pose;
+  {
+    gtsam::Pose3 map_T_laser2 = gtsam::Pose3(gtsam::Rot3::Rz(output.x[2]), gtsam::Point3(output.x[0], output.x[1], 0.0));
+    gtsam::Pose3 delta = base_T_laser_*map_T_laser2*laser_T_base_;
+    relative_pose = gtsam::Pose2(delta.translation().x(), delta.translation().y(), delta.rotation().yaw());
+  }
+
+  // Create the output object
+  RelativePoseEstimate match;
+  match.timestamp1 = scan1.header.stamp;
+  match.timestamp2 = scan2.header.stamp;
+  match.relative_pose = relative_pose;
+  match.cov = computeMatchCovariance(csm_params_, output, covariance_mode_);
+
+  // Add some error detection
+  double initial_guess_error = initial_pose.localCoordinates(match.relative_pose).norm();
+  if(initial_guess_error > initial_guess_error_threshold_) throw std::runtime_error("Scanmatch deviation from initial guess is too large.");
+  if(match.cov.trace() > covariance_trace_threshold_) throw std::runtime_error("Scanmatch covariance is too large.");
+  if(minimum_overlap_ > 0.0 && computeScanOverlap(match.relative_pose, scan1, scan2, correspondence_distance_, base_T_laser_) < minimum_overlap_) {
+    throw std::runtime_error("Scanmatch overlap is too small.");
+  }
+
+  return match;
+}
+
+} /// @namespace csm
+
+} /// @namespace mapping
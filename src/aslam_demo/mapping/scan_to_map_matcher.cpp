@@ -0,0 +1,200 @@
+/**
+ * scan_to_map_matcher.cpp
+ */
+
+#include <aslam_demo/mapping/scan_to_map_matcher.h>
+#include <aslam_demo/mapping/correlative_scan_matcher.h>
+#include <aslam_demo/mapping/timer.h>
+#include <ros/ros.h>
+#include <algorithm>
+#include <cmath>
+
+namespace mapping {
+
+namespace scan_to_map {
+
+/* ************************************************************************* */
+double ScanToMapMatcher::Level::interpolate(double x, double y, double& dx, double& dy) const {
+  // Values are sampled at the cell centers
+  double u = x - 0.5;
+  double v = y - 0.5;
+  int col = std::floor(u);
+  int row = std::floor(v);
+  double fx = u - col;
+  double fy = v - row;
+
+  double m00 = value(row, col);
+  double m10 = value(row, col + 1);
+  double m01 = value(row + 1, col);
+  double m11 = value(row + 1, col + 1);
+
+  dx = (1.0 - fy)*(m10 - m00) + fy*(m11 - m01);
+  dy = (1.0 - fx)*(m01 - m00) + fx*(m11 - m10);
+  return (1.0 - fy)*((1.0 - fx)*m00 + fx*m10) + fy*((1.0 - fx)*m01 + fx*m11);
+}
+
+/* ************************************************************************* */
+ScanToMapMatcher::ScanToMapMatcher(size_t levels, size_t iterations, double min_score, const gtsam::Pose3& base_T_laser) :
+    level_count_(std::max<size_t>(levels, 1)), iterations_(iterations), min_score_(min_score), base_T_laser_(base_T_laser) {
+}
+
+/* ************************************************************************* */
+void ScanToMapMatcher::setMap(const ProbabilityMap& map) {
+
+  Timer timer;
+  timer.start();
+
+  levels_.resize(level_count_);
+  origin_ = map.origin();
+
+  // Convert the log-odds into occupancy evidence: 0 for free or unknown cells, approaching 1 for occupied cells
+  int rows = map.rows();
+  int cols = map.cols();
+  std::vector<float> evidence(rows*cols);
+  for(int row = 0; row < rows; ++row) {
+    for(int col = 0; col < cols; ++col) {
+      double log_odds = map.logOdds(row, col);
+      evidence[row*cols + col] = (log_odds > 0.0) ? std::tanh(0.5*log_odds) : 0.0;
+    }
+  }
+
+  // The finest level is smoothed with a 3x3 binomial kernel to widen the basin of the gradient
+  Level& finest = levels_[0];
+  finest.rows = rows;
+  finest.cols = cols;
+  finest.cell_size = map.cellSize();
+  finest.values.assign(rows*cols, 0.0f);
+  const float kernel[3] = { 0.25f, 0.5f, 0.25f };
+  for(int row = 0; row < rows; ++row) {
+    for(int col = 0; col < cols; ++col) {
+      float sum = 0.0f;
+      for(int i = -1; i <= 1; ++i) {
+        for(int j = -1; j <= 1; ++j) {
+          int r = std::min(std::max(row + i, 0), rows - 1);
+          int c = std::min(std::max(col + j, 0), cols - 1);
+          sum += kernel[i+1]*kernel[j+1]*evidence[r*cols + c];
+        }
+      }
+      finest.values[row*cols + col] = sum;
+    }
+  }
+
+  // Each coarser level keeps the maximum of a 2x2 block, so thin walls survive the downsampling
+  for(size_t l = 1; l < level_count_; ++l) {
+    const Level& fine = levels_[l-1];
+    Level& coarse = levels_[l];
+    coarse.rows = (fine.rows + 1) / 2;
+    coarse.cols = (fine.cols + 1) / 2;
+    coarse.cell_size = 2.0*fine.cell_size;
+    coarse.values.assign(coarse.rows*coarse.cols, 0.0f);
+    for(int row = 0; row < coarse.rows; ++row) {
+      for(int col = 0; col < coarse.cols; ++col) {
+        float value = std::max(std::max(fine.value(2*row, 2*col), fine.value(2*row, 2*col + 1)),
+                               std::max(fine.value(2*row + 1, 2*col), fine.value(2*row + 1, 2*col + 1)));
+        coarse.values[row*coarse.cols + col] = value;
+      }
+    }
+  }
+
+  timer.stop();
+  ROS_DEBUG_STREAM("Built a " << level_count_ << " level scan matching pyramid from a " << rows << "x" << cols << " map in " << timer.elapsed() << " seconds.");
+}
+
+/* ************************************************************************* */
+double ScanToMapMatcher::evaluate(const Level& level, const std::vector<gtsam::Point2>& points, const gtsam::Pose2& pose, gtsam::Matrix& H, gtsam::Vector& b) const {
+  double c = std::cos(pose.theta());
+  double s = std::sin(pose.theta());
+
+  // Accumulate the normal equations of the residuals 1 - M(S_i(pose))
+  H = gtsam::zeros(3,3);
+  b = gtsam::zero(3);
+  double score = 0.0;
+  for(size_t i = 0; i < points.size(); ++i) {
+    double px = points[i].x();
+    double py = points[i].y();
+    double wx = c*px - s*py + pose.x();
+    double wy = s*px + c*py + pose.y();
+
+    double gx, gy;
+    double value = level.interpolate((wx - origin_.x()) / level.cell_size, (wy - origin_.y()) / level.cell_size, gx, gy);
+    gx /= level.cell_size;
+    gy /= level.cell_size;
+    score += value;
+
+    double residual = 1.0 - value;
+    double J[3] = { gx, gy, gx*(-s*px - c*py) + gy*(c*px - s*py) };
+    for(size_t m = 0; m < 3; ++m) {
+      b(m) += J[m]*residual;
+      for(size_t n = 0; n < 3; ++n) {
+        H(m,n) += J[m]*J[n];
+      }
+    }
+  }
+  return score / points.size();
+}
+
+/* ************************************************************************* */
+double ScanToMapMatcher::optimize(const Level& level, const std::vector<gtsam::Point2>& points, gtsam::Pose2& pose, gtsam::Matrix& hessian) const {
+
+  gtsam::Vector b;
+  double score = evaluate(level, points, pose, hessian, b);
+
+  // The residuals stay large even at the optimum, so plain Gauss-Newton steps overshoot the
+  // narrow peaks of the map. Damp the steps and only keep those that raise the score.
+  double lambda = 1e-3;
+  for(size_t iteration = 0; iteration < iterations_; ++iteration) {
+    gtsam::Matrix damped = hessian;
+    for(size_t i = 0; i < 3; ++i) {
+      damped(i,i) += lambda*hessian(i,i) + 1e-9;
+    }
+    gtsam::Vector delta = damped.inverse()*b;
+    gtsam::Pose2 candidate(pose.x() + delta(0), pose.y() + delta(1), pose.theta() + delta(2));
+
+    gtsam::Matrix candidate_hessian;
+    gtsam::Vector candidate_b;
+    double candidate_score = evaluate(level, points, candidate, candidate_hessian, candidate_b);
+    if(candidate_score > score) {
+      pose = candidate;
+      score = candidate_score;
+      hessian = candidate_hessian;
+      b = candidate_b;
+      lambda = std::max(1e-6, 0.1*lambda);
+      if(std::fabs(delta(0)) < 1e-4 && std::fabs(delta(1)) < 1e-4 && std::fabs(delta(2)) < 1e-4) break;
+    } else {
+      lambda *= 10.0;
+      if(lambda > 1e6) break;
+    }
+  }
+
+  return score;
+}
+
+/* ************************************************************************* */
+bool ScanToMapMatcher::match(const sensor_msgs::LaserScan& scan, const gtsam::Pose2& initial_guess, gtsam::Pose2& pose, gtsam::Matrix& covariance) const {
+  if(levels_.empty()) return false;
+
+  std::vector<gtsam::Point2> points = correlative::scanToPoints(scan, base_T_laser_);
+  if(points.size() < 10) return false;
+
+  // Coarse to fine
+  pose = initial_guess;
+  gtsam::Matrix hessian;
+  double score = 0.0;
+  for(size_t l = levels_.size(); l-- > 0; ) {
+    score = optimize(levels_[l], points, pose, hessian);
+  }
+
+  if(score < min_score_ || std::fabs(hessian.determinant()) < 1e-12) {
+    ROS_DEBUG_STREAM("Scan to map match at " << scan.header.stamp << " rejected. Score: " << score);
+    return false;
+  }
+
+  // Scale the inverse Hessian by the residual variance
+  double residual_variance = std::max(1e-4, (1.0 - score)*(1.0 - score));
+  covariance = residual_variance*hessian.inverse();
+  return true;
+}
+
+} // namespace scan_to_map
+
+} // namespace mapping
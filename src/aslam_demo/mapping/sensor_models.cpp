@@ -236,6 +236,11 @@ LaserScanModel::~LaserScanModel() {
 
 /* ************************************************************************* */
 void LaserScanModel::updateMap(ProbabilityMap& map, const gtsam::Point2& sensor_origin, const gtsam::Point2& laser_return) const {
+  updateMap(map, sensor_origin, laser_return, 0, map.rows());
+}
+
+/* ************************************************************************* */
+void LaserScanModel::updateMap(ProbabilityMap& map, const gtsam::Point2& sensor_origin, const gtsam::Point2& laser_return, int row_begin, int row_end) const {
 
   // Sensor Model (summation):
   // (1) Constant probability (Pfree) between the sensor and (range return - 3*sigma)
@@ -257,6 +262,9 @@ void LaserScanModel::updateMap(ProbabilityMap& map, const gtsam::Point2& sensor_
   // Loop over the line points, calculating which sensor model segments apply
   for(size_t i = 0; i < line.size(); ++i) {
 
+    // Skip cells outside of the requested rows
+    if(line[i].row < row_begin || line[i].row >= row_end) continue;
+
     // Compute the distance from the sensor origin to the edges of this cell
     double distance1 = sensor_origin.distance(line[i].start);
     double distance2 = sensor_origin.distance(line[i].end);
@@ -304,6 +312,20 @@ void LaserScanModel::updateMap(ProbabilityMap& map, const gtsam::Point2& sensor_
 /* ************************************************************************* */
 void LaserScanModel::updateMap(ProbabilityMap& map, const sensor_msgs::LaserScan& scan, const gtsam::Pose2& world_T_base, const gtsam::Pose3& base_T_laser) const {
 
+  // Transform the ranges into points in the world frame
+  gtsam::Point2 sensor_origin;
+  std::vector<gtsam::Point2> range_points = projectScan(scan, world_T_base, base_T_laser, sensor_origin);
+
+  // Update the map
+  for(size_t i = 0; i < range_points.size(); ++i) {
+    // Call the per-point function version
+    updateMap(map, sensor_origin, range_points[i]);
+  }
+}
+
+/* ************************************************************************* */
+std::vector<gtsam::Point2> LaserScanModel::projectScan(const sensor_msgs::LaserScan& scan, const gtsam::Pose2& world_T_base, const gtsam::Pose3& base_T_laser, gtsam::Point2& sensor_origin) const {
+
   // Transform the ranges into points in the laser frame
   /// @todo: The laser_geometry object automatically filters out min and max range points
   laser_geometry::LaserProjection projector;
@@ -315,17 +337,14 @@ void LaserScanModel::updateMap(ProbabilityMap& map, const sensor_msgs::LaserScan
   std::vector<gtsam::Point2> range_points;
   range_points.reserve(cloud.points.size());
   gtsam::Pose3 world_T_laser = gtsam::Pose3(gtsam::Rot3::Rz(world_T_base.theta()), gtsam::Point3(world_T_base.x(), world_T_base.y(), 0)) * base_T_laser;
-  gtsam::Point2 sensor_origin(world_T_laser.x(), world_T_laser.y());
+  sensor_origin = gtsam::Point2(world_T_laser.x(), world_T_laser.y());
   for(size_t i = 0; i < cloud.points.size(); ++i) {
     gtsam::Point3 laser_P_range(cloud.points[i].x, cloud.points[i].y, cloud.points[i].z);
     gtsam::Point3 world_P_range = world_T_laser * laser_P_range;
     range_points.push_back(gtsam::Point2(world_P_range.x(), world_P_range.y()));
   }
-  // Update the map
-  for(size_t i = 0; i < range_points.size(); ++i) {
-    // Call the per-point function version
-    updateMap(map, sensor_origin, range_points[i]);
-  }
+
+  return range_points;
 }
 
 
@@ -0,0 +1,217 @@
+/**
+ * submaps.cpp
+ */
+
+#include <aslam_demo/mapping/submaps.h>
+#include <aslam_demo/mapping/map_processing.h>
+#include <aslam_demo/mapping/timer.h>
+#include <aslam_demo/factors/key_generator.h>
+#include <ros/ros.h>
+#include <boost/foreach.hpp>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace mapping {
+
+namespace submaps {
+
+/* ************************************************************************* */
+SubmapCollection::SubmapCollection(size_t keyframes_per_submap, double submap_radius, double cell_size,
+    size_t tile_size, double scan_sigma, double time_tolerance) :
+    keyframes_per_submap_(std::max<size_t>(keyframes_per_submap, 1)), submap_radius_(submap_radius), cell_size_(cell_size),
+    tile_size_(std::max<size_t>(tile_size, 1)), time_tolerance_(time_tolerance), laser_model_(scan_sigma, false),
+    map_rows_(0), map_cols_(0), map_cell_size_(0.0), tile_rows_(0), tile_cols_(0) {
+}
+
+/* ************************************************************************* */
+void SubmapCollection::insert(const gtsam::Values& values, const LaserScans& scans, const gtsam::Pose3& base_T_laser) {
+
+  // Create a key generator for timestamp <--> key conversions
+  factors::KeyGenerator key_generator(time_tolerance_);
+
+  BOOST_FOREACH(const gtsam::Values::ConstKeyValuePair& key_value, values) {
+    // Only use Pose2 values that have not been fused yet
+    if(key_generator.extractKeyType(key_value.key) != factors::key_type::Pose2) continue;
+    if(assigned_keys_.count(key_value.key)) continue;
+
+    // Find the laserscan closest to the pose timestamp. findMapScan only answers once a scan past the tolerance
+    // window exists, so keys without a scan are retried until then; after that, the pose was not a keyframe.
+    ros::Time timestamp = key_generator.computeQuantizedTimestamp(key_generator.extractTimestamp(key_value.key));
+    const sensor_msgs::LaserScan* scan = map::findMapScan(scans, timestamp, time_tolerance_);
+    if(!scan) {
+      if(!scans.empty() && timestamp + ros::Duration(time_tolerance_) < scans.rbegin()->first) assigned_keys_.insert(key_value.key);
+      continue;
+    }
+    assigned_keys_.insert(key_value.key);
+
+    // Start a new submap anchored at this keyframe if needed
+    if(submaps_.empty() || submaps_.back()->finished) {
+      Submap::shared_ptr submap(new Submap());
+      size_t cells = std::ceil(2.0 * submap_radius_ / cell_size_);
+      submap->anchor = key_value.key;
+      submap->map = ProbabilityMap(cells, cells, cell_size_, gtsam::Point2(-submap_radius_, -submap_radius_));
+      submap->keyframes = 0;
+      submap->finished = false;
+      submap->modified = false;
+      submap->placed = false;
+      submaps_.push_back(submap);
+    }
+    Submap& submap = *submaps_.back();
+
+    // Fuse the scan in the anchor frame
+    const gtsam::Pose2& world_T_anchor = values.at<gtsam::Pose2>(submap.anchor);
+    const gtsam::Pose2& world_T_base = static_cast<const gtsam::Pose2&>(key_value.value);
+    laser_model_.updateMap(submap.map, *scan, world_T_anchor.between(world_T_base), base_T_laser);
+    submap.modified = true;
+
+    // Close the submap once it is full, releasing the unused area
+    if(++submap.keyframes >= keyframes_per_submap_) {
+      submap.finished = true;
+      submap.map.shrinkToFit();
+    }
+  }
+}
+
+/* ************************************************************************* */
+void SubmapCollection::compose(ProbabilityMap& map, const gtsam::Values& values, double pose_tolerance) {
+
+  Timer timer;
+  timer.start();
+
+  std::vector<char> dirty_tiles;
+
+  // A change in the global map geometry invalidates every placement
+  if(map.rows() != map_rows_ || map.cols() != map_cols_ || map.cellSize() != map_cell_size_ || !map.origin().equals(map_origin_, 1e-9)) {
+    map_rows_ = map.rows();
+    map_cols_ = map.cols();
+    map_cell_size_ = map.cellSize();
+    map_origin_ = map.origin();
+    tile_rows_ = (map_rows_ + tile_size_ - 1) / tile_size_;
+    tile_cols_ = (map_cols_ + tile_size_ - 1) / tile_size_;
+    tile_submaps_.assign(tile_rows_*tile_cols_, std::vector<size_t>());
+    BOOST_FOREACH(const Submap::shared_ptr& submap, submaps_) {
+      submap->placed = false;
+      submap->placed_tiles.clear();
+    }
+    dirty_tiles.assign(tile_rows_*tile_cols_, 1);
+  } else {
+    dirty_tiles.assign(tile_rows_*tile_cols_, 0);
+  }
+
+  // Update the placement of every moved or modified submap
+  size_t moved_submaps = 0;
+  for(size_t i = 0; i < submaps_.size(); ++i) {
+    Submap& submap = *submaps_[i];
+    gtsam::Pose2 world_T_anchor = values.exists(submap.anchor) ? values.at<gtsam::Pose2>(submap.anchor) : submap.placed_pose;
+    bool moved = !submap.placed || !world_T_anchor.equals(submap.placed_pose, pose_tolerance);
+    if(!moved && !submap.modified) continue;
+    ++moved_submaps;
+
+    // Remove the previous footprint
+    BOOST_FOREACH(size_t tile, submap.placed_tiles) {
+      dirty_tiles[tile] = 1;
+      std::vector<size_t>& overlapping = tile_submaps_[tile];
+      overlapping.erase(std::remove(overlapping.begin(), overlapping.end(), i), overlapping.end());
+    }
+
+    // Add the new footprint
+    submap.placed_tiles = computeTiles(submap, world_T_anchor, map);
+    BOOST_FOREACH(size_t tile, submap.placed_tiles) {
+      dirty_tiles[tile] = 1;
+      tile_submaps_[tile].push_back(i);
+    }
+    submap.placed_pose = world_T_anchor;
+    submap.placed = true;
+    submap.modified = false;
+  }
+
+  // Recompute the affected tiles
+  size_t recomposed_tiles = 0;
+  for(size_t tile = 0; tile < dirty_tiles.size(); ++tile) {
+    if(dirty_tiles[tile]) {
+      composeTile(map, tile);
+      ++recomposed_tiles;
+    }
+  }
+
+  timer.stop();
+  ROS_DEBUG_STREAM("Composed " << moved_submaps << " of " << submaps_.size() << " submaps into " << recomposed_tiles
+      << " of " << dirty_tiles.size() << " map tiles in " << timer.elapsed() << " seconds.");
+}
+
+/* ************************************************************************* */
+void SubmapCollection::clear() {
+  submaps_.clear();
+  assigned_keys_.clear();
+  tile_submaps_.assign(tile_rows_*tile_cols_, std::vector<size_t>());
+}
+
+/* ************************************************************************* */
+std::vector<size_t> SubmapCollection::computeTiles(const Submap& submap, const gtsam::Pose2& world_T_anchor, const ProbabilityMap& map) const {
+
+  // Transform the corners of the submap into the global map frame
+  const gtsam::Point2& origin = submap.map.origin();
+  double width = submap.map.cols() * submap.map.cellSize();
+  double height = submap.map.rows() * submap.map.cellSize();
+  gtsam::Point2 corners[4] = { origin, origin + gtsam::Point2(width, 0.0), origin + gtsam::Point2(0.0, height), origin + gtsam::Point2(width, height) };
+
+  double x_min = +std::numeric_limits<double>::max();
+  double x_max = -std::numeric_limits<double>::max();
+  double y_min = +std::numeric_limits<double>::max();
+  double y_max = -std::numeric_limits<double>::max();
+  for(size_t i = 0; i < 4; ++i) {
+    gtsam::Point2 corner = map.fromWorld(world_T_anchor.transform_from(corners[i]));
+    x_min = std::min(x_min, corner.x());
+    x_max = std::max(x_max, corner.x());
+    y_min = std::min(y_min, corner.y());
+    y_max = std::max(y_max, corner.y());
+  }
+
+  // Clip the bounding box to the map and convert it to a tile range
+  std::vector<size_t> tiles;
+  if(x_max < 0 || y_max < 0 || x_min >= map.cols() || y_min >= map.rows()) return tiles;
+  int col_min = std::max(0, (int)std::floor(x_min)) / tile_size_;
+  int col_max = std::min((int)map.cols() - 1, (int)std::floor(x_max)) / tile_size_;
+  int row_min = std::max(0, (int)std::floor(y_min)) / tile_size_;
+  int row_max = std::min((int)map.rows() - 1, (int)std::floor(y_max)) / tile_size_;
+  for(int row = row_min; row <= row_max; ++row) {
+    for(int col = col_min; col <= col_max; ++col) {
+      tiles.push_back(row*tile_cols_ + col);
+    }
+  }
+
+  return tiles;
+}
+
+/* ************************************************************************* */
+void SubmapCollection::composeTile(ProbabilityMap& map, size_t tile) const {
+
+  int row_begin = (tile / tile_cols_) * tile_size_;
+  int col_begin = (tile % tile_cols_) * tile_size_;
+  int row_end = std::min<int>(row_begin + tile_size_, map.rows());
+  int col_end = std::min<int>(col_begin + tile_size_, map.cols());
+  const std::vector<size_t>& overlapping = tile_submaps_[tile];
+
+  for(int row = row_begin; row < row_end; ++row) {
+    for(int col = col_begin; col < col_end; ++col) {
+      // Sum the log-odds of every submap at the cell center
+      gtsam::Point2 world = map.toWorld(gtsam::Point2(col + 0.5, row + 0.5));
+      double log_odds = 0.0;
+      BOOST_FOREACH(size_t i, overlapping) {
+        const Submap& submap = *submaps_[i];
+        gtsam::Point2 local = submap.map.fromWorld(submap.placed_pose.transform_to(world));
+        int local_row = std::floor(local.y());
+        int local_col = std::floor(local.x());
+        if(submap.map.inside(local_row, local_col)) {
+          log_odds += submap.map.logOdds(local_row, local_col);
+        }
+      }
+      map.setLogOdds(row, col, log_odds);
+    }
+  }
+}
+
+} // namespace submaps
+
+} // namespace mapping